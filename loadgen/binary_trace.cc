@@ -0,0 +1,321 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "binary_trace.h"
+
+namespace mlperf {
+
+using binary_trace::ArgType;
+using binary_trace::RecordType;
+
+void BinaryTraceWriter::Start(std::ostream* out) {
+  out_ = out;
+  buffer_.clear();
+  buffer_.reserve(kWriteThreshold + 4096);
+  string_ids_.clear();
+  string_table_ = 0;
+  buffer_.insert(buffer_.end(), binary_trace::kMagic,
+                 binary_trace::kMagic + binary_trace::kMagicSize);
+  AppendUnsigned(binary_trace::kVersion);
+}
+
+void BinaryTraceWriter::Finish() {
+  buffer_.push_back(static_cast<char>(RecordType::End));
+  WriteBuffer();
+  out_->flush();
+  out_ = nullptr;
+  string_ids_.clear();
+  std::vector<char>().swap(buffer_);
+}
+
+void BinaryTraceWriter::StartFragment() {
+  out_ = nullptr;
+  buffer_.clear();
+  string_ids_.clear();
+  string_table_ = 0;
+}
+
+void BinaryTraceWriter::AppendFragment(uint64_t string_table,
+                                       BinaryTraceWriter* fragment) {
+  if (fragment->buffer_.empty()) {
+    return;
+  }
+  SelectStringTable(string_table);
+  buffer_.insert(buffer_.end(), fragment->buffer_.begin(),
+                 fragment->buffer_.end());
+  fragment->buffer_.clear();
+  EndRecord();
+}
+
+void BinaryTraceWriter::SelectStringTable(uint64_t string_table) {
+  buffer_.push_back(static_cast<char>(RecordType::StringTable));
+  AppendUnsigned(string_table);
+  string_table_ = string_table;
+}
+
+void BinaryTraceWriter::WriteBuffer() {
+  out_->write(buffer_.data(), buffer_.size());
+  buffer_.clear();
+}
+
+uint64_t BinaryTraceWriter::Intern(const std::string& s) {
+  auto inserted = string_ids_.emplace(s, string_ids_.size());
+  uint64_t id = inserted.first->second;
+  if (inserted.second) {
+    buffer_.push_back(static_cast<char>(RecordType::String));
+    AppendUnsigned(id);
+    AppendUnsigned(s.size());
+    buffer_.insert(buffer_.end(), s.begin(), s.end());
+  }
+  return id;
+}
+
+void BinaryTraceWriter::AppendArgValue(double value) {
+  AppendType(ArgType::Double);
+  uint64_t bits;
+  static_assert(sizeof(bits) == sizeof(value), "Unexpected double size.");
+  std::memcpy(&bits, &value, sizeof(bits));
+  for (int i = 0; i < 8; i++) {
+    buffer_.push_back(static_cast<char>(bits >> (i * 8)));
+  }
+}
+
+void BinaryTraceWriter::AppendArgValue(const std::string& value) {
+  AppendType(ArgType::Raw);
+  AppendUnsigned(value.size());
+  buffer_.insert(buffer_.end(), value.begin(), value.end());
+}
+
+void WriteChromeTraceJsonHeader(std::ostream* out) {
+  *out << "{ \"traceEvents\": [\n";
+}
+
+void WriteChromeTraceJsonFooter(std::ostream* out) {
+  *out << "{ \"name\": \"LastTrace\" }\n"
+       << "],\n"
+       << "\"displayTimeUnit\": \"ns\",\n"
+       << "\"otherData\": {\n"
+       << "\"version\": \"MLPerf LoadGen v0.5a0\"\n"
+       << "}\n"
+       << "}\n";
+}
+
+namespace {
+
+class BinaryTraceReader {
+ public:
+  explicit BinaryTraceReader(std::istream* in) : in_(in) {}
+
+  bool ok() const { return ok_; }
+
+  uint8_t ReadByte() {
+    int c = in_->get();
+    if (c == std::char_traits<char>::eof()) {
+      ok_ = false;
+      return 0;
+    }
+    return static_cast<uint8_t>(c);
+  }
+
+  uint64_t ReadUnsigned() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64 && ok_; shift += 7) {
+      uint8_t b = ReadByte();
+      value |= static_cast<uint64_t>(b & 0x7F) << shift;
+      if ((b & 0x80) == 0) {
+        return value;
+      }
+    }
+    ok_ = false;
+    return 0;
+  }
+
+  int64_t ReadSigned() {
+    uint64_t zigzag = ReadUnsigned();
+    return static_cast<int64_t>(zigzag >> 1) ^
+           -static_cast<int64_t>(zigzag & 1);
+  }
+
+  double ReadDouble() {
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; i++) {
+      bits |= static_cast<uint64_t>(ReadByte()) << (i * 8);
+    }
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+
+  std::string ReadBytes(size_t size) {
+    std::string s(size, '\0');
+    in_->read(&s[0], size);
+    if (static_cast<size_t>(in_->gcount()) != size) {
+      ok_ = false;
+    }
+    return s;
+  }
+
+  const std::string& ReadStringRef() {
+    uint64_t id = ReadUnsigned();
+    if (id >= strings_->size()) {
+      ok_ = false;
+      return empty_;
+    }
+    return (*strings_)[id];
+  }
+
+  void ReadStringRecord() {
+    uint64_t id = ReadUnsigned();
+    uint64_t size = ReadUnsigned();
+    if (!ok_ || id > strings_->size()) {
+      ok_ = false;
+      return;
+    }
+    if (id == strings_->size()) {
+      strings_->push_back(ReadBytes(size));
+    } else {
+      (*strings_)[id] = ReadBytes(size);
+    }
+  }
+
+  void ReadStringTableRecord() { strings_ = &string_tables_[ReadUnsigned()]; }
+
+  // Mirrors AsyncLog::LogArgs.
+  void ReadArgs(std::ostream* out) {
+    uint64_t count = ReadUnsigned();
+    for (uint64_t i = 0; i < count && ok_; i++) {
+      if (i != 0) {
+        *out << ", ";
+      }
+      *out << "\"" << ReadStringRef() << "\" : ";
+      ArgType type = static_cast<ArgType>(ReadByte());
+      switch (type) {
+        case ArgType::Unsigned:
+          *out << ReadUnsigned();
+          break;
+        case ArgType::Signed:
+          *out << ReadSigned();
+          break;
+        case ArgType::Double:
+          *out << ReadDouble();
+          break;
+        case ArgType::Bool:
+          *out << (ReadUnsigned() ? "true" : "false");
+          break;
+        case ArgType::Raw:
+          *out << ReadBytes(ReadUnsigned());
+          break;
+        default:
+          ok_ = false;
+      }
+    }
+  }
+
+ private:
+  std::istream* in_;
+  bool ok_ = true;
+  std::unordered_map<uint64_t, std::vector<std::string>> string_tables_;
+  std::vector<std::string>* strings_ = &string_tables_[0];
+  const std::string empty_;
+};
+
+}  // namespace
+
+bool ConvertBinaryTraceToJson(std::istream* in, std::ostream* out) {
+  BinaryTraceReader reader(in);
+  std::string magic = reader.ReadBytes(binary_trace::kMagicSize);
+  if (!reader.ok() || magic != binary_trace::kMagic ||
+      reader.ReadUnsigned() != binary_trace::kVersion) {
+    return false;
+  }
+
+  // The record layouts below must stay in sync with BinaryTraceWriter and
+  // the JSON must stay in sync with AsyncLog.
+  WriteChromeTraceJsonHeader(out);
+  while (reader.ok()) {
+    RecordType type = static_cast<RecordType>(reader.ReadByte());
+    if (!reader.ok()) {
+      break;
+    }
+    switch (type) {
+      case RecordType::String: {
+        reader.ReadStringRecord();
+        break;
+      }
+      case RecordType::StringTable: {
+        reader.ReadStringTableRecord();
+        break;
+      }
+      case RecordType::Complete: {
+        const std::string& name = reader.ReadStringRef();
+        const std::string& pid_tid = reader.ReadStringRef();
+        int64_t ts = reader.ReadSigned();
+        int64_t dur = reader.ReadSigned();
+        *out << "{ \"name\": \"" << name << "\", "
+             << "\"ph\": \"X\", " << pid_tid << "\"ts\": " << ts << ", "
+             << "\"dur\": " << dur << ", "
+             << "\"args\": { ";
+        reader.ReadArgs(out);
+        *out << " }},\n";
+        break;
+      }
+      case RecordType::AsyncInstant: {
+        const std::string& name = reader.ReadStringRef();
+        const std::string& pid_tid = reader.ReadStringRef();
+        uint64_t id = reader.ReadUnsigned();
+        int64_t ts = reader.ReadSigned();
+        *out << "{\"name\": \"" << name << "\", "
+             << "\"cat\": \"default\", "
+             << "\"ph\": \"n\", "
+             << "\"id\": " << id << ", " << pid_tid << "\"ts\": " << ts
+             << ", "
+             << "\"args\": { ";
+        reader.ReadArgs(out);
+        *out << " }},\n";
+        break;
+      }
+      case RecordType::AsyncSpan: {
+        const std::string& name = reader.ReadStringRef();
+        const std::string& pid_tid = reader.ReadStringRef();
+        uint64_t id = reader.ReadUnsigned();
+        int64_t ts = reader.ReadSigned();
+        int64_t dur = reader.ReadSigned();
+        *out << "{\"name\": \"" << name << "\", "
+             << "\"cat\": \"default\", "
+             << "\"ph\": \"b\", "
+             << "\"id\": " << id << ", " << pid_tid << "\"ts\": " << ts
+             << ", "
+             << "\"args\": { ";
+        reader.ReadArgs(out);
+        *out << " }},\n";
+        *out << "{ \"name\": \"" << name << "\", "
+             << "\"cat\": \"default\", "
+             << "\"ph\": \"e\", "
+             << "\"id\": " << id << ", " << pid_tid
+             << "\"ts\": " << ts + dur << " },\n";
+        break;
+      }
+      case RecordType::End: {
+        WriteChromeTraceJsonFooter(out);
+        return reader.ok();
+      }
+      default:
+        return false;
+    }
+  }
+  // A truncated trace, e.g. from a crashed run. Close the JSON anyway so
+  // whatever was recorded can still be viewed.
+  WriteChromeTraceJsonFooter(out);
+  return false;
+}
+
+}  // namespace mlperf
@@ -0,0 +1,242 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Implements a compact binary encoding of the trace, which is much cheaper
+// for the IOThread to produce than Chrome trace JSON.
+//
+// File layout:
+//   Header:  The 8 byte magic "MLPTRACE", followed by a varint version.
+//   Records: A 1 byte RecordType followed by the type's fields, in order:
+//     String:       id, length, <length bytes>
+//     Complete:     name, pid_tid, ts, dur, args
+//     AsyncInstant: name, pid_tid, id, ts, args
+//     AsyncSpan:    name, pid_tid, id, ts, dur, args
+//     StringTable:  index
+//     End:          <no fields>
+//   args:    count, followed by count * (key, ArgType, value).
+//
+// All integers are LEB128 varints; ts, dur, and signed args are zigzag
+// encoded first.
+// Doubles are 8 little-endian bytes.
+// name, pid_tid, and key are ids into a string table built from the String
+// records, each of which precedes the first record that references it.
+// Records use string table 0 until a StringTable record selects another one.
+// This lets fragments serialized on different threads be concatenated
+// without agreeing on string ids. A String record may redefine an id.
+// Timestamps are in nanoseconds relative to the start of the trace.
+// String arg values are pre-formatted JSON and are emitted verbatim.
+//
+// Use the binary_trace_to_json tool to convert a trace to Chrome trace JSON,
+// which can be loaded by chrome://tracing or Perfetto.
+
+#ifndef MLPERF_LOADGEN_BINARY_TRACE_H_
+#define MLPERF_LOADGEN_BINARY_TRACE_H_
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+namespace mlperf {
+
+namespace binary_trace {
+
+constexpr char kMagic[] = "MLPTRACE";
+constexpr size_t kMagicSize = sizeof(kMagic) - 1;
+constexpr uint64_t kVersion = 1;
+
+enum class RecordType : uint8_t {
+  String = 1,
+  Complete = 2,
+  AsyncInstant = 3,
+  AsyncSpan = 4,
+  End = 5,
+  StringTable = 6,
+};
+
+enum class ArgType : uint8_t {
+  Unsigned = 1,
+  Signed = 2,
+  Double = 3,
+  Bool = 4,
+  Raw = 5,
+};
+
+}  // namespace binary_trace
+
+// Encodes trace events into a large in-memory buffer that is only written
+// to the output stream once it's full or the trace is finished.
+class BinaryTraceWriter {
+ public:
+  void Start(std::ostream* out);
+  void Finish();
+  void WriteBuffer();
+
+  // A fragment has no header and is never written to a stream directly.
+  // Instead, its records are moved into a started trace by AppendFragment.
+  void StartFragment();
+  // Appends the records of |fragment| using |string_table|, which must be
+  // unique to |fragment| for the lifetime of the fragment's string table.
+  void AppendFragment(uint64_t string_table, BinaryTraceWriter* fragment);
+
+  template <typename... Args>
+  void WriteComplete(const std::string& name, const std::string& pid_tid,
+                     int64_t ts, int64_t dur, const Args&... args) {
+    BeginRecord(binary_trace::RecordType::Complete, name, pid_tid, args...);
+    AppendSigned(ts);
+    AppendSigned(dur);
+    AppendArgs(args...);
+    EndRecord();
+  }
+
+  template <typename... Args>
+  void WriteAsyncInstant(const std::string& name, const std::string& pid_tid,
+                         uint64_t id, int64_t ts, const Args&... args) {
+    BeginRecord(binary_trace::RecordType::AsyncInstant, name, pid_tid,
+                args...);
+    AppendUnsigned(id);
+    AppendSigned(ts);
+    AppendArgs(args...);
+    EndRecord();
+  }
+
+  template <typename... Args>
+  void WriteAsyncSpan(const std::string& name, const std::string& pid_tid,
+                      uint64_t id, int64_t ts, int64_t dur,
+                      const Args&... args) {
+    BeginRecord(binary_trace::RecordType::AsyncSpan, name, pid_tid, args...);
+    AppendUnsigned(id);
+    AppendSigned(ts);
+    AppendSigned(dur);
+    AppendArgs(args...);
+    EndRecord();
+  }
+
+ private:
+  // The string table must be updated before any bytes of the record that
+  // references it are written, so all the strings are interned up front.
+  template <typename... Args>
+  void BeginRecord(binary_trace::RecordType type, const std::string& name,
+                   const std::string& pid_tid, const Args&... args) {
+    if (string_table_ != 0) {
+      SelectStringTable(0);
+    }
+    name_id_ = Intern(name);
+    pid_tid_id_ = Intern(pid_tid);
+    InternArgKeys(args...);
+    buffer_.push_back(static_cast<char>(type));
+    AppendUnsigned(name_id_);
+    AppendUnsigned(pid_tid_id_);
+  }
+
+  void EndRecord() {
+    if (out_ && buffer_.size() >= kWriteThreshold) {
+      WriteBuffer();
+    }
+  }
+
+  uint64_t Intern(const std::string& s);
+  void SelectStringTable(uint64_t string_table);
+
+  void InternArgKeys() {}
+
+  template <typename T, typename... Args>
+  void InternArgKeys(const std::string& key, const T&, const Args&... args) {
+    arg_key_ids_.push_back(Intern(key));
+    InternArgKeys(args...);
+  }
+
+  template <typename... Args>
+  void AppendArgs(const Args&... args) {
+    static_assert(sizeof...(args) % 2 == 0,
+                  "Trace args must be key/value pairs.");
+    AppendUnsigned(sizeof...(args) / 2);
+    AppendArgPairs(0, args...);
+    arg_key_ids_.clear();
+  }
+
+  void AppendArgPairs(size_t) {}
+
+  template <typename T, typename... Args>
+  void AppendArgPairs(size_t i, const std::string&, const T& value,
+                      const Args&... args) {
+    AppendUnsigned(arg_key_ids_[i]);
+    AppendArgValue(value);
+    AppendArgPairs(i + 1, args...);
+  }
+
+  void AppendArgValue(bool value) {
+    AppendType(binary_trace::ArgType::Bool);
+    AppendUnsigned(value ? 1 : 0);
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value &&
+                          std::is_signed<T>::value>::type
+  AppendArgValue(T value) {
+    AppendType(binary_trace::ArgType::Signed);
+    AppendSigned(value);
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value &&
+                          std::is_unsigned<T>::value>::type
+  AppendArgValue(T value) {
+    AppendType(binary_trace::ArgType::Unsigned);
+    AppendUnsigned(value);
+  }
+
+  void AppendArgValue(double value);
+  void AppendArgValue(const std::string& value);
+  void AppendArgValue(const char* value) { AppendArgValue(std::string(value)); }
+
+  void AppendType(binary_trace::ArgType type) {
+    buffer_.push_back(static_cast<char>(type));
+  }
+
+  void AppendUnsigned(uint64_t value) {
+    while (value >= 0x80) {
+      buffer_.push_back(static_cast<char>((value & 0x7F) | 0x80));
+      value >>= 7;
+    }
+    buffer_.push_back(static_cast<char>(value));
+  }
+
+  void AppendSigned(int64_t value) {
+    AppendUnsigned((static_cast<uint64_t>(value) << 1) ^
+                   static_cast<uint64_t>(value >> 63));
+  }
+
+  static constexpr size_t kWriteThreshold = 1024 * 1024;
+
+  std::ostream* out_ = nullptr;
+  std::vector<char> buffer_;
+  std::unordered_map<std::string, uint64_t> string_ids_;
+  uint64_t string_table_ = 0;
+  uint64_t name_id_ = 0;
+  uint64_t pid_tid_id_ = 0;
+  std::vector<uint64_t> arg_key_ids_;
+};
+
+// Converts a binary trace to Chrome trace JSON.
+// Returns false if |in| isn't a valid binary trace.
+bool ConvertBinaryTraceToJson(std::istream* in, std::ostream* out);
+
+void WriteChromeTraceJsonHeader(std::ostream* out);
+void WriteChromeTraceJsonFooter(std::ostream* out);
+
+}  // namespace mlperf
+
+#endif  // MLPERF_LOADGEN_BINARY_TRACE_H_
@@ -15,12 +15,14 @@ limitations under the License.
 
 #include <functional>
 
+#include "../live_metrics.h"
 #include "../loadgen.h"
 #include "../query_sample.h"
 #include "../query_sample_library.h"
 #include "../system_under_test.h"
 #include "../test_settings.h"
 #include "pybind11/functional.h"
+#include "pybind11/numpy.h"
 #include "pybind11/pybind11.h"
 #include "pybind11/stl.h"
 #include "pybind11/stl_bind.h"
@@ -32,6 +34,18 @@ namespace {
 using IssueQueryCallback = std::function<void(std::vector<QuerySample>)>;
 using FlushQueriesCallback = std::function<void()>;
 using ReportLatencyResultsCallback = std::function<void(std::vector<int64_t>)>;
+using ReportLatencyDetailsCallback = std::function<void(pybind11::dict)>;
+
+// A read-only numpy array over |data| that doesn't copy or own it.
+template <typename T>
+pybind11::array_t<T> ReadOnlyView(const T* data, size_t size) {
+  // With a base object, numpy uses |data| in place rather than copying it.
+  pybind11::capsule no_owner(data, [](void*) {});
+  pybind11::array_t<T> view(static_cast<pybind11::ssize_t>(size), data,
+                            no_owner);
+  view.attr("setflags")(pybind11::arg("write") = false);
+  return view;
+}
 
 // Forwards SystemUnderTest calls to relevant callbacks.
 class SystemUnderTestTrampoline : public SystemUnderTest {
@@ -39,11 +53,13 @@ class SystemUnderTestTrampoline : public SystemUnderTest {
   SystemUnderTestTrampoline(
       std::string name, IssueQueryCallback issue_cb,
       FlushQueriesCallback flush_queries_cb,
-      ReportLatencyResultsCallback report_latency_results_cb)
+      ReportLatencyResultsCallback report_latency_results_cb,
+      ReportLatencyDetailsCallback report_latency_details_cb)
       : name_(std::move(name)),
         issue_cb_(issue_cb),
         flush_queries_cb_(flush_queries_cb),
-        report_latency_results_cb_(report_latency_results_cb) {}
+        report_latency_results_cb_(report_latency_results_cb),
+        report_latency_details_cb_(report_latency_details_cb) {}
   ~SystemUnderTestTrampoline() override = default;
 
   const std::string& Name() const override { return name_; }
@@ -55,17 +71,42 @@ class SystemUnderTestTrampoline : public SystemUnderTest {
 
   void FlushQueries() override { flush_queries_cb_(); }
 
+  // Passing None for the callback opts out of the raw latencies.
+  bool WantsLatencyResults() const override {
+    return static_cast<bool>(report_latency_results_cb_);
+  }
+
   void ReportLatencyResults(
       const std::vector<QuerySampleLatency>& latencies_ns) override {
     pybind11::gil_scoped_acquire gil_acquirer;
     report_latency_results_cb_(latencies_ns);
   }
 
+  bool WantsLatencyDetails() const override {
+    return static_cast<bool>(report_latency_details_cb_);
+  }
+
+  // The arrays are views of the loadgen's buffers, so they must not be used
+  // after the callback returns. Copy them to keep them.
+  void ReportLatencyDetails(const LatencyReport& report) override {
+    pybind11::gil_scoped_acquire gil_acquirer;
+    const size_t n = report.sample_count;
+    pybind11::dict details;
+    details["sequence_ids"] = ReadOnlyView(report.sequence_ids, n);
+    details["sample_indices"] = ReadOnlyView(report.sample_indices, n);
+    details["scheduled_ns"] = ReadOnlyView(report.scheduled_ns, n);
+    details["issued_ns"] = ReadOnlyView(report.issued_ns, n);
+    details["completed_ns"] = ReadOnlyView(report.completed_ns, n);
+    details["latencies_ns"] = ReadOnlyView(report.latencies_ns, n);
+    report_latency_details_cb_(details);
+  }
+
  private:
   std::string name_;
   IssueQueryCallback issue_cb_;
   FlushQueriesCallback flush_queries_cb_;
   ReportLatencyResultsCallback report_latency_results_cb_;
+  ReportLatencyDetailsCallback report_latency_details_cb_;
 };
 
 using LoadSamplesToRamCallback =
@@ -116,9 +157,11 @@ namespace py {
 
 uintptr_t ConstructSUT(IssueQueryCallback issue_cb,
                        FlushQueriesCallback flush_queries_cb,
-                       ReportLatencyResultsCallback report_latency_results_cb) {
+                       ReportLatencyResultsCallback report_latency_results_cb,
+                       ReportLatencyDetailsCallback report_latency_details_cb) {
   SystemUnderTestTrampoline* sut = new SystemUnderTestTrampoline(
-      "PySUT", issue_cb, flush_queries_cb, report_latency_results_cb);
+      "PySUT", issue_cb, flush_queries_cb, report_latency_results_cb,
+      report_latency_details_cb);
   return reinterpret_cast<uintptr_t>(sut);
 }
 
@@ -213,6 +256,28 @@ PYBIND11_MODULE(mlperf_loadgen, m) {
       .def_readwrite("max_duration_ms", &TestSettings::max_duration_ms)
       .def_readwrite("min_query_count", &TestSettings::min_query_count)
       .def_readwrite("max_query_count", &TestSettings::max_query_count)
+      .def_readwrite("warmup_duration_ms", &TestSettings::warmup_duration_ms)
+      .def_readwrite("warmup_query_count", &TestSettings::warmup_query_count)
+      .def_readwrite("calibrate_expected_performance",
+                     &TestSettings::calibrate_expected_performance)
+      .def_readwrite("calibration_duration_ms",
+                     &TestSettings::calibration_duration_ms)
+      .def_readwrite("accuracy_double_buffered_loading",
+                     &TestSettings::accuracy_double_buffered_loading)
+      .def_readwrite("exact_latency_percentiles",
+                     &TestSettings::exact_latency_percentiles)
+      .def_readwrite("early_termination", &TestSettings::early_termination)
+      .def_readwrite("early_termination_confidence",
+                     &TestSettings::early_termination_confidence)
+      .def_readwrite("fail_fast", &TestSettings::fail_fast)
+      .def_readwrite("peak_performance_probe_duration_ms",
+                     &TestSettings::peak_performance_probe_duration_ms)
+      .def_readwrite("peak_performance_tolerance",
+                     &TestSettings::peak_performance_tolerance)
+      .def_readwrite("peak_performance_min_load",
+                     &TestSettings::peak_performance_min_load)
+      .def_readwrite("peak_performance_max_load",
+                     &TestSettings::peak_performance_max_load)
       .def_readwrite("qsl_rng_seed", &TestSettings::qsl_rng_seed)
       .def_readwrite("sample_index_rng_seed",
                      &TestSettings::sample_index_rng_seed)
@@ -223,6 +288,15 @@ PYBIND11_MODULE(mlperf_loadgen, m) {
       .value("EndOfTestOnly", LoggingMode::EndOfTestOnly)
       .value("Synchronous", LoggingMode::Synchronous);
 
+  pybind11::enum_<TraceFormat>(m, "TraceFormat")
+      .value("ChromeJson", TraceFormat::ChromeJson)
+      .value("Binary", TraceFormat::Binary);
+
+  pybind11::enum_<LogSinkType>(m, "LogSinkType")
+      .value("Stream", LogSinkType::Stream)
+      .value("LargeBlock", LogSinkType::LargeBlock)
+      .value("Direct", LogSinkType::Direct);
+
   pybind11::class_<LogOutputSettings>(m, "LogOutputSettings")
       .def(pybind11::init<>())
       .def_readwrite("outdir", &LogOutputSettings::outdir)
@@ -233,7 +307,15 @@ PYBIND11_MODULE(mlperf_loadgen, m) {
       .def_readwrite("copy_detail_to_stdout",
                      &LogOutputSettings::copy_detail_to_stdout)
       .def_readwrite("copy_summary_to_stdout",
-                     &LogOutputSettings::copy_summary_to_stdout);
+                     &LogOutputSettings::copy_summary_to_stdout)
+      .def_readwrite("summary_sink", &LogOutputSettings::summary_sink)
+      .def_readwrite("detail_sink", &LogOutputSettings::detail_sink)
+      .def_readwrite("accuracy_sink", &LogOutputSettings::accuracy_sink)
+      .def_readwrite("trace_sink", &LogOutputSettings::trace_sink)
+      .def_readwrite("time_series_sink",
+                     &LogOutputSettings::time_series_sink)
+      .def_readwrite("latency_export_sink",
+                     &LogOutputSettings::latency_export_sink);
 
   pybind11::class_<LogSettings>(m, "LogSettings")
       .def(pybind11::init<>())
@@ -241,7 +323,55 @@ PYBIND11_MODULE(mlperf_loadgen, m) {
       .def_readwrite("log_mode", &LogSettings::log_mode)
       .def_readwrite("log_mode_async_poll_interval_ms",
                      &LogSettings::log_mode_async_poll_interval_ms)
-      .def_readwrite("enable_trace", &LogSettings::enable_trace);
+      .def_readwrite("log_mode_end_of_test_max_memory_mb",
+                     &LogSettings::log_mode_end_of_test_max_memory_mb)
+      .def_readwrite("log_buffer_max_memory_mb",
+                     &LogSettings::log_buffer_max_memory_mb)
+      .def_readwrite("log_buffer_reserved_memory_mb",
+                     &LogSettings::log_buffer_reserved_memory_mb)
+      .def_readwrite("enable_trace", &LogSettings::enable_trace)
+      .def_readwrite("trace_format", &LogSettings::trace_format)
+      .def_readwrite("log_serializer_thread_count",
+                     &LogSettings::log_serializer_thread_count)
+      .def_readwrite("time_series_window_ms",
+                     &LogSettings::time_series_window_ms)
+      .def_readwrite("enable_latency_export",
+                     &LogSettings::enable_latency_export);
+
+  pybind11::class_<LiveMetrics>(m, "LiveMetrics")
+      .def(pybind11::init<>())
+      .def_readonly("test_running", &LiveMetrics::test_running)
+      .def_readonly("scenario", &LiveMetrics::scenario)
+      .def_readonly("mode", &LiveMetrics::mode)
+      .def_readonly("elapsed_seconds", &LiveMetrics::elapsed_seconds)
+      .def_readonly("queries_issued", &LiveMetrics::queries_issued)
+      .def_readonly("samples_issued", &LiveMetrics::samples_issued)
+      .def_readonly("queries_completed", &LiveMetrics::queries_completed)
+      .def_readonly("samples_completed", &LiveMetrics::samples_completed)
+      .def_readonly("queries_outstanding", &LiveMetrics::queries_outstanding)
+      .def_readonly("completed_samples_per_second",
+                    &LiveMetrics::completed_samples_per_second)
+      .def_readonly("completed_samples_per_second_window_seconds",
+                    &LiveMetrics::completed_samples_per_second_window_seconds)
+      .def_readonly("latency_count", &LiveMetrics::latency_count)
+      .def_readonly("latency_min", &LiveMetrics::latency_min)
+      .def_readonly("latency_max", &LiveMetrics::latency_max)
+      .def_readonly("latency_mean", &LiveMetrics::latency_mean)
+      .def_readonly("latency_p50", &LiveMetrics::latency_p50)
+      .def_readonly("latency_p90", &LiveMetrics::latency_p90)
+      .def_readonly("latency_p95", &LiveMetrics::latency_p95)
+      .def_readonly("latency_p99", &LiveMetrics::latency_p99)
+      .def_readonly("latency_p999", &LiveMetrics::latency_p999)
+      .def_readonly("window_start_seconds", &LiveMetrics::window_start_seconds)
+      .def_readonly("window_seconds", &LiveMetrics::window_seconds)
+      .def_readonly("window_sample_count", &LiveMetrics::window_sample_count)
+      .def_readonly("window_latency_mean", &LiveMetrics::window_latency_mean)
+      .def_readonly("window_latency_p50", &LiveMetrics::window_latency_p50)
+      .def_readonly("window_latency_p90", &LiveMetrics::window_latency_p90)
+      .def_readonly("window_latency_p99", &LiveMetrics::window_latency_p99)
+      .def_readonly("window_latency_max", &LiveMetrics::window_latency_max)
+      .def_readonly("latencies_pending", &LiveMetrics::latencies_pending)
+      .def_readonly("log_buffer_bytes", &LiveMetrics::log_buffer_bytes);
 
   pybind11::class_<QuerySample>(m, "QuerySample")
       .def(pybind11::init<>())
@@ -261,7 +391,15 @@ PYBIND11_MODULE(mlperf_loadgen, m) {
   pybind11::bind_vector<std::vector<QuerySampleResponse>>(
       m, "VectorQuerySampleResponse");
 
-  m.def("ConstructSUT", &py::ConstructSUT, "Construct the system under test.");
+  m.def("ConstructSUT", &py::ConstructSUT, pybind11::arg("issue_cb"),
+        pybind11::arg("flush_queries_cb"),
+        pybind11::arg("report_latency_results_cb"),
+        pybind11::arg("report_latency_details_cb") = pybind11::none(),
+        "Construct the system under test. If given, "
+        "report_latency_details_cb is called after each performance run with "
+        "a dict of read-only numpy arrays: sequence_ids, sample_indices, "
+        "scheduled_ns, issued_ns, completed_ns and latencies_ns. They view "
+        "the loadgen's buffers and are only valid during the callback.");
   m.def("DestroySUT", &py::DestroySUT,
         "Destroy the object created by ConstructSUT.");
 
@@ -279,6 +417,9 @@ PYBIND11_MODULE(mlperf_loadgen, m) {
   m.def("QuerySamplesComplete", &py::QuerySamplesComplete,
         "Called by the SUT to indicate that samples from some combination of"
         "IssueQuery calls have finished.");
+  m.def("GetLiveMetrics", &mlperf::GetLiveMetrics,
+        "Returns a snapshot of the metrics of the running test. May be called "
+        "from any thread while StartTest runs on another.");
 }
 
 }  // namespace py
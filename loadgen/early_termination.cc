@@ -0,0 +1,91 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "early_termination.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace mlperf {
+
+namespace {
+
+constexpr uint64_t kFirstCheckSampleCount = 32;
+constexpr double kPi = 3.14159265358979323846;
+
+// The z such that a standard normal falls within [-z, z] with probability
+// |confidence|.
+double TwoSidedZ(double confidence) {
+  const double tail = 1.0 - confidence;
+  double low = 0.0;
+  double high = 40.0;
+  for (int i = 0; i < 64; i++) {
+    double mid = (low + high) / 2;
+    if (std::erfc(mid / std::sqrt(2.0)) > tail) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return high;
+}
+
+// Bounds of the Wilson score interval for |successes| out of |trials|.
+void WilsonInterval(uint64_t successes, uint64_t trials, double z,
+                    double* lower, double* upper) {
+  const double n = static_cast<double>(trials);
+  const double p = static_cast<double>(successes) / n;
+  const double z2 = z * z;
+  const double center = p + z2 / (2 * n);
+  const double spread = z * std::sqrt(p * (1 - p) / n + z2 / (4 * n * n));
+  const double scale = 1 + z2 / n;
+  *lower = std::max(0.0, (center - spread) / scale);
+  *upper = std::min(1.0, (center + spread) / scale);
+}
+
+}  // namespace
+
+EarlyTerminationCheck::EarlyTerminationCheck(double percentile,
+                                             double confidence)
+    : percentile_(percentile),
+      confidence_(confidence),
+      next_check_at_(kFirstCheckSampleCount) {}
+
+EarlyTerminationCheck::Verdict EarlyTerminationCheck::Check(uint64_t issued,
+                                                            uint64_t within,
+                                                            uint64_t over) {
+  const uint64_t completed = within + over;
+  if (completed < next_check_at_ || issued < completed) {
+    return Verdict::Unsettled;
+  }
+  next_check_at_ = completed + completed / 2;
+  check_count_++;
+
+  const double k = static_cast<double>(check_count_);
+  check_confidence_ = 1.0 - (1.0 - confidence_) * 6.0 / (kPi * kPi * k * k);
+  const double z = TwoSidedZ(check_confidence_);
+
+  // Outstanding samples count as over the target for the lower bound and
+  // as within it for the upper bound.
+  double unused = 0;
+  WilsonInterval(within, issued, z, &lower_bound_, &unused);
+  WilsonInterval(issued - over, issued, z, &unused, &upper_bound_);
+  if (lower_bound_ > percentile_) {
+    return Verdict::Met;
+  }
+  if (upper_bound_ < percentile_) {
+    return Verdict::Missed;
+  }
+  return Verdict::Unsettled;
+}
+
+}  // namespace mlperf
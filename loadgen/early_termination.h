@@ -0,0 +1,61 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef MLPERF_LOADGEN_EARLY_TERMINATION_H_
+#define MLPERF_LOADGEN_EARLY_TERMINATION_H_
+
+#include <cstdint>
+
+namespace mlperf {
+
+// Decides, while a run is still going, whether its latency percentile is
+// within the target latency.
+// The fraction of samples within the target is estimated with a Wilson
+// score interval. The verdict is settled once the interval is entirely
+// above or below the percentile. Samples that haven't completed yet are
+// counted against whichever verdict is being tested, so slow samples that
+// are still outstanding can't settle it early.
+// Checking repeatedly as samples come in would make a wrong verdict more
+// likely than 1 - |confidence|. To avoid that, the interval is only checked
+// each time the completed samples grow by half, and the k'th check uses a
+// share of 6 / (pi^2 k^2) of the allowed error, which sums to no more than
+// it over all checks. This assumes the latencies are independent, which a
+// SUT whose latency drifts over the run is not.
+class EarlyTerminationCheck {
+ public:
+  enum class Verdict { Unsettled, Met, Missed };
+
+  EarlyTerminationCheck(double percentile, double confidence);
+
+  // |issued| samples were issued, of which |within| completed within the
+  // target latency and |over| completed over it.
+  Verdict Check(uint64_t issued, uint64_t within, uint64_t over);
+
+  // Describe the most recent check.
+  uint64_t CheckCount() const { return check_count_; }
+  double CheckConfidence() const { return check_confidence_; }
+  double LowerBound() const { return lower_bound_; }
+  double UpperBound() const { return upper_bound_; }
+
+ private:
+  const double percentile_;
+  const double confidence_;
+  uint64_t next_check_at_;
+  uint64_t check_count_ = 0;
+  double check_confidence_ = 0;
+  double lower_bound_ = 0;
+  double upper_bound_ = 1;
+};
+
+}  // namespace mlperf
+
+#endif  // MLPERF_LOADGEN_EARLY_TERMINATION_H_
@@ -0,0 +1,69 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "latency_export.h"
+
+#include <cstring>
+
+#include "latency_histogram.h"
+
+namespace mlperf {
+namespace latency_export {
+
+void WriteRecords(std::ostream* out, uint32_t run_index,
+                  const std::vector<LatencyRecord>& records) {
+  LatencyFileHeader header;
+  std::memcpy(header.magic, kMagic, sizeof(header.magic));
+  header.version = kVersion;
+  header.header_size = sizeof(LatencyFileHeader);
+  header.record_size = sizeof(LatencyRecord);
+  header.run_index = run_index;
+  header.record_count = records.size();
+  out->write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out->write(reinterpret_cast<const char*>(records.data()),
+             records.size() * sizeof(LatencyRecord));
+}
+
+void WriteHistogramJsonHeader(std::ostream* out) { *out << "["; }
+
+void WriteHistogramJson(std::ostream* out, uint32_t run_index,
+                        const LatencyHistogram& histogram) {
+  if (run_index != 0) {
+    *out << ",";
+  }
+  *out << "\n{\"run\": " << run_index
+       << ", \"sample_count\": " << histogram.Count()
+       << ", \"min_ns\": " << histogram.Min()
+       << ", \"max_ns\": " << histogram.Max()
+       << ", \"mean_ns\": " << histogram.Mean()
+       << ", \"max_relative_error\": " << LatencyHistogram::kMaxRelativeError
+       << ",\n \"buckets\": [";
+  bool needs_comma = false;
+  for (size_t i = 0; i < LatencyHistogram::kBucketCount; i++) {
+    uint64_t count = histogram.BucketCount(i);
+    if (count == 0) {
+      continue;
+    }
+    if (needs_comma) {
+      *out << ", ";
+    }
+    needs_comma = true;
+    *out << "[" << LatencyHistogram::BucketLowestValue(i) << ", "
+         << LatencyHistogram::BucketHighestValue(i) << ", " << count << "]";
+  }
+  *out << "]}";
+}
+
+void WriteHistogramJsonFooter(std::ostream* out) { *out << "\n]\n"; }
+
+}  // namespace latency_export
+}  // namespace mlperf
@@ -0,0 +1,77 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Implements the latency export files, for tools that analyze the latencies
+// of every sample.
+//
+// latencies<suffix>.bin has one section per performance run, each of which
+// is a LatencyFileHeader followed by |record_count| LatencyRecords. Both are
+// fixed size and 8 byte aligned, so the records of a section can be mapped
+// directly as an array. Integers are in native byte order.
+//
+// latency_histogram<suffix>.json is an array with one object per
+// performance run, in the same order as the sections:
+//   {"run": 0, "sample_count": ..., "min_ns": ..., "max_ns": ...,
+//    "mean_ns": ..., "max_relative_error": ...,
+//    "buckets": [[lowest_ns, highest_ns, count], ...]}
+// Only buckets with latencies are listed.
+
+#ifndef MLPERF_LOADGEN_LATENCY_EXPORT_H_
+#define MLPERF_LOADGEN_LATENCY_EXPORT_H_
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+namespace mlperf {
+
+class LatencyHistogram;
+
+struct LatencyFileHeader {
+  char magic[8];  // "MLPLATCY"
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t record_size;
+  uint32_t run_index;  // Matches "run" in the histogram JSON.
+  uint64_t record_count;
+};
+
+// Times are in nanoseconds since the start of the run.
+struct LatencyRecord {
+  uint64_t sequence_id;
+  uint64_t sample_index;
+  int64_t scheduled_ns;
+  int64_t issued_ns;
+  int64_t completed_ns;
+};
+
+static_assert(sizeof(LatencyFileHeader) == 32, "Unexpected padding.");
+static_assert(sizeof(LatencyRecord) == 40, "Unexpected padding.");
+
+namespace latency_export {
+
+constexpr char kMagic[] = "MLPLATCY";
+constexpr uint32_t kVersion = 1;
+
+void WriteRecords(std::ostream* out, uint32_t run_index,
+                  const std::vector<LatencyRecord>& records);
+
+void WriteHistogramJsonHeader(std::ostream* out);
+void WriteHistogramJson(std::ostream* out, uint32_t run_index,
+                        const LatencyHistogram& histogram);
+void WriteHistogramJsonFooter(std::ostream* out);
+
+}  // namespace latency_export
+
+}  // namespace mlperf
+
+#endif  // MLPERF_LOADGEN_LATENCY_EXPORT_H_
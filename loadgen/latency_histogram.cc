@@ -0,0 +1,132 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "latency_histogram.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace mlperf {
+
+namespace {
+
+size_t MostSignificantBit(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+  return 63 - __builtin_clzll(value);
+#else
+  size_t msb = 0;
+  while (value >>= 1) {
+    msb++;
+  }
+  return msb;
+#endif
+}
+
+}  // namespace
+
+size_t LatencyHistogram::BucketIndex(uint64_t value) {
+  if (value < kSubBucketCount) {
+    return static_cast<size_t>(value);
+  }
+  // Shift so the value lands in the upper half of the sub buckets.
+  size_t shift = MostSignificantBit(value) - (kSubBucketBits - 1);
+  size_t sub_bucket = static_cast<size_t>(value >> shift) - kSubBucketHalfCount;
+  return kSubBucketCount + (shift - 1) * kSubBucketHalfCount + sub_bucket;
+}
+
+uint64_t LatencyHistogram::BucketHighestValue(size_t index) {
+  if (index < kSubBucketCount) {
+    return index;
+  }
+  size_t shift = (index - kSubBucketCount) / kSubBucketHalfCount + 1;
+  uint64_t sub_bucket =
+      (index - kSubBucketCount) % kSubBucketHalfCount + kSubBucketHalfCount;
+  return (sub_bucket << shift) + ((uint64_t(1) << shift) - 1);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other) {
+  uint64_t other_count = other.Count();
+  if (other_count == 0) {
+    return;
+  }
+  for (size_t i = 0; i < kBucketCount; i++) {
+    uint64_t c = other.buckets_[i].load(std::memory_order_relaxed);
+    if (c != 0) {
+      buckets_[i].fetch_add(c, std::memory_order_relaxed);
+    }
+  }
+  sum_.fetch_add(other.sum_.load(std::memory_order_relaxed),
+                 std::memory_order_relaxed);
+  QuerySampleLatency other_min = other.min_.load(std::memory_order_relaxed);
+  QuerySampleLatency min = min_.load(std::memory_order_relaxed);
+  while (other_min < min && !min_.compare_exchange_weak(
+                                min, other_min, std::memory_order_relaxed)) {
+  }
+  QuerySampleLatency other_max = other.max_.load(std::memory_order_relaxed);
+  QuerySampleLatency max = max_.load(std::memory_order_relaxed);
+  while (other_max > max && !max_.compare_exchange_weak(
+                                max, other_max, std::memory_order_relaxed)) {
+  }
+  count_.fetch_add(other_count, std::memory_order_release);
+}
+
+void LatencyHistogram::Reset() {
+  for (auto& bucket : buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  sum_.store(0, std::memory_order_relaxed);
+  min_.store(std::numeric_limits<QuerySampleLatency>::max(),
+             std::memory_order_relaxed);
+  max_.store(std::numeric_limits<QuerySampleLatency>::min(),
+             std::memory_order_relaxed);
+  count_.store(0, std::memory_order_release);
+}
+
+QuerySampleLatency LatencyHistogram::Min() const {
+  return Count() == 0 ? 0 : min_.load(std::memory_order_relaxed);
+}
+
+QuerySampleLatency LatencyHistogram::Max() const {
+  return Count() == 0 ? 0 : max_.load(std::memory_order_relaxed);
+}
+
+QuerySampleLatency LatencyHistogram::Mean() const {
+  uint64_t count = Count();
+  return count == 0 ? 0 : sum_.load(std::memory_order_relaxed) /
+                              static_cast<QuerySampleLatency>(count);
+}
+
+QuerySampleLatency LatencyHistogram::Percentile(double percentile) const {
+  assert(percentile >= 0.0);
+  assert(percentile < 1.0);
+  uint64_t count = Count();
+  if (count == 0) {
+    return 0;
+  }
+  uint64_t rank = static_cast<uint64_t>(count * percentile);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBucketCount; i++) {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen > rank) {
+      // The highest value of a bucket can overshoot the largest latency.
+      QuerySampleLatency value =
+          static_cast<QuerySampleLatency>(std::min<uint64_t>(
+              BucketHighestValue(i),
+              std::numeric_limits<QuerySampleLatency>::max()));
+      return std::max(std::min(value, Max()), Min());
+    }
+  }
+  // Only reachable while other threads are recording.
+  return Max();
+}
+
+}  // namespace mlperf
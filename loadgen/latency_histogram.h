@@ -0,0 +1,96 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef MLPERF_LOADGEN_LATENCY_HISTOGRAM_H_
+#define MLPERF_LOADGEN_LATENCY_HISTOGRAM_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#include "query_sample.h"
+
+namespace mlperf {
+
+// A log-bucketed histogram of latencies with a bounded relative error.
+// Latencies below kSubBucketCount ns are counted exactly. Above that, each
+// power of two range is split into kSubBucketCount / 2 buckets, so a bucket
+// never spans more than kMaxRelativeError of the latencies it holds.
+// Record is lock-free and may be called from any number of threads.
+class LatencyHistogram {
+ public:
+  static constexpr size_t kSubBucketBits = 8;
+  static constexpr size_t kSubBucketCount = size_t(1) << kSubBucketBits;
+  static constexpr size_t kSubBucketHalfCount = kSubBucketCount / 2;
+  static constexpr size_t kBucketCount =
+      kSubBucketCount + (64 - kSubBucketBits) * kSubBucketHalfCount;
+  static constexpr double kMaxRelativeError = 1.0 / kSubBucketHalfCount;
+
+  LatencyHistogram() = default;
+  LatencyHistogram(const LatencyHistogram&) = delete;
+  LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+  void Record(QuerySampleLatency latency) {
+    uint64_t value = latency < 0 ? 0 : static_cast<uint64_t>(latency);
+    buckets_[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(latency, std::memory_order_relaxed);
+    QuerySampleLatency min = min_.load(std::memory_order_relaxed);
+    while (latency < min && !min_.compare_exchange_weak(
+                                min, latency, std::memory_order_relaxed)) {
+    }
+    QuerySampleLatency max = max_.load(std::memory_order_relaxed);
+    while (latency > max && !max_.compare_exchange_weak(
+                                max, latency, std::memory_order_relaxed)) {
+    }
+    // Counted last, so readers that see the count see the bucket as well.
+    count_.fetch_add(1, std::memory_order_release);
+  }
+
+  // Adds the latencies of |other| to this histogram.
+  void Merge(const LatencyHistogram& other);
+
+  // Not thread safe with respect to Record.
+  void Reset();
+
+  uint64_t Count() const { return count_.load(std::memory_order_acquire); }
+  QuerySampleLatency Min() const;
+  QuerySampleLatency Max() const;
+  QuerySampleLatency Mean() const;
+
+  // Returns the latency at index |count * percentile| of the sorted
+  // latencies, rounded up to the highest latency of its bucket.
+  QuerySampleLatency Percentile(double percentile) const;
+
+  uint64_t BucketCount(size_t index) const {
+    return buckets_[index].load(std::memory_order_relaxed);
+  }
+
+  static size_t BucketIndex(uint64_t value);
+  static uint64_t BucketLowestValue(size_t index) {
+    return index == 0 ? 0 : BucketHighestValue(index - 1) + 1;
+  }
+  static uint64_t BucketHighestValue(size_t index);
+
+ private:
+  std::atomic<uint64_t> buckets_[kBucketCount] = {};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<QuerySampleLatency> sum_{0};
+  std::atomic<QuerySampleLatency> min_{
+      std::numeric_limits<QuerySampleLatency>::max()};
+  std::atomic<QuerySampleLatency> max_{
+      std::numeric_limits<QuerySampleLatency>::min()};
+};
+
+}  // namespace mlperf
+
+#endif  // MLPERF_LOADGEN_LATENCY_HISTOGRAM_H_
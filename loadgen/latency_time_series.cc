@@ -0,0 +1,162 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "latency_time_series.h"
+
+#include <algorithm>
+
+#include "latency_histogram.h"
+
+namespace mlperf {
+
+void LatencyTimeSeries::Window::AddToBucket(size_t bucket, uint64_t count) {
+  if (buckets.empty()) {
+    first_bucket = bucket;
+    buckets.push_back(0);
+  } else if (bucket < first_bucket) {
+    buckets.insert(buckets.begin(), first_bucket - bucket, 0);
+    first_bucket = bucket;
+  } else if (bucket - first_bucket >= buckets.size()) {
+    buckets.resize(bucket - first_bucket + 1, 0);
+  }
+  buckets[bucket - first_bucket] += count;
+}
+
+// Matches LatencyHistogram::Percentile.
+QuerySampleLatency LatencyTimeSeries::Window::Percentile(
+    double percentile) const {
+  uint64_t rank = static_cast<uint64_t>(count * percentile);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets.size(); i++) {
+    seen += buckets[i];
+    if (seen > rank) {
+      QuerySampleLatency value =
+          static_cast<QuerySampleLatency>(std::min<uint64_t>(
+              LatencyHistogram::BucketHighestValue(first_bucket + i),
+              std::numeric_limits<QuerySampleLatency>::max()));
+      return std::max(std::min(value, max), min);
+    }
+  }
+  return max;
+}
+
+void LatencyTimeSeries::SetWindow(std::chrono::nanoseconds window) {
+  if (window != window_) {
+    Clear();
+    window_ = window;
+  }
+}
+
+void LatencyTimeSeries::Record(std::chrono::nanoseconds completion_time,
+                               QuerySampleLatency latency) {
+  if (window_.count() == 0) {
+    return;
+  }
+  Window* window = GetOrAddWindow(WindowIndex(completion_time));
+  uint64_t value = latency < 0 ? 0 : static_cast<uint64_t>(latency);
+  window->AddToBucket(LatencyHistogram::BucketIndex(value), 1);
+  window->count++;
+  window->sum += latency;
+  window->min = std::min(window->min, latency);
+  window->max = std::max(window->max, latency);
+}
+
+void LatencyTimeSeries::Merge(const LatencyTimeSeries& other) {
+  if (other.window_ != window_) {
+    return;
+  }
+  for (size_t i = 0; i < other.windows_.size(); i++) {
+    const Window& from = other.windows_[i];
+    if (from.count == 0) {
+      continue;
+    }
+    Window* to = GetOrAddWindow(other.first_index_ + static_cast<int64_t>(i));
+    for (size_t b = 0; b < from.buckets.size(); b++) {
+      if (from.buckets[b] != 0) {
+        to->AddToBucket(from.first_bucket + b, from.buckets[b]);
+      }
+    }
+    to->count += from.count;
+    to->sum += from.sum;
+    to->min = std::min(to->min, from.min);
+    to->max = std::max(to->max, from.max);
+  }
+}
+
+void LatencyTimeSeries::Clear() {
+  windows_.clear();
+  first_index_ = 0;
+}
+
+std::vector<LatencyTimeSeries::WindowStats> LatencyTimeSeries::Stats() const {
+  std::vector<WindowStats> stats;
+  for (size_t i = 0; i < windows_.size(); i++) {
+    if (windows_[i].count != 0) {
+      stats.push_back(
+          MakeStats(first_index_ + static_cast<int64_t>(i), windows_[i]));
+    }
+  }
+  return stats;
+}
+
+bool LatencyTimeSeries::StatsAt(std::chrono::nanoseconds time,
+                                WindowStats* stats) const {
+  if (window_.count() == 0 || windows_.empty()) {
+    return false;
+  }
+  int64_t index = WindowIndex(time);
+  if (index < first_index_ ||
+      index - first_index_ >= static_cast<int64_t>(windows_.size())) {
+    return false;
+  }
+  const Window& window = windows_[index - first_index_];
+  if (window.count == 0) {
+    return false;
+  }
+  *stats = MakeStats(index, window);
+  return true;
+}
+
+int64_t LatencyTimeSeries::WindowIndex(std::chrono::nanoseconds time) const {
+  return time.count() < 0 ? -1 : time.count() / window_.count();
+}
+
+LatencyTimeSeries::Window* LatencyTimeSeries::GetOrAddWindow(int64_t index) {
+  if (windows_.empty()) {
+    first_index_ = index;
+    windows_.emplace_back();
+  } else if (index < first_index_) {
+    windows_.insert(windows_.begin(), first_index_ - index, Window());
+    first_index_ = index;
+  } else if (index - first_index_ >= static_cast<int64_t>(windows_.size())) {
+    windows_.resize(index - first_index_ + 1);
+  }
+  return &windows_[index - first_index_];
+}
+
+LatencyTimeSeries::WindowStats LatencyTimeSeries::MakeStats(
+    int64_t index, const Window& window) const {
+  WindowStats stats;
+  stats.start = window_ * index;
+  stats.length = window_;
+  stats.sample_count = window.count;
+  stats.min = window.min;
+  stats.max = window.max;
+  stats.mean = window.sum / static_cast<QuerySampleLatency>(window.count);
+  stats.p50 = window.Percentile(.50);
+  stats.p90 = window.Percentile(.90);
+  stats.p99 = window.Percentile(.99);
+  stats.p999 = window.Percentile(.999);
+  return stats;
+}
+
+}  // namespace mlperf
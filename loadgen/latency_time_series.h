@@ -0,0 +1,90 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef MLPERF_LOADGEN_LATENCY_TIME_SERIES_H_
+#define MLPERF_LOADGEN_LATENCY_TIME_SERIES_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <vector>
+
+#include "query_sample.h"
+
+namespace mlperf {
+
+// Latency statistics over fixed windows of completion time, to show how
+// the latencies of a run change over time. Completion times are relative
+// to the start of the phase, so the first window starts with the phase.
+// Each window keeps a LatencyHistogram's buckets, but only the range of
+// buckets its latencies fall in.
+// Not thread safe. Each log serializer keeps its own, which are merged.
+class LatencyTimeSeries {
+ public:
+  struct WindowStats {
+    std::chrono::nanoseconds start{0};
+    std::chrono::nanoseconds length{0};
+    uint64_t sample_count = 0;
+    QuerySampleLatency min = 0;
+    QuerySampleLatency max = 0;
+    QuerySampleLatency mean = 0;
+    QuerySampleLatency p50 = 0;
+    QuerySampleLatency p90 = 0;
+    QuerySampleLatency p99 = 0;
+    QuerySampleLatency p999 = 0;
+  };
+
+  // A |window| of 0 disables the time series. Clears it if |window| changes.
+  void SetWindow(std::chrono::nanoseconds window);
+  std::chrono::nanoseconds WindowLength() const { return window_; }
+
+  void Record(std::chrono::nanoseconds completion_time,
+              QuerySampleLatency latency);
+  void Merge(const LatencyTimeSeries& other);
+  void Clear();
+  bool Empty() const { return windows_.empty(); }
+
+  // In order of time, skipping windows without any latencies.
+  std::vector<WindowStats> Stats() const;
+
+  // Sets |stats| to the window that contains |time|. Returns false if it
+  // doesn't have any latencies.
+  bool StatsAt(std::chrono::nanoseconds time, WindowStats* stats) const;
+
+ private:
+  struct Window {
+    uint64_t count = 0;
+    QuerySampleLatency sum = 0;
+    QuerySampleLatency min = std::numeric_limits<QuerySampleLatency>::max();
+    QuerySampleLatency max = std::numeric_limits<QuerySampleLatency>::min();
+    // Counts of the LatencyHistogram buckets from |first_bucket| on.
+    size_t first_bucket = 0;
+    std::vector<uint64_t> buckets;
+
+    void AddToBucket(size_t bucket, uint64_t count);
+    QuerySampleLatency Percentile(double percentile) const;
+  };
+
+  int64_t WindowIndex(std::chrono::nanoseconds time) const;
+  Window* GetOrAddWindow(int64_t index);
+  WindowStats MakeStats(int64_t index, const Window& window) const;
+
+  std::chrono::nanoseconds window_{0};
+  int64_t first_index_ = 0;
+  std::deque<Window> windows_;
+};
+
+}  // namespace mlperf
+
+#endif  // MLPERF_LOADGEN_LATENCY_TIME_SERIES_H_
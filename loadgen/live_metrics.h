@@ -0,0 +1,84 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// This file defines the metrics a client can poll from another thread while
+// a test is running. See mlperf::GetLiveMetrics in loadgen.h.
+
+#ifndef MLPERF_LOADGEN_LIVE_METRICS_H
+#define MLPERF_LOADGEN_LIVE_METRICS_H
+
+#include <cstdint>
+
+#include "query_sample.h"
+#include "test_settings.h"
+
+namespace mlperf {
+
+struct LiveMetrics {
+  // Whether StartTest is running. If not, the rest of the metrics describe
+  // the last phase of the last test.
+  bool test_running = false;
+
+  // The phase that is issuing queries. AccuracyOnly or PerformanceOnly.
+  TestScenario scenario = TestScenario::SingleStream;
+  TestMode mode = TestMode::PerformanceOnly;
+
+  // Seconds since the phase started issuing queries.
+  double elapsed_seconds = 0;
+
+  uint64_t queries_issued = 0;
+  uint64_t samples_issued = 0;
+  uint64_t queries_completed = 0;
+  uint64_t samples_completed = 0;
+  uint64_t queries_outstanding = 0;
+
+  // Samples completed per second over roughly the last second. The window
+  // is longer if there hasn't been a snapshot for a while; its actual
+  // length is |completed_samples_per_second_window_seconds|.
+  double completed_samples_per_second = 0;
+  double completed_samples_per_second_window_seconds = 0;
+
+  // Statistics of the latencies processed so far this phase. Percentiles
+  // are rounded up by less than 1%. Latencies are processed by the logger
+  // asynchronously, so they trail |samples_completed| a bit.
+  uint64_t latency_count = 0;
+  QuerySampleLatency latency_min = 0;
+  QuerySampleLatency latency_max = 0;
+  QuerySampleLatency latency_mean = 0;
+  QuerySampleLatency latency_p50 = 0;
+  QuerySampleLatency latency_p90 = 0;
+  QuerySampleLatency latency_p95 = 0;
+  QuerySampleLatency latency_p99 = 0;
+  QuerySampleLatency latency_p999 = 0;
+
+  // The last full window of the latency time series, by completion time.
+  // See LogSettings::time_series_window_ms. Latencies that are still being
+  // processed can land in the window after it's reported. All 0 if the
+  // window has no latencies yet, or if the time series is disabled.
+  double window_start_seconds = 0;  // Since the phase started.
+  double window_seconds = 0;
+  uint64_t window_sample_count = 0;
+  QuerySampleLatency window_latency_mean = 0;
+  QuerySampleLatency window_latency_p50 = 0;
+  QuerySampleLatency window_latency_p90 = 0;
+  QuerySampleLatency window_latency_p99 = 0;
+  QuerySampleLatency window_latency_max = 0;
+
+  // The logger's backlog: completed samples whose latencies haven't been
+  // processed yet and the memory holding unprocessed log entries.
+  uint64_t latencies_pending = 0;
+  uint64_t log_buffer_bytes = 0;
+};
+
+}  // namespace mlperf
+
+#endif  // MLPERF_LOADGEN_LIVE_METRICS_H
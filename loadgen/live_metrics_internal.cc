@@ -0,0 +1,128 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "live_metrics_internal.h"
+
+#include "utils.h"
+
+namespace mlperf {
+
+namespace {
+
+constexpr std::chrono::milliseconds kCompletionRateWindow(1000);
+
+}  // namespace
+
+void LiveMetricsTracker::StartTest() {
+  test_running_.store(true, std::memory_order_relaxed);
+}
+
+void LiveMetricsTracker::EndTest() {
+  test_running_.store(false, std::memory_order_relaxed);
+}
+
+void LiveMetricsTracker::StartPhase(TestScenario scenario, TestMode mode,
+                                    PerfClock::time_point start) {
+  scenario_.store(scenario, std::memory_order_relaxed);
+  mode_.store(mode, std::memory_order_relaxed);
+  phase_start_.store(start.time_since_epoch().count(),
+                     std::memory_order_relaxed);
+  queries_issued_.store(0, std::memory_order_relaxed);
+  samples_issued_.store(0, std::memory_order_relaxed);
+  queries_completed_.store(0, std::memory_order_relaxed);
+  samples_completed_.store(0, std::memory_order_relaxed);
+  latencies_.Reset();
+
+  std::unique_lock<std::mutex> lock(snapshot_mutex_);
+  recent_snapshots_.clear();
+}
+
+LiveMetrics LiveMetricsTracker::Snapshot() {
+  LiveMetrics metrics;
+  PerfClock::time_point now = PerfClock::now();
+  PerfClock::time_point phase_start(
+      PerfClock::duration(phase_start_.load(std::memory_order_relaxed)));
+
+  metrics.test_running = test_running_.load(std::memory_order_relaxed);
+  metrics.scenario = scenario_.load(std::memory_order_relaxed);
+  metrics.mode = mode_.load(std::memory_order_relaxed);
+  metrics.elapsed_seconds = DurationToSeconds(now - phase_start);
+
+  // Each count is read before the count it's subtracted from, which can only
+  // be larger by the time it's read.
+  metrics.latency_count = latencies_.Count();
+  metrics.queries_completed =
+      queries_completed_.load(std::memory_order_acquire);
+  metrics.samples_completed =
+      samples_completed_.load(std::memory_order_acquire);
+  metrics.queries_issued = queries_issued_.load(std::memory_order_relaxed);
+  metrics.samples_issued = samples_issued_.load(std::memory_order_relaxed);
+  metrics.queries_outstanding =
+      metrics.queries_issued - metrics.queries_completed;
+  metrics.latencies_pending =
+      metrics.samples_completed - metrics.latency_count;
+  metrics.log_buffer_bytes = GlobalLogger().LogBufferBytesInUse();
+
+  metrics.latency_min = latencies_.Min();
+  metrics.latency_max = latencies_.Max();
+  metrics.latency_mean = latencies_.Mean();
+  metrics.latency_p50 = latencies_.Percentile(.50);
+  metrics.latency_p90 = latencies_.Percentile(.90);
+  metrics.latency_p95 = latencies_.Percentile(.95);
+  metrics.latency_p99 = latencies_.Percentile(.99);
+  metrics.latency_p999 = latencies_.Percentile(.999);
+
+  LatencyTimeSeries::WindowStats window;
+  std::chrono::nanoseconds elapsed = now - phase_start;
+  if (GlobalLogger().GetLastFullTimeSeriesWindow(elapsed, &window)) {
+    metrics.window_start_seconds = DurationToSeconds(window.start);
+    metrics.window_seconds = DurationToSeconds(window.length);
+    metrics.window_sample_count = window.sample_count;
+    metrics.window_latency_mean = window.mean;
+    metrics.window_latency_p50 = window.p50;
+    metrics.window_latency_p90 = window.p90;
+    metrics.window_latency_p99 = window.p99;
+    metrics.window_latency_max = window.max;
+  }
+
+  std::unique_lock<std::mutex> lock(snapshot_mutex_);
+  // Measure from the newest snapshot that's at least a window old, or from
+  // the start of the phase if there isn't one.
+  if (recent_snapshots_.empty()) {
+    recent_snapshots_.push_back({phase_start, 0});
+  }
+  while (recent_snapshots_.size() > 1 &&
+         now - recent_snapshots_[1].time >= kCompletionRateWindow) {
+    recent_snapshots_.pop_front();
+  }
+  CompletedAt baseline = recent_snapshots_.front();
+  // Bounds the history if snapshots are taken in a tight loop.
+  if (now - recent_snapshots_.back().time >= kCompletionRateWindow / 16) {
+    recent_snapshots_.push_back({now, metrics.samples_completed});
+  }
+  double window_seconds = DurationToSeconds(now - baseline.time);
+  metrics.completed_samples_per_second_window_seconds = window_seconds;
+  if (window_seconds > 0 &&
+      metrics.samples_completed >= baseline.samples_completed) {
+    metrics.completed_samples_per_second =
+        (metrics.samples_completed - baseline.samples_completed) /
+        window_seconds;
+  }
+  return metrics;
+}
+
+LiveMetricsTracker& GlobalLiveMetrics() {
+  static LiveMetricsTracker g_live_metrics;
+  return g_live_metrics;
+}
+
+}  // namespace mlperf
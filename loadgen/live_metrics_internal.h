@@ -0,0 +1,87 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef MLPERF_LOADGEN_LIVE_METRICS_INTERNAL_H
+#define MLPERF_LOADGEN_LIVE_METRICS_INTERNAL_H
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+
+#include "latency_histogram.h"
+#include "live_metrics.h"
+#include "logging.h"
+
+namespace mlperf {
+
+// Collects the counters behind LiveMetrics as the test runs.
+// The counters are relaxed atomics, so the threads updating them never
+// block on a snapshot.
+class LiveMetricsTracker {
+ public:
+  void StartTest();
+  void EndTest();
+
+  // Called by the issuing thread before the first query of each phase.
+  void StartPhase(TestScenario scenario, TestMode mode,
+                  PerfClock::time_point start);
+  void QueryIssued(size_t sample_count) {
+    queries_issued_.store(queries_issued_.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_relaxed);
+    samples_issued_.store(
+        samples_issued_.load(std::memory_order_relaxed) + sample_count,
+        std::memory_order_relaxed);
+  }
+
+  // Called by any thread.
+  void QueryCompleted() {
+    queries_completed_.fetch_add(1, std::memory_order_relaxed);
+  }
+  void SamplesCompleted(size_t sample_count) {
+    samples_completed_.fetch_add(sample_count, std::memory_order_relaxed);
+  }
+
+  // Called by the threads that process the log.
+  void RecordLatency(QuerySampleLatency latency) {
+    latencies_.Record(latency);
+  }
+
+  LiveMetrics Snapshot();
+
+ private:
+  std::atomic<bool> test_running_{false};
+  std::atomic<TestScenario> scenario_{TestScenario::SingleStream};
+  std::atomic<TestMode> mode_{TestMode::PerformanceOnly};
+  std::atomic<PerfClock::rep> phase_start_{0};
+
+  std::atomic<uint64_t> queries_issued_{0};
+  std::atomic<uint64_t> samples_issued_{0};
+  std::atomic<uint64_t> queries_completed_{0};
+  std::atomic<uint64_t> samples_completed_{0};
+  LatencyHistogram latencies_;
+
+  // The samples completed as of recent snapshots, to derive the QPS.
+  // Protected by snapshot_mutex_.
+  struct CompletedAt {
+    PerfClock::time_point time;
+    uint64_t samples_completed;
+  };
+  std::mutex snapshot_mutex_;
+  std::deque<CompletedAt> recent_snapshots_;
+};
+
+LiveMetricsTracker& GlobalLiveMetrics();
+
+}  // namespace mlperf
+
+#endif  // MLPERF_LOADGEN_LIVE_METRICS_INTERNAL_H
@@ -17,14 +17,23 @@ limitations under the License.
 #include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cmath>
 #include <cstring>
 #include <fstream>
 #include <future>
+#include <limits>
+#include <memory>
 #include <queue>
 #include <random>
 #include <string>
 #include <thread>
 
+#include "early_termination.h"
+#include "latency_histogram.h"
+#include "latency_time_series.h"
+#include "live_metrics.h"
+#include "live_metrics_internal.h"
+#include "log_sink.h"
 #include "logging.h"
 #include "query_sample.h"
 #include "query_sample_library.h"
@@ -39,11 +48,19 @@ namespace mlperf {
 struct SampleMetadata;
 struct QueryMetadata;
 
+// The latency constraint of these scenarios applies to whole queries, which
+// are only done once all of their samples are.
+bool HasQueryLatencyConstraint(TestScenario scenario) {
+  return scenario == TestScenario::MultiStream ||
+         scenario == TestScenario::MultiStreamFree;
+}
+
 // Every query and sample within a call to StartTest gets a unique sequence id
 // for easy cross reference.
 struct SequenceGen {
   uint64_t NextQueryId() { return query_id++; }
   uint64_t NextSampleId() { return sample_id++; }
+  uint64_t PeekSampleId() const { return sample_id; }
 
  private:
   uint64_t query_id = 0;
@@ -59,7 +76,7 @@ struct ResponseDelegate {
   virtual ~ResponseDelegate() = default;
   virtual void SampleComplete(SampleMetadata*, QuerySampleResponse*,
                               PerfClock::time_point) = 0;
-  virtual void QueryComplete() = 0;
+  virtual void QueryComplete(QueryMetadata* query) = 0;
 };
 
 // SampleMetadata is used by the load generator to coordinate
@@ -68,6 +85,7 @@ struct SampleMetadata {
   QueryMetadata* query_metadata;
   uint64_t sequence_id;
   QuerySampleIndex sample_index;
+  PerfClock::time_point complete_time{};
 };
 
 class QueryMetadata {
@@ -117,10 +135,12 @@ class QueryMetadata {
     if (old_count == 1) {
       all_samples_done_time = timestamp;
       all_samples_done_.set_value();
-      response_delegate->QueryComplete();
+      response_delegate->QueryComplete(this);
     }
   }
 
+  const std::vector<SampleMetadata>& Samples() const { return samples_; }
+
   void WaitForAllSamplesCompleted() { all_samples_done_.get_future().wait(); }
 
   PerfClock::time_point WaitForAllSamplesCompletedWithTimestamp() {
@@ -128,6 +148,18 @@ class QueryMetadata {
     return all_samples_done_time;
   }
 
+  // Samples can complete on other threads before IssueQuery returns, so
+  // this is atomic and reads as PerfClock::time_point::max() until set.
+  void SetIssuedEndTime(PerfClock::time_point time) {
+    issued_end_time_.store(time.time_since_epoch().count(),
+                           std::memory_order_relaxed);
+  }
+  PerfClock::time_point IssuedEndTime() const {
+    PerfClock::rep rep = issued_end_time_.load(std::memory_order_relaxed);
+    return rep == 0 ? PerfClock::time_point::max()
+                    : PerfClock::time_point(PerfClock::duration(rep));
+  }
+
  public:
   std::vector<QuerySample> query_to_send;
   const std::chrono::nanoseconds scheduled_delta;
@@ -145,6 +177,7 @@ class QueryMetadata {
 
  private:
   std::atomic<size_t> wait_count_;
+  std::atomic<PerfClock::rep> issued_end_time_{0};
   std::promise<void> all_samples_done_;
   std::vector<SampleMetadata> samples_;
 };
@@ -157,6 +190,7 @@ void QuerySamplesComplete(QuerySampleResponse* responses,
       [](AsyncLog& log) { log.ScopedTrace("QuerySamplesComplete"); });
 
   const QuerySampleResponse* end = responses + response_count;
+  GlobalLiveMetrics().SamplesCompleted(response_count);
 
   // Notify first to unblock loadgen production ASAP.
   for (QuerySampleResponse* response = responses; response < end; response++) {
@@ -168,11 +202,90 @@ void QuerySamplesComplete(QuerySampleResponse* responses,
   // Log samples.
   for (QuerySampleResponse* response = responses; response < end; response++) {
     SampleMetadata* sample = reinterpret_cast<SampleMetadata*>(response->id);
+    sample->complete_time = timestamp;
     QueryMetadata* query = sample->query_metadata;
     query->response_delegate->SampleComplete(sample, response, timestamp);
   }
 }
 
+// Splits each sample's latency into where the time went, to tell whether a
+// tail comes from the SUT or from the loadgen. The scheduler lateness, issue
+// and SUT times add up to the latency. The completion hop is the loadgen's
+// time on the SUT's thread between QuerySamplesComplete and logging the
+// sample, which isn't part of the latency.
+struct LatencyBreakdown {
+  LatencyHistogram scheduler_lateness;  // Until the issue started.
+  LatencyHistogram issue;               // Blocked in SUT::IssueQuery.
+  LatencyHistogram sut;                 // After IssueQuery returned.
+  LatencyHistogram completion_hop;
+
+  void Record(const QueryMetadata& query, PerfClock::time_point complete,
+              PerfClock::time_point hop_end) {
+    PerfClock::time_point sut_start =
+        std::min(query.IssuedEndTime(), complete);
+    scheduler_lateness.Record(
+        ToNanoseconds(query.issued_start_time - query.scheduled_time));
+    issue.Record(ToNanoseconds(sut_start - query.issued_start_time));
+    sut.Record(ToNanoseconds(complete - sut_start));
+    completion_hop.Record(ToNanoseconds(hop_end - complete));
+  }
+
+  static QuerySampleLatency ToNanoseconds(PerfClock::duration duration) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(duration)
+        .count();
+  }
+};
+
+// The LatencyReport buffers of a performance run, only gathered for SUTs
+// that want them.
+struct LatencyDetails {
+  std::vector<uint64_t> sequence_ids;
+  std::vector<QuerySampleIndex> sample_indices;
+  std::vector<int64_t> scheduled_ns;
+  std::vector<int64_t> issued_ns;
+  std::vector<int64_t> completed_ns;
+  std::vector<QuerySampleLatency> latencies_ns;
+
+  void Reserve(size_t sample_count) {
+    sequence_ids.reserve(sample_count);
+    sample_indices.reserve(sample_count);
+    scheduled_ns.reserve(sample_count);
+    issued_ns.reserve(sample_count);
+    completed_ns.reserve(sample_count);
+    latencies_ns.reserve(sample_count);
+  }
+
+  // Queries must be added in issue order to keep samples in sequence order.
+  void Add(const QueryMetadata& query, PerfClock::time_point start) {
+    int64_t scheduled =
+        LatencyBreakdown::ToNanoseconds(query.scheduled_time - start);
+    int64_t issued =
+        LatencyBreakdown::ToNanoseconds(query.issued_start_time - start);
+    for (const SampleMetadata& sample : query.Samples()) {
+      int64_t completed =
+          LatencyBreakdown::ToNanoseconds(sample.complete_time - start);
+      sequence_ids.push_back(sample.sequence_id);
+      sample_indices.push_back(sample.sample_index);
+      scheduled_ns.push_back(scheduled);
+      issued_ns.push_back(issued);
+      completed_ns.push_back(completed);
+      latencies_ns.push_back(completed - scheduled);
+    }
+  }
+
+  LatencyReport Report() const {
+    LatencyReport report;
+    report.sample_count = sequence_ids.size();
+    report.sequence_ids = sequence_ids.data();
+    report.sample_indices = sample_indices.data();
+    report.scheduled_ns = scheduled_ns.data();
+    report.issued_ns = issued_ns.data();
+    report.completed_ns = completed_ns.data();
+    report.latencies_ns = latencies_ns.data();
+    return report;
+  }
+};
+
 struct DurationGeneratorNs {
   const PerfClock::time_point start;
   int64_t delta(PerfClock::time_point end) const {
@@ -189,9 +302,20 @@ struct DurationGeneratorNs {
 template <TestScenario scenario, TestMode mode>
 struct ResponseDelegateDetailed : public ResponseDelegate {
   std::atomic<size_t> queries_completed{0};
+  // Set before the first query is issued.
+  PerfClock::time_point phase_start;
+  // Samples, or queries if the latency constraint applies to queries, are
+  // only counted against the target latency if it's set, in performance
+  // mode.
+  std::chrono::nanoseconds target_latency{0};
+  std::atomic<uint64_t> within_target{0};
+  std::atomic<uint64_t> over_target{0};
+  // Set before the first query is issued.
+  LatencyBreakdown* latency_breakdown = nullptr;
 
   void SampleComplete(SampleMetadata* sample, QuerySampleResponse* response,
                       PerfClock::time_point complete_begin_time) override {
+    PerfClock::time_point hop_end_time = PerfClock::now();
     // Using a raw pointer here should help us hit the std::function
     // small buffer optimization code path when we aren't copying data.
     // For some reason, using std::unique_ptr<std::vector> wasn't moving
@@ -203,16 +327,23 @@ struct ResponseDelegateDetailed : public ResponseDelegate {
       uint8_t* src_end = src_begin + response->size;
       sample_data_copy = new std::vector<uint8_t>(src_begin, src_end);
     }
-    Log([sample, complete_begin_time, sample_data_copy](AsyncLog& log) {
+    if (target_latency.count() != 0 &&
+        !HasQueryLatencyConstraint(scenario)) {
+      CountAgainstTarget(complete_begin_time -
+                         sample->query_metadata->scheduled_time);
+    }
+    Log([sample, complete_begin_time, hop_end_time, sample_data_copy,
+         phase_start = phase_start,
+         latency_breakdown = latency_breakdown](AsyncLog& log) {
       QueryMetadata* query = sample->query_metadata;
       DurationGeneratorNs sched{query->scheduled_time};
       QuerySampleLatency latency = sched.delta(complete_begin_time);
-      log.RecordLatency(sample->sequence_id, latency);
+      latency_breakdown->Record(*query, complete_begin_time, hop_end_time);
       // Disable tracing each sample in offline mode. Since thousands of
       // samples could be overlapping when visualized, it's not very useful.
       // TODO: Should we disable for cloud mode as well? Sufficiently
       // out-of-order processing could have lots of overlap too.
-      if (scenario != TestScenario::Offline) {
+      if (scenario != TestScenario::Offline && TracingEnabled()) {
         log.TraceSample("Sample", sample->sequence_id, query->scheduled_time,
                         complete_begin_time, "sample_seq", sample->sequence_id,
                         "query_seq", query->sequence_id, "sample_idx",
@@ -226,15 +357,35 @@ struct ResponseDelegateDetailed : public ResponseDelegate {
                         LogBinaryAsHexString{sample_data_copy});
         delete sample_data_copy;
       }
+
+      // Record the latency last, since it may unblock the destruction of
+      // |sample| and |query|.
+      GlobalLiveMetrics().RecordLatency(latency);
+      log.RecordLatency(sample->sequence_id, latency,
+                        complete_begin_time - phase_start);
     });
   }
 
-  void QueryComplete() override {
-    // We only need to track oustanding queries in the server scenario to
-    // detect when the SUT has fallen too far behind.
-    if (scenario == TestScenario::Server) {
-      queries_completed.fetch_add(1, std::memory_order_relaxed);
+  void CountAgainstTarget(PerfClock::duration latency) {
+    if (latency <= target_latency) {
+      within_target.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      over_target.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  void QueryComplete(QueryMetadata* query) override {
+    GlobalLiveMetrics().QueryCompleted();
+    if (target_latency.count() != 0 &&
+        HasQueryLatencyConstraint(scenario)) {
+      CountAgainstTarget(query->all_samples_done_time - query->scheduled_time);
     }
+    // Counted last, so the query latency counts above are complete once
+    // every query is. Sample latencies are counted by SampleComplete, which
+    // runs after QueryComplete for the same response, before the latency is
+    // logged. Those counts are only complete once GetLatenciesBlocking has
+    // returned.
+    queries_completed.fetch_add(1, std::memory_order_release);
   }
 };
 
@@ -301,7 +452,9 @@ std::vector<QueryMetadata> GenerateQueries(
   std::vector<QueryMetadata> queries;
 
   assert(scenario == settings.scenario);
-  assert(mode == settings.mode);
+  // FindPeakPerformance runs performance mode phases.
+  assert(mode == settings.mode ||
+         settings.mode == TestMode::FindPeakPerformance);
 
   // Using the std::mt19937 pseudo-random number generator ensures a modicum of
   // cross platform reproducibility for trace generation.
@@ -425,9 +578,11 @@ struct QueryScheduler<TestScenario::MultiStream> {
         i_period++;
         tick_time =
             start_time + SecondsToDuration<PerfClock::duration>(i_period / qps);
-        Log([tick_time](AsyncLog& log) {
-          log.TraceAsyncInstant("QueryInterval", 0, tick_time);
-        });
+        if (TracingEnabled()) {
+          LogTrace([tick_time](AsyncLog& log) {
+            log.TraceAsyncInstant("QueryInterval", 0, tick_time);
+          });
+        }
       } while (tick_time < now);
       next_query->scheduled_intervals = i_period - i_period_old;
       next_query->scheduled_time = tick_time;
@@ -524,11 +679,29 @@ struct QueryScheduler<TestScenario::Offline> {
 // and other context.
 struct PerformanceResult {
   std::vector<QuerySampleLatency> latencies;
+  std::shared_ptr<const LatencyHistogram> latency_histogram;
+  std::shared_ptr<const LatencyBreakdown> latency_breakdown;
+  std::shared_ptr<const LatencyDetails> latency_details;  // If wanted.
+  // A query's latency is that of its last sample.
+  // |query_latencies| is only kept for exact_latency_percentiles.
+  std::vector<QuerySampleLatency> query_latencies;
+  std::shared_ptr<const LatencyHistogram> query_latency_histogram;
+  // Only reported for scenarios that issue queries on a schedule.
+  // How long after its scheduled time each query was issued.
+  std::shared_ptr<const LatencyHistogram> issue_lateness_histogram;
+  size_t max_queries_behind;  // Due but not issued yet. Server only.
+  size_t skipped_intervals;   // MultiStream only.
+  std::shared_ptr<const LatencyHistogram> corrected_query_latency_histogram;
   size_t queries_issued;
   double max_latency;
   double final_query_scheduled_time;         // seconds from start.
   double final_query_issued_time;            // seconds from start.
   double final_query_all_samples_done_time;  // seconds from start.
+  EarlyTerminationCheck::Verdict early_termination_verdict;
+  bool latency_constraint_unmeetable;  // Set if fail fast ended the run.
+  // Samples, or queries if the latency constraint applies to queries,
+  // within the target latency. Only counted in performance mode.
+  uint64_t latencies_within_target;
 };
 
 // TODO: Templates for scenario and mode are overused, given the loadgen
@@ -539,13 +712,23 @@ PerformanceResult IssueQueries(SystemUnderTest* sut,
                                const TestSettingsInternal& settings,
                                const LoadableSampleSet& loaded_sample_set,
                                SequenceGen* sequence_gen) {
-  GlobalLogger().RestartLatencyRecording();
+  // Latencies are collected per phase, starting from its first sample. The
+  // summary only needs the histogram, so the raw latencies are only kept
+  // for exact percentiles or the SUT.
+  const bool keep_latencies =
+      mode == TestMode::PerformanceOnly && settings.discarded_phase.empty() &&
+      (settings.requested.exact_latency_percentiles ||
+       sut->WantsLatencyResults());
+  GlobalLogger().RestartLatencyRecording(sequence_gen->PeekSampleId(),
+                                         keep_latencies);
   ResponseDelegateDetailed<scenario, mode> response_logger;
 
   std::vector<QueryMetadata> queries = GenerateQueries<scenario, mode>(
       settings, loaded_sample_set, sequence_gen, &response_logger);
 
   size_t queries_issued = 0;
+  size_t queries_due = 0;         // Server only.
+  size_t max_queries_behind = 0;  // Server only.
   // TODO: Replace the constant 5 below with a TestSetting.
   const double query_seconds_outstanding_threshold =
       5 * std::chrono::duration_cast<std::chrono::duration<double>>(
@@ -557,18 +740,60 @@ PerformanceResult IssueQueries(SystemUnderTest* sut,
   const PerfClock::time_point start = PerfClock::now();
   PerfClock::time_point last_now = start;
   QueryScheduler<scenario> query_scheduler(settings, start);
+  auto latency_breakdown = std::make_shared<LatencyBreakdown>();
+  response_logger.latency_breakdown = latency_breakdown.get();
+  response_logger.phase_start = start;
+  const bool early_termination =
+      mode == TestMode::PerformanceOnly && settings.early_termination;
+  // TODO: Make .90 a spec constant.
+  EarlyTerminationCheck early_termination_check(
+      .90, settings.early_termination_confidence);
+  EarlyTerminationCheck::Verdict early_termination_verdict =
+      EarlyTerminationCheck::Verdict::Unsettled;
+  // Fail fast ends the run once more latencies are over the target than
+  // the percentile allows out of all the latencies the run would collect.
+  const bool fail_fast =
+      mode == TestMode::PerformanceOnly && settings.fail_fast;
+  uint64_t max_over_target = std::numeric_limits<uint64_t>::max();
+  bool latency_constraint_unmeetable = false;
+  if (fail_fast) {
+    // The run ends with the first query issued after the min duration, and
+    // no earlier than the min query count, so it can't issue more queries.
+    uint64_t planned_queries = 1;
+    for (const QueryMetadata& query : queries) {
+      if (query.scheduled_delta > settings.min_duration) {
+        break;
+      }
+      planned_queries++;
+    }
+    planned_queries = std::max(planned_queries, settings.min_query_count);
+    uint64_t planned = HasQueryLatencyConstraint(scenario)
+                           ? planned_queries
+                           : planned_queries * settings.samples_per_query;
+    max_over_target = static_cast<uint64_t>((1 - .90) * planned);
+  }
+  // Also counted for the exact performance constraint check.
+  if (mode == TestMode::PerformanceOnly) {
+    response_logger.target_latency = settings.target_latency;
+  }
+  GlobalLiveMetrics().StartPhase(scenario, mode, start);
 
   for (auto& query : queries) {
     auto trace1 =
         MakeScopedTracer([](AsyncLog& log) { log.ScopedTrace("SampleLoop"); });
     last_now = query_scheduler.Wait(&query);
 
+    // Counted first, so the live metrics never see the query complete
+    // before it's issued.
+    GlobalLiveMetrics().QueryIssued(query.query_to_send.size());
+
     // Issue the query to the SUT.
     {
       auto trace3 = MakeScopedTracer(
           [](AsyncLog& log) { log.ScopedTrace("IssueQuery"); });
       sut->IssueQuery(query.query_to_send);
     }
+    query.SetIssuedEndTime(PerfClock::now());
 
     queries_issued++;
     if (mode == TestMode::AccuracyOnly) {
@@ -602,19 +827,83 @@ PerformanceResult IssueQueries(SystemUnderTest* sut,
       break;
     }
     if (scenario == TestScenario::Server) {
+      // Only reported, since a SUT that blocks in IssueQuery falls behind
+      // the schedule without having queries outstanding.
+      queries_due = std::max(queries_due, queries_issued);
+      while (queries_due < queries.size() &&
+             queries[queries_due].scheduled_delta <= duration) {
+        queries_due++;
+      }
+      max_queries_behind =
+          std::max(max_queries_behind, queries_due - queries_issued);
       size_t queries_outstanding =
           queries_issued -
           response_logger.queries_completed.load(std::memory_order_relaxed);
       if (queries_outstanding > max_queries_outstanding) {
-        LogError([queries_issued, queries_outstanding](AsyncLog& log) {
+        auto log_ending = [queries_issued, queries_outstanding](AsyncLog& log) {
           log.LogDetail("Ending early: Too many oustanding queries.", "issued",
                         queries_issued, "outstanding", queries_outstanding);
+        };
+        if (settings.peak_performance_probe) {
+          LogDetail(log_ending);
+        } else {
+          LogError(log_ending);
+        }
+        break;
+      }
+    }
+    // The response delegate counts latencies as they complete, regardless
+    // of when the logs are processed.
+    if (fail_fast) {
+      uint64_t over =
+          response_logger.over_target.load(std::memory_order_relaxed);
+      if (over > max_over_target) {
+        latency_constraint_unmeetable = true;
+        LogDetail([duration, queries_issued, over,
+                   max_over_target](AsyncLog& log) {
+          log.LogDetail(
+              "Ending early: Latency constraint can no longer be met.",
+              "duration_ns", duration.count(), "query_count", queries_issued,
+              "over_target", over, "max_over_target", max_over_target);
+        });
+        break;
+      }
+    }
+    if (early_termination) {
+      uint64_t issued = HasQueryLatencyConstraint(scenario)
+                            ? queries_issued
+                            : queries_issued * settings.samples_per_query;
+      uint64_t within =
+          response_logger.within_target.load(std::memory_order_relaxed);
+      uint64_t over =
+          response_logger.over_target.load(std::memory_order_relaxed);
+      early_termination_verdict =
+          early_termination_check.Check(issued, within, over);
+      if (settings.peak_performance_probe &&
+          early_termination_verdict == EarlyTerminationCheck::Verdict::Met) {
+        // A SUT falling behind may only show later in the probe.
+        early_termination_verdict = EarlyTerminationCheck::Verdict::Unsettled;
+      }
+      if (early_termination_verdict !=
+          EarlyTerminationCheck::Verdict::Unsettled) {
+        bool met = early_termination_verdict ==
+                   EarlyTerminationCheck::Verdict::Met;
+        LogDetail([met, duration, queries_issued, issued, within, over,
+                   confidence = settings.early_termination_confidence,
+                   check = early_termination_check](AsyncLog& log) {
+          log.LogDetail(
+              met ? "Ending early: Latency constraint met with confidence."
+                  : "Ending early: Latency constraint missed with confidence.",
+              "confidence", confidence, "check", check.CheckCount(),
+              "check_confidence", check.CheckConfidence(), "lower_bound",
+              check.LowerBound(), "upper_bound", check.UpperBound(),
+              "duration_ns", duration.count(), "query_count", queries_issued,
+              "issued", issued, "within_target", within, "over_target",
+              over);
         });
         break;
       }
     }
-    // TODO: Use GetMaxLatencySoFar here if we decide to have a hard latency
-    //       limit.
   }
 
   // Let the SUT know it should not expect any more queries.
@@ -624,23 +913,114 @@ PerformanceResult IssueQueries(SystemUnderTest* sut,
   // doesn't apply.
   if (scenario != TestScenario::Offline && mode == TestMode::PerformanceOnly &&
       queries_issued >= queries.size()) {
-    LogError([](AsyncLog& log) {
+    auto log_ran_out = [](AsyncLog& log) {
       log.LogDetail(
           "Ending early: Ran out of generated queries to issue before the "
           "minimum query count and test duration were reached.");
       log.LogDetail(
           "Please update the relevant expected latency or target qps in the "
           "TestSettings so they are more accurate.");
-    });
+    };
+    // Only the measured phases need all their queries.
+    if (settings.discarded_phase.empty()) {
+      LogError(log_ran_out);
+    } else {
+      LogDetail(log_ran_out);
+    }
   }
 
   // Wait for tail queries to complete and collect all the latencies.
   // We have to keep the synchronization primitives alive until the SUT
   // is done with them.
   auto& final_query = queries[queries_issued - 1];
-  const size_t expected_latencies = queries_issued * settings.samples_per_query;
-  std::vector<QuerySampleLatency> latencies(
-      GlobalLogger().GetLatenciesBlocking(expected_latencies));
+  // The Offline accuracy remainder query has fewer samples than the others.
+  size_t expected_latencies = 0;
+  for (size_t i = 0; i < queries_issued; i++) {
+    expected_latencies += queries[i].query_to_send.size();
+  }
+  auto latency_histogram = std::make_shared<LatencyHistogram>();
+  LatencyTimeSeries time_series;
+  std::vector<QuerySampleLatency> latencies(GlobalLogger().GetLatenciesBlocking(
+      expected_latencies, latency_histogram.get(), &time_series));
+  // A query's last latency can be recorded before its completing thread is
+  // done with the query, which is brief.
+  while (response_logger.queries_completed.load(std::memory_order_acquire) <
+         queries_issued) {
+    std::this_thread::yield();
+  }
+
+  // Every query is done, so their latencies are read from the completion
+  // times already captured, rather than recorded as they complete.
+  auto query_latency_histogram = std::make_shared<LatencyHistogram>();
+  std::vector<QuerySampleLatency> query_latencies;
+  if (settings.requested.exact_latency_percentiles) {
+    query_latencies.reserve(queries_issued);
+  }
+  // Queries issued late show the SUT held up the schedule. Intervals the
+  // MultiStream scheduler skipped are charged to the corrected histogram as
+  // queries done along with the next issued query, so skipping can't make a
+  // SUT look faster.
+  auto issue_lateness_histogram = std::make_shared<LatencyHistogram>();
+  auto corrected_query_latency_histogram =
+      std::make_shared<LatencyHistogram>();
+  const QuerySampleLatency scheduled_interval =
+      static_cast<QuerySampleLatency>(std::nano::den / settings.target_qps);
+  size_t skipped_intervals = 0;
+  for (size_t i = 0; i < queries_issued; i++) {
+    const QueryMetadata& query = queries[i];
+    QuerySampleLatency latency = LatencyBreakdown::ToNanoseconds(
+        query.all_samples_done_time - query.scheduled_time);
+    query_latency_histogram->Record(latency);
+    if (settings.requested.exact_latency_percentiles) {
+      query_latencies.push_back(latency);
+    }
+    issue_lateness_histogram->Record(std::max<QuerySampleLatency>(
+        0, LatencyBreakdown::ToNanoseconds(query.issued_start_time -
+                                           query.scheduled_time)));
+    corrected_query_latency_histogram->Record(latency);
+    for (int skipped = 1; skipped < query.scheduled_intervals; skipped++) {
+      corrected_query_latency_histogram->Record(latency +
+                                                skipped * scheduled_interval);
+      skipped_intervals++;
+    }
+  }
+
+  if (!time_series.Empty()) {
+    Log([phase = settings.discarded_phase.empty() ? ToString(mode)
+                                                  : settings.discarded_phase,
+         time_series = std::move(time_series)](
+            AsyncLog& log) { log.LogTimeSeries(phase, time_series); });
+  }
+  std::shared_ptr<LatencyDetails> latency_details;
+  if (mode == TestMode::PerformanceOnly && settings.discarded_phase.empty() &&
+      sut->WantsLatencyDetails()) {
+    latency_details = std::make_shared<LatencyDetails>();
+    latency_details->Reserve(expected_latencies);
+    for (size_t i = 0; i < queries_issued; i++) {
+      latency_details->Add(queries[i], start);
+    }
+  }
+  if (mode == TestMode::PerformanceOnly && settings.discarded_phase.empty() &&
+      GlobalLogger().ExportingLatencies()) {
+    std::vector<LatencyRecord> records;
+    records.reserve(expected_latencies);
+    for (size_t i = 0; i < queries_issued; i++) {
+      const QueryMetadata& query = queries[i];
+      int64_t scheduled_ns = LatencyBreakdown::ToNanoseconds(
+          query.scheduled_time - start);
+      int64_t issued_ns = LatencyBreakdown::ToNanoseconds(
+          query.issued_start_time - start);
+      for (const SampleMetadata& sample : query.Samples()) {
+        records.push_back(
+            {sample.sequence_id, sample.sample_index, scheduled_ns, issued_ns,
+             LatencyBreakdown::ToNanoseconds(sample.complete_time - start)});
+      }
+    }
+    Log([records = std::move(records),
+         latency_histogram = latency_histogram](AsyncLog& log) {
+      log.LogLatencyExport(records, *latency_histogram);
+    });
+  }
 
   // Log contention counters after every test as a sanity check.
   GlobalLogger().LogContentionCounters();
@@ -654,11 +1034,23 @@ PerformanceResult IssueQueries(SystemUnderTest* sut,
   double final_query_all_samples_done_time =
       DurationToSeconds(final_query.all_samples_done_time - start);
   return PerformanceResult{std::move(latencies),
+                           std::move(latency_histogram),
+                           std::move(latency_breakdown),
+                           std::move(latency_details),
+                           std::move(query_latencies),
+                           std::move(query_latency_histogram),
+                           std::move(issue_lateness_histogram),
+                           max_queries_behind,
+                           skipped_intervals,
+                           std::move(corrected_query_latency_histogram),
                            queries_issued,
                            max_latency,
                            final_query_scheduled_time,
                            final_query_issued_time,
-                           final_query_all_samples_done_time};
+                           final_query_all_samples_done_time,
+                           early_termination_verdict,
+                           latency_constraint_unmeetable,
+                           response_logger.within_target.load()};
 }
 
 // Takes the raw PerformanceResult and uses relevant context to determine
@@ -669,10 +1061,11 @@ struct PerformanceSummary {
   PerformanceResult pr;
 
   // Set by ProcessLatencies.
-  size_t sample_count;
-  QuerySampleLatency latency_min;
-  QuerySampleLatency latency_max;
-  QuerySampleLatency latency_mean;
+  bool latencies_processed = false;
+  size_t sample_count = 0;
+  QuerySampleLatency latency_min = 0;
+  QuerySampleLatency latency_max = 0;
+  QuerySampleLatency latency_mean = 0;
   struct PercentileEntry {
     const double percentile;
     QuerySampleLatency value = 0;
@@ -680,43 +1073,113 @@ struct PerformanceSummary {
   // TODO: Make .90 a spec constant and have that affect relevant strings.
   PercentileEntry latency_target{.90};
   PercentileEntry latency_percentiles[5] = {{.50}, {.90}, {.95}, {.99}, {.999}};
+  size_t query_count = 0;
+  QuerySampleLatency query_latency_min = 0;
+  QuerySampleLatency query_latency_max = 0;
+  QuerySampleLatency query_latency_mean = 0;
+  PercentileEntry query_latency_target{.90};
+  PercentileEntry query_latency_percentiles[5] = {
+      {.50}, {.90}, {.95}, {.99}, {.999}};
+  // Only set if exact_latency_percentiles is requested.
+  double histogram_max_relative_error = 0;
 
   void ProcessLatencies();
+  void ProcessLatenciesExactly();
+  void SelectExactPercentiles(std::vector<QuerySampleLatency>* latencies,
+                              std::vector<PercentileEntry*> entries);
 
   bool MinDurationMet();
   bool MinQueriesMet();
   bool MinSamplesMet();
   bool HasPerfConstraints();
+  bool TargetPercentileWithinTarget(size_t count);
   bool PerfConstraintsMet();
+  void LogScheduleAdherence(AsyncLog& log);
+  void LogLatencyBreakdown(AsyncLog& log);
   void Log(AsyncLog& log);
 };
 
 void PerformanceSummary::ProcessLatencies() {
-  if (pr.latencies.empty()) {
+  if (latencies_processed) {
     return;
   }
+  latencies_processed = true;
 
-  sample_count = pr.latencies.size();
+  const LatencyHistogram& histogram = *pr.latency_histogram;
+  sample_count = histogram.Count();
+  if (sample_count == 0) {
+    return;
+  }
 
-  QuerySampleLatency accumulated_latency = 0;
-  for (auto latency : pr.latencies) {
-    accumulated_latency += latency;
+  latency_min = histogram.Min();
+  latency_max = histogram.Max();
+  latency_mean = histogram.Mean();
+  latency_target.value = histogram.Percentile(latency_target.percentile);
+  for (auto& lp : latency_percentiles) {
+    lp.value = histogram.Percentile(lp.percentile);
   }
-  latency_mean = accumulated_latency / sample_count;
 
-  std::sort(pr.latencies.begin(), pr.latencies.end());
+  const LatencyHistogram& query_histogram = *pr.query_latency_histogram;
+  query_count = query_histogram.Count();
+  if (query_count != 0) {
+    query_latency_min = query_histogram.Min();
+    query_latency_max = query_histogram.Max();
+    query_latency_mean = query_histogram.Mean();
+    query_latency_target.value =
+        query_histogram.Percentile(query_latency_target.percentile);
+    for (auto& lp : query_latency_percentiles) {
+      lp.value = query_histogram.Percentile(lp.percentile);
+    }
+  }
+
+  if (settings.requested.exact_latency_percentiles) {
+    ProcessLatenciesExactly();
+  }
+}
 
-  latency_target.value = pr.latencies[sample_count * latency_target.percentile];
-  latency_min = pr.latencies.front();
-  latency_max = pr.latencies.back();
+void PerformanceSummary::ProcessLatenciesExactly() {
+  assert(pr.latencies.size() == sample_count);
+  std::vector<PercentileEntry*> entries{&latency_target};
   for (auto& lp : latency_percentiles) {
-    assert(lp.percentile >= 0.0);
-    assert(lp.percentile < 1.0);
-    lp.value = pr.latencies[sample_count * lp.percentile];
+    entries.push_back(&lp);
+  }
+  SelectExactPercentiles(&pr.latencies, std::move(entries));
+
+  assert(pr.query_latencies.size() == query_count);
+  if (query_count != 0) {
+    std::vector<PercentileEntry*> query_entries{&query_latency_target};
+    for (auto& lp : query_latency_percentiles) {
+      query_entries.push_back(&lp);
+    }
+    SelectExactPercentiles(&pr.query_latencies, std::move(query_entries));
+  }
+}
+
+// Replaces the percentiles of |entries| read from a histogram with exact
+// ones and records how far off the histogram was.
+void PerformanceSummary::SelectExactPercentiles(
+    std::vector<QuerySampleLatency>* latencies,
+    std::vector<PercentileEntry*> entries) {
+  const size_t count = latencies->size();
+  std::vector<size_t> ranks;
+  for (PercentileEntry* entry : entries) {
+    ranks.push_back(count * entry->percentile);
+  }
+  SelectOrderStatistics(latencies, std::move(ranks));
+
+  for (PercentileEntry* entry : entries) {
+    QuerySampleLatency exact = (*latencies)[count * entry->percentile];
+    if (exact > 0) {
+      double error =
+          std::abs(static_cast<double>(entry->value - exact)) / exact;
+      histogram_max_relative_error =
+          std::max(histogram_max_relative_error, error);
+    }
+    entry->value = exact;
   }
 
   // Clear latencies since we are done processing them.
-  pr.latencies = std::vector<QuerySampleLatency>();
+  *latencies = std::vector<QuerySampleLatency>();
 }
 
 bool PerformanceSummary::MinDurationMet() {
@@ -740,19 +1203,28 @@ bool PerformanceSummary::HasPerfConstraints() {
          settings.scenario == TestScenario::Server;
 }
 
+// The percentiles may come from the histogram, so the target percentile is
+// checked against the exact count of latencies within the target instead.
+// As in SelectExactPercentiles, it's the latency at rank
+// count * percentile of the sorted latencies.
+bool PerformanceSummary::TargetPercentileWithinTarget(size_t count) {
+  const size_t rank = count * latency_target.percentile;
+  return count == 0 || pr.latencies_within_target > rank;
+}
+
+// Must be called after ProcessLatencies.
 bool PerformanceSummary::PerfConstraintsMet() {
+  assert(latencies_processed);
   switch (settings.scenario) {
     case TestScenario::SingleStream:
       return true;
     case TestScenario::MultiStream:
     case TestScenario::MultiStreamFree: {
       // TODO: Finalize multi-stream performance targets with working group.
-      ProcessLatencies();
-      return latency_target.value <= settings.target_latency.count();
+      return TargetPercentileWithinTarget(query_count);
     }
     case TestScenario::Server: {
-      ProcessLatencies();
-      return latency_target.value <= settings.target_latency.count();
+      return TargetPercentileWithinTarget(sample_count);
       break;
     }
     case TestScenario::Offline:
@@ -762,6 +1234,70 @@ bool PerformanceSummary::PerfConstraintsMet() {
   return false;
 }
 
+void PerformanceSummary::LogScheduleAdherence(AsyncLog& log) {
+  log.LogSummary(
+      "\n"
+      "================================================\n"
+      "Schedule Adherence\n"
+      "================================================");
+  // The issue rate needs at least two queries issued at different times.
+  if (pr.queries_issued > 1 && pr.final_query_issued_time > 0) {
+    double issued_qps = (pr.queries_issued - 1) / pr.final_query_issued_time;
+    log.LogSummary("Issued QPS : ", issued_qps);
+  }
+  const LatencyHistogram& lateness = *pr.issue_lateness_histogram;
+  log.LogSummary("Issue lateness (ns) : p50 " +
+                 std::to_string(lateness.Percentile(.50)) + ", p90 " +
+                 std::to_string(lateness.Percentile(.90)) + ", p99 " +
+                 std::to_string(lateness.Percentile(.99)) + ", max " +
+                 std::to_string(lateness.Max()));
+  if (settings.scenario == TestScenario::Server) {
+    log.LogSummary("Max queries due but not issued : ",
+                   pr.max_queries_behind);
+  }
+  if (settings.scenario == TestScenario::MultiStream) {
+    size_t intervals = pr.queries_issued + pr.skipped_intervals;
+    log.LogSummary(
+        "Skipped intervals : " + std::to_string(pr.skipped_intervals) + " (" +
+        DoubleToString(100.0 * pr.skipped_intervals / intervals) + "%)");
+  }
+  const LatencyHistogram& corrected = *pr.corrected_query_latency_histogram;
+  log.LogSummary("Corrected query latency (ns) : p50 " +
+                 std::to_string(corrected.Percentile(.50)) + ", p90 " +
+                 std::to_string(corrected.Percentile(.90)) + ", p99 " +
+                 std::to_string(corrected.Percentile(.99)) + ", max " +
+                 std::to_string(corrected.Max()));
+  log.LogSummary(
+      "Issue lateness is how long after its scheduled time a query was "
+      "issued. Skipped intervals are charged to the corrected latencies.");
+}
+
+void PerformanceSummary::LogLatencyBreakdown(AsyncLog& log) {
+  log.LogSummary(
+      "\n"
+      "================================================\n"
+      "Latency Breakdown (ns)\n"
+      "================================================");
+  auto log_part = [&](const std::string& name, const std::string& label,
+                      const LatencyHistogram& part) {
+    log.LogSummary(label + " : p50 " + std::to_string(part.Percentile(.50)) +
+                   ", p90 " + std::to_string(part.Percentile(.90)) +
+                   ", p99 " + std::to_string(part.Percentile(.99)) +
+                   ", max " + std::to_string(part.Max()));
+    log.LogDetail("latency_breakdown", "part", name, "mean_ns", part.Mean(),
+                  "p50_ns", part.Percentile(.50), "p90_ns",
+                  part.Percentile(.90), "p99_ns", part.Percentile(.99),
+                  "max_ns", part.Max());
+  };
+  const LatencyBreakdown& breakdown = *pr.latency_breakdown;
+  log_part("scheduler_lateness", "Scheduler lateness",
+           breakdown.scheduler_lateness);
+  log_part("issue", "Issue blocking    ", breakdown.issue);
+  log_part("sut", "SUT               ", breakdown.sut);
+  log_part("completion_hop", "Completion hop    ", breakdown.completion_hop);
+  log.LogSummary("The completion hop isn't part of the latency.");
+}
+
 void PerformanceSummary::Log(AsyncLog& log) {
   ProcessLatencies();
 
@@ -811,7 +1347,10 @@ void PerformanceSummary::Log(AsyncLog& log) {
 
   bool min_duration_met = MinDurationMet();
   bool min_queries_met = MinQueriesMet() && MinSamplesMet();
-  bool perf_constraints_met = PerfConstraintsMet();
+  // Fail fast can end a run before the latencies show every query that
+  // would have been over the target, so the constraint is checked directly.
+  bool perf_constraints_met =
+      PerfConstraintsMet() && !pr.latency_constraint_unmeetable;
   bool all_constraints_met =
       min_duration_met && min_queries_met && perf_constraints_met;
   log.LogSummary("Result is : ", all_constraints_met ? "VALID" : "INVALID");
@@ -822,6 +1361,20 @@ void PerformanceSummary::Log(AsyncLog& log) {
   log.LogSummary("  Min duration satisfied : ",
                  min_duration_met ? "Yes" : "NO");
   log.LogSummary("  Min queries satisfied : ", min_queries_met ? "Yes" : "NO");
+  if (pr.early_termination_verdict !=
+      EarlyTerminationCheck::Verdict::Unsettled) {
+    log.LogSummary("  Ended early, with " +
+                   DoubleToString(settings.early_termination_confidence * 100) +
+                   "% confidence the latency constraint is " +
+                   (pr.early_termination_verdict ==
+                            EarlyTerminationCheck::Verdict::Met
+                        ? "met."
+                        : "NOT met."));
+  }
+  if (pr.latency_constraint_unmeetable) {
+    log.LogSummary(
+        "  Ended early, the latency constraint can no longer be met.");
+  }
 
   log.LogSummary(
       "\n"
@@ -836,6 +1389,31 @@ void PerformanceSummary::Log(AsyncLog& log) {
         DoubleToString(lp.percentile * 100) + " percentile latency (ns)   : ",
         lp.value);
   }
+  if (settings.scenario != TestScenario::Offline &&
+      (HasQueryLatencyConstraint(settings.scenario) ||
+       settings.samples_per_query > 1)) {
+    log.LogSummary("");
+    log.LogSummary("Min query latency (ns)              : ",
+                   query_latency_min);
+    log.LogSummary("Max query latency (ns)              : ",
+                   query_latency_max);
+    log.LogSummary("Mean query latency (ns)             : ",
+                   query_latency_mean);
+    for (auto& lp : query_latency_percentiles) {
+      log.LogSummary(DoubleToString(lp.percentile * 100) +
+                         " percentile query latency (ns) : ",
+                     lp.value);
+    }
+  }
+  if (settings.requested.exact_latency_percentiles) {
+    log.LogDetail("latency_histogram_max_relative_error : ",
+                  histogram_max_relative_error);
+  } else {
+    log.LogSummary("");
+    log.LogSummary(
+        "Latency percentiles are rounded up by less than 1%. The performance "
+        "constraint check uses the exact latencies.");
+  }
   if (settings.scenario == TestScenario::SingleStream) {
     double qps_w_lg = (sample_count - 1) / pr.final_query_issued_time;
     double qps_wo_lg = 1 / QuerySampleLatencyToSeconds(latency_min);
@@ -843,6 +1421,13 @@ void PerformanceSummary::Log(AsyncLog& log) {
     log.LogSummary("QPS w/ loadgen overhead  : " + DoubleToString(qps_w_lg));
     log.LogSummary("QPS w/o loadgen overhead : " + DoubleToString(qps_wo_lg));
   }
+  if (sample_count != 0 && (settings.scenario == TestScenario::Server ||
+                            settings.scenario == TestScenario::MultiStream)) {
+    LogScheduleAdherence(log);
+  }
+  if (sample_count != 0) {
+    LogLatencyBreakdown(log);
+  }
 
   log.LogSummary(
       "\n"
@@ -866,6 +1451,152 @@ void LoadSamplesToRam(QuerySampleLibrary* qsl,
   qsl->LoadSamplesToRam(samples);
 }
 
+// Runs a performance phase on samples that are already loaded.
+template <TestScenario scenario>
+PerformanceSummary RunPerformancePhase(SystemUnderTest* sut,
+                                       const TestSettingsInternal& settings,
+                                       const LoadableSampleSet& performance_set,
+                                       SequenceGen* sequence_gen) {
+  PerformanceResult pr(IssueQueries<scenario, TestMode::PerformanceOnly>(
+      sut, settings, performance_set, sequence_gen));
+
+  if (sut->WantsLatencyResults()) {
+    sut->ReportLatencyResults(pr.latencies);
+  }
+  if (pr.latency_details) {
+    sut->ReportLatencyDetails(pr.latency_details->Report());
+    pr.latency_details.reset();
+  }
+  if (!settings.requested.exact_latency_percentiles) {
+    // The summary only needs the histogram.
+    pr.latencies = std::vector<QuerySampleLatency>();
+  }
+  return PerformanceSummary{sut->Name(), settings, std::move(pr)};
+}
+
+// The requested settings with the values |settings| already validated, so
+// the settings derived for other phases don't report them again.
+TestSettings ValidatedRequest(const TestSettingsInternal& settings) {
+  TestSettings requested = settings.requested;
+  requested.early_termination = settings.early_termination;
+  requested.fail_fast = settings.fail_fast;
+  requested.calibrate_expected_performance =
+      settings.calibrate_expected_performance;
+  requested.calibration_duration_ms = settings.calibration_duration.count();
+  requested.peak_performance_probe_duration_ms =
+      settings.peak_performance_probe_duration.count();
+  requested.peak_performance_tolerance = settings.peak_performance_tolerance;
+  requested.peak_performance_min_load = settings.peak_performance_min_load;
+  requested.peak_performance_max_load = settings.peak_performance_max_load;
+  return requested;
+}
+
+// Issues the requested warm-up traffic on the loaded performance set, and
+// discards its results.
+template <TestScenario scenario>
+void RunWarmUp(SystemUnderTest* sut, const TestSettingsInternal& settings,
+               const LoadableSampleSet& performance_set,
+               SequenceGen* sequence_gen) {
+  const TestSettings& requested = settings.requested;
+  if (requested.warmup_duration_ms == 0 && requested.warmup_query_count == 0) {
+    return;
+  }
+
+  TestSettings warmup_requested = ValidatedRequest(settings);
+  warmup_requested.min_duration_ms = requested.warmup_duration_ms;
+  warmup_requested.min_query_count = requested.warmup_query_count;
+  warmup_requested.max_duration_ms = 0;
+  warmup_requested.max_query_count = 0;
+  warmup_requested.early_termination = false;
+  warmup_requested.fail_fast = false;
+  warmup_requested.calibrate_expected_performance = false;
+  TestSettingsInternal warmup_settings(warmup_requested);
+  warmup_settings.discarded_phase = "Warm-up";
+
+  LogDetail([](AsyncLog& log) { log.LogDetail("Starting warm-up:"); });
+  size_t queries_issued = 0;
+  double duration = 0;
+  {
+    auto trace = MakeScopedTracer(
+        [](AsyncLog& log) { log.ScopedTrace("WarmUp"); });
+    PerformanceResult pr(IssueQueries<scenario, TestMode::PerformanceOnly>(
+        sut, warmup_settings, performance_set, sequence_gen));
+    queries_issued = pr.queries_issued;
+    duration = pr.final_query_all_samples_done_time;
+  }
+  LogDetail([queries_issued, duration](AsyncLog& log) {
+    log.LogDetail("Warm-up done, its latencies are discarded.", "queries",
+                  queries_issued, "duration_s", duration);
+  });
+}
+
+// Measures the SUT on the loaded performance set for the calibration
+// duration, and returns |settings| with the measured expected latency or
+// QPS. A probe that ends well short of the calibration duration, because the
+// expected value generated too few queries, is rerun with the value it
+// measured.
+template <TestScenario scenario>
+TestSettingsInternal CalibrateExpectedPerformance(
+    SystemUnderTest* sut, const TestSettingsInternal& settings,
+    const LoadableSampleSet& performance_set, SequenceGen* sequence_gen) {
+  constexpr int kMaxProbes = 4;
+  const bool single_stream = scenario == TestScenario::SingleStream;
+  const char* calibrated_name = single_stream
+                                    ? "single_stream_expected_latency_ns"
+                                    : "offline_expected_qps";
+  TestSettings calibrated = ValidatedRequest(settings);
+  const double calibration_duration =
+      DurationToSeconds(settings.calibration_duration);
+
+  LogDetail([](AsyncLog& log) { log.LogDetail("Starting calibration:"); });
+  auto trace = MakeScopedTracer(
+      [](AsyncLog& log) { log.ScopedTrace("Calibration"); });
+  for (int probe = 0; probe < kMaxProbes; probe++) {
+    TestSettings probe_requested = calibrated;
+    probe_requested.min_duration_ms = settings.calibration_duration.count();
+    probe_requested.min_query_count = 1;
+    probe_requested.max_duration_ms = 0;
+    probe_requested.max_query_count = 0;
+    probe_requested.early_termination = false;
+    probe_requested.fail_fast = false;
+    probe_requested.calibrate_expected_performance = false;
+    TestSettingsInternal probe_settings(probe_requested);
+    probe_settings.discarded_phase = "Calibration";
+
+    PerformanceResult pr(IssueQueries<scenario, TestMode::PerformanceOnly>(
+        sut, probe_settings, performance_set, sequence_gen));
+    const double duration = pr.final_query_all_samples_done_time;
+    if (duration > 0) {
+      if (single_stream) {
+        calibrated.single_stream_expected_latency_ns = std::max<uint64_t>(
+            1, duration * std::nano::den / pr.queries_issued);
+      } else {
+        calibrated.offline_expected_qps =
+            pr.queries_issued * probe_settings.samples_per_query / duration;
+      }
+    }
+    LogDetail([probe, duration, calibrated_name,
+               measured = single_stream
+                              ? calibrated.single_stream_expected_latency_ns
+                              : calibrated.offline_expected_qps](
+                  AsyncLog& log) {
+      log.LogDetail("Calibration probe done.", "probe", probe, "duration_s",
+                    duration, calibrated_name, measured);
+    });
+    if (duration >= calibration_duration / 2) {
+      break;
+    }
+  }
+
+  LogDetail([calibrated_name,
+             value = single_stream
+                         ? calibrated.single_stream_expected_latency_ns
+                         : calibrated.offline_expected_qps](AsyncLog& log) {
+    log.LogDetail(std::string("Calibrated ") + calibrated_name + " : ", value);
+  });
+  return TestSettingsInternal(calibrated);
+}
+
 template <TestScenario scenario>
 void RunPerformanceMode(SystemUnderTest* sut, QuerySampleLibrary* qsl,
                         const TestSettingsInternal& settings,
@@ -877,15 +1608,147 @@ void RunPerformanceMode(SystemUnderTest* sut, QuerySampleLibrary* qsl,
   const LoadableSampleSet& performance_set = loadable_sets.front();
   LoadSamplesToRam(qsl, performance_set.set);
 
-  PerformanceResult pr(IssueQueries<scenario, TestMode::PerformanceOnly>(
-      sut, settings, performance_set, sequence_gen));
+  RunWarmUp<scenario>(sut, settings, performance_set, sequence_gen);
+  if (settings.calibrate_expected_performance) {
+    TestSettingsInternal calibrated_settings =
+        CalibrateExpectedPerformance<scenario>(sut, settings, performance_set,
+                                               sequence_gen);
+    Log([perf_summary = RunPerformancePhase<scenario>(
+             sut, calibrated_settings, performance_set, sequence_gen)](
+            AsyncLog& log) mutable { perf_summary.Log(log); });
+  } else {
+    Log([perf_summary = RunPerformancePhase<scenario>(
+             sut, settings, performance_set, sequence_gen)](
+            AsyncLog& log) mutable { perf_summary.Log(log); });
+  }
 
-  sut->ReportLatencyResults(pr.latencies);
+  qsl->UnloadSamplesFromRam(performance_set.set);
+  DrainLogSinks();
+}
 
-  Log([perf_summary = PerformanceSummary{sut->Name(), settings, std::move(pr)}](
-          AsyncLog& log) mutable { perf_summary.Log(log); });
+// The load FindPeakPerformance mode searches for the highest passing value
+// of. Scenarios without a specialization don't support the mode.
+template <TestScenario scenario>
+struct PeakPerformanceLoad {
+  static constexpr bool kSupported = false;
+  static const char* Name() { return ""; }
+  static const char* SummaryName() { return ""; }
+  static double Initial(const TestSettingsInternal&) { return 0; }
+  static double Floor(const TestSettingsInternal&) { return 0; }
+  static double Ceiling(const TestSettingsInternal&,
+                        const LoadableSampleSet&) {
+    return 0;
+  }
+  static void Apply(double, TestSettings*) {}
+  static double Next(double, double, const TestSettingsInternal&) {
+    return 0;
+  }
+};
 
-  qsl->UnloadSamplesFromRam(performance_set.set);
+// Server searches QPS, to within the tolerance.
+template <>
+struct PeakPerformanceLoad<TestScenario::Server> {
+  static constexpr bool kSupported = true;
+  static const char* Name() { return "target_qps"; }
+  static const char* SummaryName() { return "QPS"; }
+  static double Initial(const TestSettingsInternal& settings) {
+    return settings.target_qps;
+  }
+  static double Floor(const TestSettingsInternal& settings) {
+    return settings.peak_performance_min_load;
+  }
+  static double Ceiling(const TestSettingsInternal& settings,
+                        const LoadableSampleSet&) {
+    return settings.peak_performance_max_load;
+  }
+  static void Apply(double load, TestSettings* requested) {
+    requested->server_target_qps = load;
+  }
+  static double Next(double passed, double failed,
+                     const TestSettingsInternal& settings) {
+    if (failed == 0) {
+      return passed * 2;
+    }
+    if (passed == 0) {
+      return failed / 2;
+    }
+    if (failed - passed > settings.peak_performance_tolerance * passed) {
+      return (passed + failed) / 2;
+    }
+    return 0;
+  }
+};
+
+// MultiStream searches samples per query, exactly. A query can hold every
+// sample of the performance set, since GenerateLoadableSets pads the set
+// for that in this mode.
+template <>
+struct PeakPerformanceLoad<TestScenario::MultiStream> {
+  static constexpr bool kSupported = true;
+  static const char* Name() { return "samples_per_query"; }
+  static const char* SummaryName() { return "samples per query"; }
+  static double Initial(const TestSettingsInternal& settings) {
+    return std::max(settings.samples_per_query, 1);
+  }
+  static double Floor(const TestSettingsInternal& settings) {
+    return std::ceil(settings.peak_performance_min_load);
+  }
+  static double Ceiling(const TestSettingsInternal& settings,
+                        const LoadableSampleSet& performance_set) {
+    return std::min(
+        std::floor(settings.peak_performance_max_load),
+        static_cast<double>(performance_set.sample_distribution_end));
+  }
+  static void Apply(double load, TestSettings* requested) {
+    requested->multi_stream_samples_per_query = static_cast<int>(load);
+  }
+  static double Next(double passed, double failed,
+                     const TestSettingsInternal&) {
+    if (failed == 0) {
+      return passed * 2;
+    }
+    if (passed == 0) {
+      return std::floor(failed / 2);
+    }
+    if (failed - passed > 1) {
+      return std::floor((passed + failed) / 2);
+    }
+    return 0;
+  }
+};
+
+// Runs a short FindPeakPerformance probe and returns whether it met the
+// latency constraint for its whole duration.
+template <TestScenario scenario>
+bool RunPeakPerformanceProbe(SystemUnderTest* sut,
+                             const TestSettings& probe_requested,
+                             const LoadableSampleSet& performance_set,
+                             SequenceGen* sequence_gen, size_t probe_index,
+                             double load) {
+  TestSettingsInternal probe_settings(probe_requested);
+  probe_settings.peak_performance_probe = true;
+
+  PerformanceSummary probe{
+      sut->Name(), probe_settings,
+      IssueQueries<scenario, TestMode::PerformanceOnly>(
+          sut, probe_settings, performance_set, sequence_gen)};
+  probe.ProcessLatencies();
+  const bool passed = probe.PerfConstraintsMet() && probe.MinDurationMet();
+
+  LogDetail([probe_index, passed, load, sample_count = probe.sample_count,
+             latency = HasQueryLatencyConstraint(scenario)
+                           ? probe.query_latency_target.value
+                           : probe.latency_target.value,
+             duration = probe.pr.final_query_issued_time,
+             ended_early = !probe.MinDurationMet()](
+                AsyncLog& log) {
+    log.LogDetail("Peak performance probe: ", "probe", probe_index,
+                  PeakPerformanceLoad<scenario>::Name(), load, "result",
+                  passed ? "PASS" : "FAIL", "samples", sample_count,
+                  "90th_percentile_latency_ns", latency, "duration_s",
+                  duration, "ended_early", ended_early);
+  });
+  return passed;
 }
 
 template <TestScenario scenario>
@@ -894,28 +1757,206 @@ void FindPeakPerformanceMode(
     const TestSettingsInternal& settings,
     const std::vector<LoadableSampleSet>& loadable_sets,
     SequenceGen* sequence_gen) {
+  using Load = PeakPerformanceLoad<scenario>;
+  if (!Load::kSupported) {
+    LogError([](AsyncLog& log) {
+      log.LogDetail(
+          "FindPeakPerformance mode is only supported for the Server and "
+          "MultiStream scenarios.");
+    });
+    return;
+  }
+
   LogDetail([](AsyncLog& log) {
     log.LogDetail("Starting FindPeakPerformance mode:");
   });
 
   // Use first loadable set as the performance set.
+  // It stays loaded for all the probes and confirmation runs.
   const LoadableSampleSet& performance_set = loadable_sets.front();
 
   LoadSamplesToRam(qsl, performance_set.set);
 
-  TestSettingsInternal search_settings = settings;
+  RunWarmUp<scenario>(sut, settings, performance_set, sequence_gen);
+
+  // Probes and confirmation runs use the sanitized search settings, so
+  // invalid values are only reported once.
+  const TestSettings search_requested = ValidatedRequest(settings);
+
+  TestSettings probe_requested = search_requested;
+  probe_requested.min_duration_ms =
+      settings.peak_performance_probe_duration.count();
+  probe_requested.min_query_count = 0;
+  probe_requested.early_termination = true;
+  probe_requested.fail_fast = true;
+
+  // The load grows or shrinks exponentially until a probe passes and
+  // another fails, then is bisected between them. A confirmation run that
+  // fails counts as a failed probe and the search resumes below it.
+  // The search fails once it would cross the floor or the ceiling from a
+  // probe already run there.
+  constexpr size_t kMaxProbes = 64;
+  constexpr size_t kMaxConfirmationRuns = 3;
+  constexpr size_t kMaxConsecutiveFailures = 3;
+  const double floor = Load::Floor(settings);
+  const double ceiling = Load::Ceiling(settings, performance_set);
+  std::vector<double> passed_history;  // Ascending.
+  double passed = 0;  // 0 until a probe passes.
+  double failed = 0;  // 0 until a probe fails.
+  size_t probe_count = 0;
+  size_t confirmation_count = 0;
+  size_t consecutive_failures = 0;  // Only counted until a probe passes.
+  std::string search_error;
+
+  // Keeps the next load within the bounds, or returns 0 if the search is
+  // over.
+  auto bounded = [&](double load) {
+    if (load > ceiling) {
+      if (passed < ceiling) {
+        return ceiling;
+      }
+      search_error = "A probe passed at the ceiling of the search.";
+      return 0.0;
+    }
+    if (load != 0 && load < floor) {
+      if (failed > floor) {
+        return floor;
+      }
+      search_error = "No probe passed at the floor of the search.";
+      return 0.0;
+    }
+    return load;
+  };
 
-  bool still_searching = true;
-  while (still_searching) {
-    PerformanceResult pr(IssueQueries<scenario, TestMode::PerformanceOnly>(
-        sut, search_settings, performance_set, sequence_gen));
-    PerformanceSummary perf_summary{sut->Name(), search_settings,
-                                    std::move(pr)};
+  double load = std::max(floor, std::min(Load::Initial(settings), ceiling));
+  if (floor > ceiling) {
+    search_error = "The floor of the search is above its ceiling.";
+    load = 0;
+  }
+  while (true) {
+    while (load != 0 && probe_count < kMaxProbes) {
+      Load::Apply(load, &probe_requested);
+      if (RunPeakPerformanceProbe<scenario>(sut, probe_requested,
+                                            performance_set, sequence_gen,
+                                            probe_count++, load)) {
+        passed = load;
+        passed_history.push_back(load);
+      } else {
+        failed = load;
+      }
+      consecutive_failures = passed == 0 ? consecutive_failures + 1 : 0;
+      if (consecutive_failures == kMaxConsecutiveFailures) {
+        search_error = "No probe passed in " +
+                       std::to_string(kMaxConsecutiveFailures) + " tries.";
+        break;
+      }
+      load = bounded(Load::Next(passed, failed, settings));
+    }
+
+    if (search_error.empty() && passed == 0) {
+      search_error = "No probe passed.";
+    }
+    if (!search_error.empty()) {
+      LogError([search_error](AsyncLog& log) {
+        log.LogDetail("Peak performance search failed: " + search_error);
+      });
+      Log([search_error, floor, ceiling, passed, failed, probe_count,
+           confirmation_count](AsyncLog& log) {
+        log.LogSummary(
+            "================================================\n"
+            "Peak Performance Search\n"
+            "================================================");
+        log.LogSummary("Probes run : ", probe_count);
+        log.LogSummary("Confirmation runs : ", confirmation_count);
+        log.LogSummary("Result is : INVALID");
+        log.LogSummary("  Search failed : " + search_error);
+        log.LogSummary(std::string("Search floor ") + Load::SummaryName() +
+                           " : ",
+                       floor);
+        log.LogSummary(std::string("Search ceiling ") + Load::SummaryName() +
+                           " : ",
+                       ceiling);
+        if (passed != 0) {
+          log.LogSummary(
+              std::string("Highest passing ") + Load::SummaryName() + " : ",
+              passed);
+        }
+        if (failed != 0) {
+          log.LogSummary(
+              std::string("Lowest failing ") + Load::SummaryName() + " : ",
+              failed);
+        }
+      });
+      break;
+    }
+
+    TestSettings confirm_requested = search_requested;
+    Load::Apply(passed, &confirm_requested);
+    TestSettingsInternal confirm_settings(confirm_requested);
+    PerformanceSummary confirmation(RunPerformancePhase<scenario>(
+        sut, confirm_settings, performance_set, sequence_gen));
+    confirmation_count++;
+    confirmation.ProcessLatencies();
+    const bool confirmed = confirmation.PerfConstraintsMet() &&
+                           confirmation.MinDurationMet() &&
+                           confirmation.MinQueriesMet() &&
+                           confirmation.MinSamplesMet();
+    LogDetail([confirmation_count, confirmed, passed](AsyncLog& log) {
+      log.LogDetail("Peak performance confirmation run: ", "run",
+                    confirmation_count, Load::Name(), passed, "result",
+                    confirmed ? "PASS" : "FAIL");
+    });
+
+    if (confirmed || confirmation_count == kMaxConfirmationRuns ||
+        probe_count == kMaxProbes) {
+      Log([confirmation = std::move(confirmation), confirmed, passed, failed,
+           probe_count, confirmation_count](AsyncLog& log) mutable {
+        confirmation.Log(log);
+        log.LogSummary(
+            "\n"
+            "================================================\n"
+            "Peak Performance Search\n"
+            "================================================");
+        log.LogSummary("Probes run : ", probe_count);
+        log.LogSummary("Confirmation runs : ", confirmation_count);
+        log.LogSummary(std::string("Peak ") + Load::SummaryName() + " : ",
+                       passed);
+        log.LogSummary("  Confirmed : ", confirmed ? "Yes" : "NO");
+        if (failed != 0) {
+          log.LogSummary(
+              std::string("Lowest failing ") + Load::SummaryName() + " : ",
+              failed);
+        }
+        log.LogSummary(
+            "The results above are from the last confirmation run, at the "
+            "peak load.");
+      });
+      break;
+    }
+
+    // The probes were too short to show the SUT falling behind.
+    failed = passed;
+    passed_history.pop_back();
+    passed = passed_history.empty() ? 0 : passed_history.back();
+    load = bounded(Load::Next(passed, failed, settings));
   }
 
   qsl->UnloadSamplesFromRam(performance_set.set);
+  DrainLogSinks();
 }
 
+// Joins |thread| once it goes out of scope, so no exit path destroys it
+// while it's still joinable.
+struct JoinOnExitThread {
+  ~JoinOnExitThread() { Join(); }
+  void Join() {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+  std::thread thread;
+};
+
 template <TestScenario scenario>
 void RunAccuracyMode(SystemUnderTest* sut, QuerySampleLibrary* qsl,
                      const TestSettingsInternal& settings,
@@ -923,13 +1964,30 @@ void RunAccuracyMode(SystemUnderTest* sut, QuerySampleLibrary* qsl,
                      SequenceGen* sequence_gen) {
   LogDetail([](AsyncLog& log) { log.LogDetail("Starting accuracy mode:"); });
 
-  for (auto& loadable_set : loadable_sets) {
-    {
-      auto trace =
-          MakeScopedTracer([count = loadable_set.set.size()](AsyncLog& log) {
-            log.ScopedTrace("LoadSamples", "count", count);
-          });
-      LoadSamplesToRam(qsl, loadable_set.set);
+  auto load = [qsl](const LoadableSampleSet& loadable_set) {
+    auto trace =
+        MakeScopedTracer([count = loadable_set.set.size()](AsyncLog& log) {
+          log.ScopedTrace("LoadSamples", "count", count);
+        });
+    LoadSamplesToRam(qsl, loadable_set.set);
+  };
+
+  // With double buffering, the next set loads on |next_load| while the
+  // current one is issued, so at most two sets are loaded at a time.
+  const bool double_buffered =
+      settings.requested.accuracy_double_buffered_loading;
+  JoinOnExitThread next_load;
+  for (size_t i = 0; i < loadable_sets.size(); i++) {
+    const LoadableSampleSet& loadable_set = loadable_sets[i];
+    if (next_load.thread.joinable()) {
+      auto trace = MakeScopedTracer(
+          [](AsyncLog& log) { log.ScopedTrace("WaitForLoadSamples"); });
+      next_load.Join();
+    } else {
+      load(loadable_set);
+    }
+    if (double_buffered && i + 1 < loadable_sets.size()) {
+      next_load.thread = std::thread(load, std::cref(loadable_sets[i + 1]));
     }
 
     PerformanceResult pr(IssueQueries<scenario, TestMode::AccuracyOnly>(
@@ -943,6 +2001,7 @@ void RunAccuracyMode(SystemUnderTest* sut, QuerySampleLibrary* qsl,
       qsl->UnloadSamplesFromRam(loadable_set.set);
     }
   }
+  DrainLogSinks();
 }
 
 // Routes runtime scenario requests to the corresponding instances of its
@@ -1011,9 +2070,14 @@ std::vector<LoadableSampleSet> GenerateLoadableSets(
 
   // Partition the samples into loadable sets.
   const size_t set_size = qsl->PerformanceSampleCount();
+  // The MultiStream peak search pads for queries of up to a whole set.
+  const bool pad_for_peak_search =
+      settings.scenario == TestScenario::MultiStream &&
+      settings.mode == TestMode::FindPeakPerformance;
   const size_t set_padding =
-      (settings.scenario == TestScenario::MultiStream ||
-       settings.scenario == TestScenario::MultiStreamFree)
+      pad_for_peak_search ? set_size - 1
+      : (settings.scenario == TestScenario::MultiStream ||
+         settings.scenario == TestScenario::MultiStreamFree)
           ? settings.samples_per_query - 1
           : 0;
   std::vector<QuerySampleIndex> loadable_set;
@@ -1045,6 +2109,8 @@ std::vector<LoadableSampleSet> GenerateLoadableSets(
       // assignment happens. Even though we should have reserved enough
       // elements above, copy the source first anyway since we are just moving
       // integers around.
+      // A set smaller than the padding repeats, since this also reads the
+      // padding already added.
       QuerySampleIndex p = set[i];
       set.push_back(p);
     }
@@ -1054,8 +2120,9 @@ std::vector<LoadableSampleSet> GenerateLoadableSets(
 }
 
 struct LogOutputs {
-  LogOutputs(const LogOutputSettings& output_settings,
-             const std::string& test_date_time) {
+  LogOutputs(const LogOutputSettings& output_settings, bool enable_trace,
+             TraceFormat trace_format, bool enable_time_series,
+             bool enable_latency_export, const std::string& test_date_time) {
     std::string prefix = output_settings.outdir;
     prefix += "/" + output_settings.prefix;
     if (output_settings.prefix_with_datetime) {
@@ -1063,37 +2130,74 @@ struct LogOutputs {
     }
     const std::string& suffix = output_settings.suffix;
 
-    summary_out.open(prefix + "summary" + suffix + ".txt");
-    detail_out.open(prefix + "detail" + suffix + ".txt");
-    accuracy_out.open(prefix + "accuracy" + suffix + ".json");
-    trace_out.open(prefix + "trace" + suffix + ".json");
+    summary_out = MakeLogSink(output_settings.summary_sink,
+                              prefix + "summary" + suffix + ".txt", false);
+    detail_out = MakeLogSink(output_settings.detail_sink,
+                             prefix + "detail" + suffix + ".txt", false);
+    accuracy_out = MakeLogSink(output_settings.accuracy_sink,
+                               prefix + "accuracy" + suffix + ".json", false);
+    if (enable_trace && trace_format == TraceFormat::Binary) {
+      trace_out = MakeLogSink(output_settings.trace_sink,
+                              prefix + "trace" + suffix + ".bin", true);
+    } else if (enable_trace) {
+      trace_out = MakeLogSink(output_settings.trace_sink,
+                              prefix + "trace" + suffix + ".json", false);
+    }
+    if (enable_time_series) {
+      time_series_out =
+          MakeLogSink(output_settings.time_series_sink,
+                      prefix + "timeseries" + suffix + ".csv", false);
+    }
+    if (enable_latency_export) {
+      latencies_out =
+          MakeLogSink(output_settings.latency_export_sink,
+                      prefix + "latencies" + suffix + ".bin", true);
+      latency_histogram_out =
+          MakeLogSink(output_settings.latency_export_sink,
+                      prefix + "latency_histogram" + suffix + ".json", false);
+    }
   }
 
   bool CheckOutputs() {
     bool all_ofstreams_good = true;
-    if (!summary_out.good()) {
+    if (!summary_out->good()) {
       all_ofstreams_good = false;
       std::cerr << "LoadGen: Failed to open summary file.";
     }
-    if (!detail_out.good()) {
+    if (!detail_out->good()) {
       all_ofstreams_good = false;
       std::cerr << "LoadGen: Failed to open detailed log file.";
     }
-    if (!accuracy_out.good()) {
+    if (!accuracy_out->good()) {
       all_ofstreams_good = false;
       std::cerr << "LoadGen: Failed to open accuracy log file.";
     }
-    if (!trace_out.good()) {
+    if (trace_out && !trace_out->good()) {
       all_ofstreams_good = false;
       std::cerr << "LoadGen: Failed to open trace file.";
     }
+    if (time_series_out && !time_series_out->good()) {
+      all_ofstreams_good = false;
+      std::cerr << "LoadGen: Failed to open time series file.";
+    }
+    if (latencies_out && !latencies_out->good()) {
+      all_ofstreams_good = false;
+      std::cerr << "LoadGen: Failed to open latencies file.";
+    }
+    if (latency_histogram_out && !latency_histogram_out->good()) {
+      all_ofstreams_good = false;
+      std::cerr << "LoadGen: Failed to open latency histogram file.";
+    }
     return all_ofstreams_good;
   }
 
-  std::ofstream summary_out;
-  std::ofstream detail_out;
-  std::ofstream accuracy_out;
-  std::ofstream trace_out;
+  std::unique_ptr<std::ostream> summary_out;
+  std::unique_ptr<std::ostream> detail_out;
+  std::unique_ptr<std::ostream> accuracy_out;
+  std::unique_ptr<std::ostream> trace_out;
+  std::unique_ptr<std::ostream> time_series_out;
+  std::unique_ptr<std::ostream> latencies_out;
+  std::unique_ptr<std::ostream> latency_histogram_out;
 };
 
 void StartTest(SystemUnderTest* sut, QuerySampleLibrary* qsl,
@@ -1103,16 +2207,28 @@ void StartTest(SystemUnderTest* sut, QuerySampleLibrary* qsl,
 
   const std::string test_date_time = CurrentDateTimeISO8601();
 
-  LogOutputs log_outputs(log_settings.log_output, test_date_time);
+  LogOutputs log_outputs(log_settings.log_output, log_settings.enable_trace,
+                         log_settings.trace_format,
+                         log_settings.time_series_window_ms != 0,
+                         log_settings.enable_latency_export, test_date_time);
   if (!log_outputs.CheckOutputs()) {
     return;
   }
+  GlobalLiveMetrics().StartTest();
+
+  GlobalLogger().ApplyLogSettings(log_settings);
 
-  GlobalLogger().StartLogging(&log_outputs.summary_out, &log_outputs.detail_out,
-                              &log_outputs.accuracy_out,
+  GlobalLogger().StartLogging(log_outputs.summary_out.get(),
+                              log_outputs.detail_out.get(),
+                              log_outputs.accuracy_out.get(),
+                              log_outputs.time_series_out.get(),
                               log_settings.log_output.copy_detail_to_stdout,
                               log_settings.log_output.copy_summary_to_stdout);
-  GlobalLogger().StartNewTrace(&log_outputs.trace_out, PerfClock::now());
+  GlobalLogger().StartLatencyExport(log_outputs.latencies_out.get(),
+                                    log_outputs.latency_histogram_out.get());
+  GlobalLogger().StartNewTrace(
+      log_outputs.trace_out.get(),
+      PerfClock::now(), log_settings.trace_format);
 
   LogLoadgenVersion();
   LogDetail([sut, qsl, test_date_time](AsyncLog& log) {
@@ -1156,6 +2272,9 @@ void StartTest(SystemUnderTest* sut, QuerySampleLibrary* qsl,
   GlobalLogger().StopLogging();
   GlobalLogger().StopTracing();
   GlobalLogger().StopIOThread();
+  GlobalLiveMetrics().EndTest();
 }
 
+LiveMetrics GetLiveMetrics() { return GlobalLiveMetrics().Snapshot(); }
+
 }  // namespace mlperf
@@ -17,6 +17,7 @@ limitations under the License.
 
 namespace mlperf {
 
+struct LiveMetrics;
 struct QuerySampleResponse;
 class QuerySampleLibrary;
 class SystemUnderTest;
@@ -38,6 +39,10 @@ void StartTest(SystemUnderTest* sut, QuerySampleLibrary* qsl,
                const TestSettings& requested_settings,
                const LogSettings& log_settings);
 
+// Returns the metrics of the test that is currently running, as defined in
+// live_metrics.h. Safe to call from any thread, at any time.
+LiveMetrics GetLiveMetrics();
+
 }  // namespace mlperf
 
 #endif  // MLPERF_LOADGEN_LOADGEN_H_
@@ -0,0 +1,247 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "log_sink.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <streambuf>
+#include <vector>
+
+#if defined(_WIN32) || defined(WIN32) || defined(_WIN64) || defined(WIN64)
+#define MLPERF_LOG_SINK_USE_STDIO
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace mlperf {
+
+namespace {
+
+// O_DIRECT requires the buffer address, size, and file offset of every write
+// to be aligned. 4KiB covers the logical block size of common devices.
+constexpr size_t kBlockAlignment = 4096;
+constexpr size_t kBlockBufferSize = 4 * 1024 * 1024;
+
+// Accumulates output into a large aligned buffer and only writes it to the
+// file once the buffer is full or the sink is drained.
+// A direct sink writes full blocks with O_DIRECT, bypassing the page cache,
+// and falls back to normal writes where O_DIRECT isn't supported.
+class LargeBlockSinkBuf : public std::streambuf {
+ public:
+  LargeBlockSinkBuf(const std::string& path, bool binary, bool direct);
+  ~LargeBlockSinkBuf() override;
+
+  bool IsOpen() const;
+  // Returns false if the write failed.
+  bool Drain() { return WriteBuffer(true); }
+
+ protected:
+  int_type overflow(int_type c) override {
+    if (!WriteBuffer(false)) {
+      return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  // The IOThread flushes its outputs every time it polls. Wait for a full
+  // block instead.
+  int sync() override { return 0; }
+
+ private:
+  bool WriteBuffer(bool include_partial_block);
+
+  std::vector<char> storage_;
+  char* buffer_ = nullptr;
+  // The file offset of buffer_[0].
+  uint64_t file_offset_ = 0;
+  bool failed_ = false;
+
+#if defined(MLPERF_LOG_SINK_USE_STDIO)
+  std::FILE* file_ = nullptr;
+#else
+  bool WriteAt(int fd, const char* data, size_t size, uint64_t offset);
+  int fd_ = -1;
+  int direct_fd_ = -1;
+#endif
+};
+
+LargeBlockSinkBuf::LargeBlockSinkBuf(const std::string& path, bool binary,
+                                     bool direct)
+    : storage_(kBlockBufferSize + kBlockAlignment) {
+  uintptr_t storage = reinterpret_cast<uintptr_t>(storage_.data());
+  buffer_ = storage_.data() + (kBlockAlignment - storage % kBlockAlignment) %
+                                  kBlockAlignment;
+  setp(buffer_, buffer_ + kBlockBufferSize);
+
+#if defined(MLPERF_LOG_SINK_USE_STDIO)
+  (void)direct;
+  file_ = std::fopen(path.c_str(), binary ? "wb" : "w");
+#else
+  (void)binary;
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#if defined(O_DIRECT)
+  if (fd_ >= 0 && direct) {
+    // Fails on file systems that don't support O_DIRECT, such as tmpfs.
+    direct_fd_ = open(path.c_str(), O_WRONLY | O_DIRECT);
+  }
+#else
+  (void)direct;
+#endif
+#endif
+}
+
+LargeBlockSinkBuf::~LargeBlockSinkBuf() {
+  Drain();
+#if defined(MLPERF_LOG_SINK_USE_STDIO)
+  if (file_) {
+    std::fclose(file_);
+  }
+#else
+  if (direct_fd_ >= 0) {
+    close(direct_fd_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+#endif
+}
+
+bool LargeBlockSinkBuf::IsOpen() const {
+#if defined(MLPERF_LOG_SINK_USE_STDIO)
+  return file_ != nullptr;
+#else
+  return fd_ >= 0;
+#endif
+}
+
+bool LargeBlockSinkBuf::WriteBuffer(bool include_partial_block) {
+  if (failed_ || !IsOpen()) {
+    return false;
+  }
+
+  const size_t size = pptr() - pbase();
+  // The bytes at the front of the buffer that don't need to be written again.
+  size_t written = 0;
+  bool success = true;
+
+#if defined(MLPERF_LOG_SINK_USE_STDIO)
+  success = std::fwrite(buffer_, 1, size, file_) == size &&
+            (!include_partial_block || std::fflush(file_) == 0);
+  written = size;
+#else
+  if (direct_fd_ >= 0) {
+    const size_t aligned_size = size - size % kBlockAlignment;
+    if (WriteAt(direct_fd_, buffer_, aligned_size, file_offset_)) {
+      written = aligned_size;
+    } else {
+      // Some file systems only reject O_DIRECT once written to.
+      close(direct_fd_);
+      direct_fd_ = -1;
+    }
+  }
+
+  if (direct_fd_ < 0) {
+    success = WriteAt(fd_, buffer_, size, file_offset_);
+    written = size;
+  } else if (include_partial_block && written != size) {
+    // Write the partial block through the page cache, but keep it buffered
+    // so it's written again as part of a full block. That keeps the offsets
+    // of all direct writes aligned.
+    success = WriteAt(fd_, buffer_ + written, size - written,
+                      file_offset_ + written);
+  }
+#endif
+
+  if (!success) {
+    failed_ = true;
+    std::cerr << "LoadGen: Failed to write log file.\n";
+    return false;
+  }
+
+  file_offset_ += written;
+  std::memmove(buffer_, buffer_ + written, size - written);
+  setp(buffer_, buffer_ + kBlockBufferSize);
+  pbump(static_cast<int>(size - written));
+  return true;
+}
+
+#if !defined(MLPERF_LOG_SINK_USE_STDIO)
+bool LargeBlockSinkBuf::WriteAt(int fd, const char* data, size_t size,
+                                uint64_t offset) {
+  while (size > 0) {
+    ssize_t result = pwrite(fd, data, size, offset);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += result;
+    size -= result;
+    offset += result;
+  }
+  return true;
+}
+#endif
+
+class LargeBlockSink : public std::ostream {
+ public:
+  LargeBlockSink(const std::string& path, bool binary, bool direct)
+      : std::ostream(nullptr), buf_(path, binary, direct) {
+    rdbuf(&buf_);
+    if (!buf_.IsOpen()) {
+      setstate(std::ios::failbit);
+    }
+  }
+
+ private:
+  LargeBlockSinkBuf buf_;
+};
+
+}  // namespace
+
+std::unique_ptr<std::ostream> MakeLogSink(LogSinkType type,
+                                          const std::string& path,
+                                          bool binary) {
+  switch (type) {
+    case LogSinkType::Stream:
+      return std::make_unique<std::ofstream>(
+          path, binary ? std::ios::out | std::ios::binary : std::ios::out);
+    case LogSinkType::LargeBlock:
+      return std::make_unique<LargeBlockSink>(path, binary, false);
+    case LogSinkType::Direct:
+      return std::make_unique<LargeBlockSink>(path, binary, true);
+  }
+  return nullptr;
+}
+
+void DrainLogSink(std::ostream* out) {
+  if (!out) {
+    return;
+  }
+  out->flush();
+  auto sink = dynamic_cast<LargeBlockSinkBuf*>(out->rdbuf());
+  if (sink && !sink->Drain()) {
+    out->setstate(std::ios::badbit);
+  }
+}
+
+}  // namespace mlperf
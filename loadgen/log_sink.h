@@ -0,0 +1,39 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Output streams for the log files that can avoid issuing many small writes
+// while a test is running. See LogSinkType.
+
+#ifndef MLPERF_LOADGEN_LOG_SINK_H_
+#define MLPERF_LOADGEN_LOG_SINK_H_
+
+#include <memory>
+#include <ostream>
+#include <string>
+
+#include "test_settings.h"
+
+namespace mlperf {
+
+// Opens |path| for writing with the given sink |type|.
+// Check good() on the result to see if the file was opened.
+std::unique_ptr<std::ostream> MakeLogSink(LogSinkType type,
+                                          const std::string& path, bool binary);
+
+// Writes everything |out| has buffered through to its file.
+// Unlike std::ostream::flush, this also writes the partial blocks of
+// LargeBlock and Direct sinks.
+void DrainLogSink(std::ostream* out);
+
+}  // namespace mlperf
+
+#endif  // MLPERF_LOADGEN_LOG_SINK_H_
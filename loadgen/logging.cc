@@ -18,13 +18,19 @@ limitations under the License.
 // those threads are stalled.
 // Each thread uses a double-buffering scheme to queue its logs. One buffer
 // is always reserved for writes and the other is reserved for reads.
+// The buffers are lists of fixed-size chunks from a pool shared by all
+// threads, which caps the memory used by queued logs.
 // A producing thread sends requests to the IOThread to swap the buffers
 // and the IOThread does the actual read/write swap after it has finished
 // reading the buffer it was working on.
+// Optionally, the IOThread hands the swapped buffers to several serializer
+// threads that each format a fixed subset of threads into their own shard
+// of the log. The IOThread then merges the shards into the output files.
 
 #include "logging.h"
 
 #include <cassert>
+#include <cstdio>
 #include <future>
 #include <iostream>
 #include <sstream>
@@ -37,18 +43,31 @@ limitations under the License.
 #define MLPERF_GET_PID() getpid()
 #endif
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MLPERF_LOADGEN_HEX_SSE2
+#endif
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+
+#include "log_sink.h"
 #include "utils.h"
 
 namespace mlperf {
 
 namespace {
 
-uintptr_t SwapRequestSlotIsWritableValue(size_t id) {
+uintptr_t SwapRequestSlotIsWritableValue(uint64_t id) {
   // LSB of 1 indicates that this isn't a pointer.
-  // MSBs encode the id to detect collisions when a slot in
-  // |thread_swap_request_slots_| is reused for a different id and the request
+  // MSBs encode the id to detect collisions when a slot in a
+  // SwapRequestTable is reused for a different id and the request
   // for the previous id is very slow.
-  return (id << 1) | 0x1;
+  return static_cast<uintptr_t>((id << 1) | 0x1);
 }
 
 bool SwapRequestSlotIsReadable(uintptr_t value) {
@@ -58,34 +77,333 @@ bool SwapRequestSlotIsReadable(uintptr_t value) {
 
 constexpr size_t kMaxThreadsToLog = 1024;
 constexpr std::chrono::milliseconds kLogPollPeriod(10);
+constexpr size_t kLogEntryChunkCapacity = 256;
+
+// Producers wake the IOThread once this many entries are waiting in a
+// buffer, which bounds buffer growth independently of the poll period.
+constexpr size_t kTlsLoggerWakeWatermark = 4 * 1024;
+
+// Exiting threads wake the IOThread once this many TlsLoggers are waiting
+// to be recycled, so thread churn doesn't keep creating new ones.
+constexpr size_t kTlsLoggerOrphanWakeWatermark = 64;
+
+// More serializers than this would mostly contend on the latencies mutex.
+constexpr size_t kMaxSerializerThreads = 64;
+
+// Limits the poll period while the loadgen is waiting on latencies so
+// the end of a run isn't held up by a long poll period.
+constexpr std::chrono::milliseconds kMaxDrainPollPeriod(10);
+
+// Formats |value| into |out| without allocating, unless |out| needs to grow.
+template <typename T>
+void AssignStreamed(std::string* out, const T& value) {
+  class ArrayBuf : public std::streambuf {
+   public:
+    ArrayBuf(char* begin, size_t size) { setp(begin, begin + size); }
+    size_t size() const { return pptr() - pbase(); }
+  };
+  char chars[64];
+  ArrayBuf buf(chars, sizeof(chars));
+  std::ostream stream(&buf);
+  stream << value;
+  out->assign(chars, buf.size());
+}
+
+int64_t PerfClockNowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             PerfClock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace
+
+#if !defined(MLPERF_LOADGEN_DISABLE_TRACING)
+std::atomic<bool> g_tracing_enabled{true};
+#endif
+
+namespace {
+
+constexpr char kDigitPairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+constexpr char kHexDigits[] = "0123456789ABCDEF";
+
+#if defined(MLPERF_LOADGEN_HEX_SSE2)
+// Maps each nibble in |nibbles| to its hex digit.
+__m128i NibblesToHex(__m128i nibbles) {
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i letter_offset = _mm_set1_epi8('A' - '0' - 10);
+  __m128i is_letter = _mm_cmpgt_epi8(nibbles, nine);
+  __m128i digits = _mm_add_epi8(nibbles, _mm_set1_epi8('0'));
+  return _mm_add_epi8(digits, _mm_and_si128(is_letter, letter_offset));
+}
+#endif
+
+// Writes 2 * |size| hex digits to |out|.
+void EncodeHex(const uint8_t* data, size_t size, char* out) {
+  size_t i = 0;
+#if defined(MLPERF_LOADGEN_HEX_SSE2)
+  const __m128i low_nibble_mask = _mm_set1_epi8(0x0F);
+  for (; i + 16 <= size; i += 16) {
+    __m128i bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), low_nibble_mask);
+    __m128i low = _mm_and_si128(bytes, low_nibble_mask);
+    // Interleave so the high nibble of each byte comes first.
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i),
+                     NibblesToHex(_mm_unpacklo_epi8(high, low)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i + 16),
+                     NibblesToHex(_mm_unpackhi_epi8(high, low)));
+  }
+#endif
+  for (; i < size; i++) {
+    out[2 * i] = kHexDigits[data[i] >> 4];
+    out[2 * i + 1] = kHexDigits[data[i] & 0x0F];
+  }
+}
 
 }  // namespace
 
-const std::string& ArgValueTransform(const bool& value) {
-  static const std::string v_true("true");
-  static const std::string v_false("false");
-  return value ? v_true : v_false;
+void LogLineWriter::AppendUnsigned(uint64_t value) {
+  // Digits are generated in pairs from the end of the buffer.
+  char digits[20];
+  char* end = digits + sizeof(digits);
+  char* begin = end;
+  while (value >= 100) {
+    const char* pair = &kDigitPairs[(value % 100) * 2];
+    value /= 100;
+    *--begin = pair[1];
+    *--begin = pair[0];
+  }
+  if (value >= 10) {
+    const char* pair = &kDigitPairs[value * 2];
+    *--begin = pair[1];
+    *--begin = pair[0];
+  } else {
+    *--begin = static_cast<char>('0' + value);
+  }
+  Append(begin, end - begin);
+}
+
+void LogLineWriter::AppendSigned(int64_t value) {
+  if (value < 0) {
+    Append("-", 1);
+    // Negating in unsigned arithmetic is well defined for the minimum value.
+    AppendUnsigned(0 - static_cast<uint64_t>(value));
+  } else {
+    AppendUnsigned(value);
+  }
+}
+
+// Doubles are rare in the logs, so they use the same format as
+// std::ostream's defaults without hand tuning.
+LogLineWriter& LogLineWriter::operator<<(double value) {
+  char chars[32];
+  int size = std::snprintf(chars, sizeof(chars), "%g", value);
+  Append(chars, size);
+  return *this;
+}
+
+LogLineWriter& LogLineWriter::operator<<(const LogBinaryAsHexString& value) {
+  Append("\"", 1);
+  if (value.data != nullptr) {
+    const uint8_t* data = value.data->data();
+    size_t remaining = value.data->size();
+    // Encode directly into the buffer, flushing it whenever it's full.
+    while (remaining > 0) {
+      if (kBufferSize - size_ < 2) {
+        Flush();
+      }
+      size_t count = std::min(remaining, (kBufferSize - size_) / 2);
+      EncodeHex(data, count, buffer_ + size_);
+      size_ += count * 2;
+      data += count;
+      remaining -= count;
+    }
+  }
+  Append("\"", 1);
+  return *this;
+}
+
+struct LogEntryChunk {
+  static constexpr uint32_t kNotPooled = UINT32_MAX;
+  explicit LogEntryChunk(uint32_t index) : pool_index(index) {}
+
+  const uint32_t pool_index;
+  // Accessed by the LogEntryChunkPool only.
+  std::atomic<uint32_t> next_free{0};
+
+  LogEntryChunk* next = nullptr;
+  size_t size = 0;
+  // Entries are moved in and reset after they are read, so the chunk can be
+  // reused without any allocations.
+  AsyncLogEntry entries[kLogEntryChunkCapacity];
+};
+
+LogEntryChunkPool::~LogEntryChunkPool() {
+  size_t pooled_count =
+      std::min(pooled_count_.load(), kSegmentCount * kSegmentSize);
+  for (size_t i = 0; i < pooled_count; i++) {
+    delete segments_[i / kSegmentSize].load()[i % kSegmentSize];
+  }
+  for (auto& segment : segments_) {
+    delete[] segment.load();
+  }
+}
+
+void LogEntryChunkPool::SetMaxBytes(size_t max_bytes) {
+  max_chunks_.store(std::min(max_bytes / sizeof(LogEntryChunk),
+                             kSegmentCount * kSegmentSize),
+                    std::memory_order_relaxed);
+}
+
+void LogEntryChunkPool::Reserve(size_t bytes) {
+  size_t reserved = std::min(bytes / sizeof(LogEntryChunk),
+                             kSegmentCount * kSegmentSize);
+  if (reserved <= reserved_chunks_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  reserved_chunks_.store(reserved, std::memory_order_relaxed);
+  size_t pooled =
+      std::min(reserved + reserved / 8, kSegmentCount * kSegmentSize);
+  while (pooled_count_.load(std::memory_order_relaxed) < pooled) {
+    LogEntryChunk* chunk = AllocatePooled();
+    if (!chunk) {
+      break;
+    }
+    PushFree(chunk);
+  }
+}
+
+void LogEntryChunkPool::SetFrozen(bool frozen) {
+  frozen_.store(frozen, std::memory_order_relaxed);
+}
+
+LogEntryChunk* LogEntryChunkPool::Acquire(bool droppable, bool* at_cap) {
+  const bool frozen = frozen_.load(std::memory_order_relaxed);
+  size_t max_chunks = max_chunks_.load(std::memory_order_relaxed);
+  if (frozen) {
+    max_chunks = std::min(max_chunks,
+                          reserved_chunks_.load(std::memory_order_relaxed));
+  }
+  size_t in_use = chunks_in_use_.fetch_add(1, std::memory_order_relaxed) + 1;
+  *at_cap = in_use >= max_chunks;
+  bool over_cap = in_use > max_chunks;
+  if (over_cap && droppable) {
+    chunks_in_use_.fetch_sub(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  size_t peak = peak_chunks_in_use_.load(std::memory_order_relaxed);
+  while (peak < in_use && !peak_chunks_in_use_.compare_exchange_weak(
+                              peak, in_use, std::memory_order_relaxed)) {
+  }
+
+  LogEntryChunk* chunk = PopFree();
+  if (!chunk && !over_cap && !frozen) {
+    chunk = AllocatePooled();
+  }
+  if (!chunk) {
+    over_cap_count_.fetch_add(1, std::memory_order_relaxed);
+    chunk = new LogEntryChunk(LogEntryChunk::kNotPooled);
+  }
+  return chunk;
+}
+
+void LogEntryChunkPool::Release(LogEntryChunk* chunk) {
+  chunks_in_use_.fetch_sub(1, std::memory_order_relaxed);
+  chunk->next = nullptr;
+  chunk->size = 0;
+  if (chunk->pool_index == LogEntryChunk::kNotPooled) {
+    delete chunk;
+    return;
+  }
+  PushFree(chunk);
+}
+
+void LogEntryChunkPool::PushFree(LogEntryChunk* chunk) {
+  uint64_t head = free_list_.load(std::memory_order_relaxed);
+  uint64_t new_head;
+  do {
+    chunk->next_free.store(static_cast<uint32_t>(head),
+                           std::memory_order_relaxed);
+    new_head = (((head >> 32) + 1) << 32) | (chunk->pool_index + 1);
+  } while (!free_list_.compare_exchange_weak(head, new_head,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed));
 }
 
-char Bin2Hex(uint8_t four_bits) {
-  char number = '0' + four_bits;
-  char letter = ('A' - 10) + four_bits;
-  return four_bits < 10 ? number : letter;
+LogEntryChunk* LogEntryChunkPool::PopFree() {
+  uint64_t head = free_list_.load(std::memory_order_acquire);
+  while (true) {
+    uint32_t index_plus_one = static_cast<uint32_t>(head);
+    if (index_plus_one == 0) {
+      return nullptr;
+    }
+    size_t index = index_plus_one - 1;
+    LogEntryChunk* chunk =
+        segments_[index / kSegmentSize].load(std::memory_order_acquire)
+                 [index % kSegmentSize];
+    // |chunk| may be popped by another thread in the meantime, in which case
+    // the tag makes the compare_exchange fail.
+    uint64_t new_head = (((head >> 32) + 1) << 32) |
+                        chunk->next_free.load(std::memory_order_relaxed);
+    if (free_list_.compare_exchange_weak(head, new_head,
+                                         std::memory_order_acquire,
+                                         std::memory_order_acquire)) {
+      return chunk;
+    }
+  }
 }
 
-const std::string ArgValueTransform(const LogBinaryAsHexString& value) {
-  if (value.data == nullptr) {
-    return "\"\"";
+LogEntryChunk* LogEntryChunkPool::AllocatePooled() {
+  size_t index = pooled_count_.fetch_add(1, std::memory_order_relaxed);
+  if (index >= kSegmentCount * kSegmentSize) {
+    return nullptr;
   }
-  std::string hex;
-  hex.reserve(value.data->size() + 2);
-  hex.push_back('"');
-  for (auto b : *value.data) {
-    hex.push_back(Bin2Hex(b >> 4));
-    hex.push_back(Bin2Hex(b & 0x0F));
+  auto& segment = segments_[index / kSegmentSize];
+  LogEntryChunk** chunks = segment.load(std::memory_order_acquire);
+  if (!chunks) {
+    LogEntryChunk** new_chunks = new LogEntryChunk*[kSegmentSize]();
+    if (segment.compare_exchange_strong(chunks, new_chunks,
+                                        std::memory_order_acq_rel)) {
+      chunks = new_chunks;
+    } else {
+      delete[] new_chunks;
+    }
   }
-  hex.push_back('"');
-  return hex;
+  LogEntryChunk* chunk = new LogEntryChunk(static_cast<uint32_t>(index));
+  chunks[index % kSegmentSize] = chunk;
+  return chunk;
+}
+
+size_t LogEntryChunkPool::BytesInUse() const {
+  return chunks_in_use_.load(std::memory_order_relaxed) *
+         sizeof(LogEntryChunk);
+}
+
+size_t LogEntryChunkPool::MaxBytes() const {
+  return max_chunks_.load(std::memory_order_relaxed) * sizeof(LogEntryChunk);
+}
+
+size_t LogEntryChunkPool::ReportPeakBytesInUse() {
+  size_t peak = peak_chunks_in_use_.exchange(
+      chunks_in_use_.load(std::memory_order_relaxed),
+      std::memory_order_relaxed);
+  return peak * sizeof(LogEntryChunk);
+}
+
+size_t LogEntryChunkPool::ReportOverCapCount() {
+  return over_cap_count_.exchange(0, std::memory_order_relaxed);
 }
 
 // TlsLogger logs a single thread using thread-local storage.
@@ -95,14 +413,33 @@ const std::string ArgValueTransform(const LogBinaryAsHexString& value) {
 //   * Without expensive syscalls or I/O operations.
 class TlsLogger {
  public:
-  TlsLogger(std::function<void()> forced_detatch);
+  TlsLogger();
   ~TlsLogger();
+
+  // Called whenever a thread starts using this TlsLogger, which may have
+  // been used by another thread that exited.
+  void AttachToThread(Logger::TlsLoggerList::iterator registry_node,
+                      std::function<void()> forced_detatch);
   void ForcedDetatchFromThread() { forced_detatch_(); }
+  // Set once the exiting thread is done with this TlsLogger, since it may
+  // still be in Log when the IOThread processes its last entry.
+  void MarkDetatched() { detatched_.store(true, std::memory_order_release); }
+  bool Detatched() const { return detatched_.load(std::memory_order_acquire); }
+  Logger::TlsLoggerList::iterator RegistryNode() const {
+    return registry_node_;
+  }
 
-  void Log(AsyncLogEntry&& entry);
+  // A |droppable| entry is dropped if there's no memory to queue it.
+  void Log(AsyncLogEntry&& entry, bool droppable);
   void SwapBuffers();
 
-  std::vector<AsyncLogEntry>* StartReadingEntries();
+  struct EntryBuffer {
+    LogEntryChunk* head = nullptr;
+    LogEntryChunk* tail = nullptr;
+    size_t size = 0;
+  };
+
+  EntryBuffer* StartReadingEntries();
   void FinishReadingEntries();
   bool ReadBufferHasBeenConsumed();
 
@@ -110,6 +447,9 @@ class TlsLogger {
 
   const std::string* TidAsString() const { return &tid_as_string_; }
 
+  // Unique per TlsLogger. Used to assign the TlsLogger to a serializer.
+  size_t Id() const { return id_; }
+
   void RequestSwapBuffersSlotRetried() {
     swap_buffers_slot_retry_count_.fetch_add(1, std::memory_order_relaxed);
   }
@@ -126,58 +466,85 @@ class TlsLogger {
     return c;
   }
 
+  size_t ReportDroppedEntryCount() {
+    size_t c = dropped_entry_count_.load(std::memory_order_relaxed);
+    dropped_entry_count_.fetch_sub(c, std::memory_order_relaxed);
+    return c;
+  }
+
   void TraceCounters();
 
  private:
-  using EntryVector = std::vector<AsyncLogEntry>;
   enum class EntryState { Unlocked, ReadLock, WriteLock };
 
+  // Returns false if the entry had to be dropped.
+  bool AppendEntry(EntryBuffer* entries, AsyncLogEntry&& entry,
+                   bool droppable);
+
   // Accessed by producer only.
   size_t i_read_ = 0;
 
   // Accessed by producer and consumer atomically.
-  EntryVector entries_[2];
+  EntryBuffer entries_[2];
   std::atomic<EntryState> entry_states_[2]{{EntryState::ReadLock},
                                            {EntryState::Unlocked}};
   std::atomic<size_t> i_write_{1};
 
   std::atomic<size_t> log_cas_fail_count_{0};
   std::atomic<size_t> swap_buffers_slot_retry_count_{0};
+  std::atomic<size_t> dropped_entry_count_{0};
 
   // Accessed by consumer only.
   size_t unread_swaps_ = 0;
   size_t i_write_prev_ = 0;
   std::string trace_pid_tid_;  // Cached as string.
   std::string tid_as_string_;  // Cached as string.
+  const size_t id_;
 
+  Logger::TlsLoggerList::iterator registry_node_;
   std::function<void()> forced_detatch_;
+  std::atomic<bool> detatched_{false};
 };
 
+// Serializes the entries of a subset of the TlsLoggers into its own shard
+// of the log, which the IOThread merges into the real outputs.
+struct LogSerializer {
+  LogSerializer(AsyncLog* writer, uint64_t index) : log(writer, index) {}
+  AsyncLog log;
+  std::vector<TlsLogger*> threads_to_read;
+  size_t start_reading_entries_retry_count = 0;
+  std::thread thread;
+};
+
+Logger::SwapRequestTable::SwapRequestTable(size_t slot_count)
+    : slots(slot_count) {
+  for (size_t i = 0; i < slot_count; i++) {
+    std::atomic_init(&slots[i], SwapRequestSlotIsWritableValue(i));
+  }
+}
+
 Logger::Logger(std::chrono::duration<double> poll_period,
                size_t max_threads_to_log)
-    : poll_period_(poll_period),
-      max_threads_to_log_(max_threads_to_log),
-      thread_swap_request_slots_(max_threads_to_log * 2) {
-  const size_t kSlotCount = max_threads_to_log * 2;
-  for (size_t i = 0; i < kSlotCount; i++) {
-    std::atomic_init(&thread_swap_request_slots_[i],
-                     SwapRequestSlotIsWritableValue(i));
-  }
+    : poll_period_(poll_period) {
+  log_entry_chunk_pool_.SetMaxBytes(LogSettings().log_buffer_max_memory_mb *
+                                    1024 * 1024);
+  swap_request_tables_[0] =
+      std::make_unique<SwapRequestTable>(max_threads_to_log * 2);
 }
 
 Logger::~Logger() {
   // TlsLoggers might outlive this Logger when loaded as a python module.
   // Forcefully make all currently registered TlsLoggers orphans.
-  std::unique_lock<std::mutex> lock(tls_loggers_registerd_mutex_);
+  std::unique_lock<std::mutex> lock(tls_loggers_mutex_);
   TlsLogger* tls_logger_prev = nullptr;
   (void)tls_logger_prev;  // Avoid unused error in release builds.
   while (!tls_loggers_registerd_.empty()) {
-    TlsLogger* tls_logger = *tls_loggers_registerd_.begin();
+    TlsLogger* tls_logger = tls_loggers_registerd_.front().get();
     // Otherwise, this is an infinite loop.
     assert(tls_logger != tls_logger_prev);
-    tls_loggers_registerd_mutex_.unlock();
+    tls_loggers_mutex_.unlock();
     tls_logger->ForcedDetatchFromThread();
-    tls_loggers_registerd_mutex_.lock();
+    tls_loggers_mutex_.lock();
     tls_logger_prev = tls_logger;
   }
 }
@@ -185,68 +552,402 @@ Logger::~Logger() {
 void Logger::RequestSwapBuffers(TlsLogger* tls_logger) {
   auto tls_logger_as_uint = reinterpret_cast<uintptr_t>(tls_logger);
   assert(SwapRequestSlotIsReadable(tls_logger_as_uint));
-  size_t id, slot;
+  uint64_t id;
+  SwapRequestTable* table;
+  size_t slot;
   uintptr_t slot_is_writeable_value;
   // The compare_exchange below should almost always succeed.
   // The compare_exchange may fail if a recycled slot is still actively used
   // by another thread, so we retry with subsequent slots here if needed.
-  // Since the slot count is 2x the expected number of threads to log,
+  // Since the slot count is at least 2x the number of TlsLoggers alive,
   // the CAS should only fail at most 50% of the time when all logging threads
   // happen to be descheduled between the fetch_add and CAS below, which is
   // very unlikely.
-  id = swap_request_id_.fetch_add(1, std::memory_order_relaxed);
-  slot = id % thread_swap_request_slots_.size();
-  slot_is_writeable_value = SwapRequestSlotIsWritableValue(id);
-  while (!thread_swap_request_slots_[slot].compare_exchange_strong(
-      slot_is_writeable_value, tls_logger_as_uint, std::memory_order_release)) {
-    id = swap_request_id_.fetch_add(1, std::memory_order_relaxed);
-    slot = id % thread_swap_request_slots_.size();
+  // Acquiring the id guarantees the table of its generation is visible.
+  while (true) {
+    id = swap_request_id_.fetch_add(1, std::memory_order_acquire);
+    table = swap_request_tables_[id >> kSwapRequestGenerationShift].get();
+    id &= (uint64_t(1) << kSwapRequestGenerationShift) - 1;
+    slot = id % table->slots.size();
     slot_is_writeable_value = SwapRequestSlotIsWritableValue(id);
+    if (table->slots[slot].compare_exchange_strong(slot_is_writeable_value,
+                                                   tls_logger_as_uint,
+                                                   std::memory_order_release)) {
+      return;
+    }
     tls_logger->RequestSwapBuffersSlotRetried();
   }
 }
 
-void Logger::RegisterTlsLogger(TlsLogger* tls_logger) {
-  std::unique_lock<std::mutex> lock(tls_loggers_registerd_mutex_);
-  if (tls_loggers_registerd_.size() >= max_threads_to_log_) {
-    LogErrorSync(
-        "Warning: More TLS loggers registerd than can "
-        "be active simultaneously.\n");
+TlsLogger* Logger::RegisterTlsLogger(std::function<void()> forced_detatch) {
+  std::unique_lock<std::mutex> lock(tls_loggers_mutex_);
+  if (tls_loggers_free_.empty()) {
+    tls_loggers_registerd_.emplace_front(std::make_unique<TlsLogger>());
+    tls_logger_create_count_++;
+  } else {
+    tls_loggers_registerd_.splice(tls_loggers_registerd_.begin(),
+                                  tls_loggers_free_, tls_loggers_free_.begin());
+    tls_logger_reuse_count_++;
+  }
+  TlsLogger* tls_logger = tls_loggers_registerd_.front().get();
+  tls_logger->AttachToThread(tls_loggers_registerd_.begin(),
+                             std::move(forced_detatch));
+
+  // Each TlsLogger has at most one swap request outstanding, including
+  // orphans whose entries haven't all been processed.
+  size_t alive_count =
+      tls_loggers_registerd_.size() + tls_logger_orphans_.size();
+  size_t slot_count =
+      swap_request_tables_[swap_request_generation_]->slots.size();
+  if (alive_count * 2 > slot_count) {
+    GrowSwapRequestSlots(std::max(slot_count * 2, alive_count * 2));
+  }
+  return tls_logger;
+}
+
+// Starts a new swap request generation with |slot_count| slots.
+// Called with tls_loggers_mutex_ held.
+void Logger::GrowSwapRequestSlots(size_t slot_count) {
+  uint64_t generation = swap_request_generation_ + 1;
+  if (generation == kMaxSwapRequestGenerations) {
+    LogErrorSync("Warning: Too many threads logging to grow the swap request "
+                 "slots any further.",
+                 "slot_count",
+                 swap_request_tables_[swap_request_generation_]->slots.size());
+    return;
   }
-  tls_loggers_registerd_.insert(tls_logger);
+
+  swap_request_tables_[generation] =
+      std::make_unique<SwapRequestTable>(slot_count);
+  SwapRequestTable* table = swap_request_tables_[generation].get();
+  uint64_t id = swap_request_id_.load(std::memory_order_relaxed);
+  do {
+    table->previous_generation_end.store(
+        id & ((uint64_t(1) << kSwapRequestGenerationShift) - 1),
+        std::memory_order_relaxed);
+  } while (!swap_request_id_.compare_exchange_weak(
+      id, generation << kSwapRequestGenerationShift, std::memory_order_release,
+      std::memory_order_relaxed));
+  swap_request_generation_ = generation;
 }
 
 // This moves ownership of the tls_logger data to Logger so the
 // exiting thread can exit immediately, even if all the logs of the
 // exiting thread haven't been processed.
-void Logger::UnRegisterTlsLogger(std::unique_ptr<TlsLogger> tls_logger) {
-  OrphanContainer::iterator orphan;
+void Logger::UnRegisterTlsLogger(TlsLogger* tls_logger) {
+  TlsLoggerList::iterator orphan = tls_logger->RegistryNode();
+  size_t orphan_count;
   {
-    std::unique_lock<std::mutex> lock(tls_logger_orphans_mutex_);
-    tls_logger_orphans_.emplace_front(std::move(tls_logger));
-    orphan = tls_logger_orphans_.begin();
+    std::unique_lock<std::mutex> lock(tls_loggers_mutex_);
+    tls_logger_orphans_.splice(tls_logger_orphans_.begin(),
+                               tls_loggers_registerd_, orphan);
+    orphan_count = tls_logger_orphans_.size();
   }
 
-  // Only remove the TlsLogger from the registry after adding to orphans so
-  // CollectTlsLoggerStats doesn't have any gaps in coverage.
-  {
-    std::unique_lock<std::mutex> lock(tls_loggers_registerd_mutex_);
-    tls_loggers_registerd_.erase(orphan->get());
+  // This will flush the logs of |tls_logger| and mark it for recycling.
+  // Deferring recycling via orphans_to_recycle helps avoid use-after-frees
+  // when the IOThread calls FinishReadingEntries.
+  tls_logger->Log(
+      [this, orphan](AsyncLog& log) {
+        // Defer so this runs on the IOThread, even if a serializer thread
+        // processed the entry.
+        log.DeferUntilWritten([this, orphan] {
+          CollectTlsLoggerStats(orphan->get());
+          orphans_to_recycle_.push_back(orphan);
+        });
+      },
+      false);
+  tls_logger->MarkDetatched();
+
+  if (orphan_count >= kTlsLoggerOrphanWakeWatermark) {
+    WakeIOThread();
   }
+}
 
-  // This will flush the logs of |tls_logger| and mark it for destruction.
-  // Deferring destruction via orphans_to_destroy helps avoid use-after-frees
-  // when the IOThread calls FinishReadingEntries.
-  (*orphan)->Log([this, orphan](AsyncLog&) {
-    CollectTlsLoggerStats(orphan->get());
-    orphans_to_destroy_.push_back(orphan);
-  });
+LogEntryChunk* Logger::AcquireLogEntryChunk(bool droppable) {
+  bool at_cap = false;
+  LogEntryChunk* chunk = log_entry_chunk_pool_.Acquire(droppable, &at_cap);
+  // Memory is only checked against the EndOfTestOnly cap while IO is
+  // deferred, so AsyncPoll mode doesn't pay for it.
+  bool deferred_bytes_exceeded =
+      io_deferred_.load(std::memory_order_relaxed) &&
+      log_entry_chunk_pool_.BytesInUse() >=
+          max_deferred_bytes_.load(std::memory_order_relaxed) &&
+      !max_deferred_bytes_exceeded_.exchange(true, std::memory_order_relaxed);
+  // The IOThread frees up chunks as it reads them. Dropping entries doesn't
+  // need the IOThread though, and waking it would only log more traces.
+  if ((at_cap && chunk) || deferred_bytes_exceeded) {
+    WakeIOThread();
+  }
+  return chunk;
+}
+
+void Logger::ReleaseLogEntryChunk(LogEntryChunk* chunk) {
+  log_entry_chunk_pool_.Release(chunk);
 }
 
 void Logger::CollectTlsLoggerStats(TlsLogger* tls_logger) {
   tls_total_log_cas_fail_count_ += tls_logger->ReportLogCasFailCount();
   tls_total_swap_buffers_slot_retry_count_ +=
       tls_logger->ReportSwapBuffersSlotRetryCount();
+  tls_total_dropped_entry_count_ += tls_logger->ReportDroppedEntryCount();
+}
+
+void AsyncLog::DrainSinks() {
+  if (writer_) {
+    writer_->DrainSinks();
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(log_mutex_);
+    DrainLogSink(summary_out_);
+    DrainLogSink(detail_out_);
+    DrainLogSink(accuracy_out_);
+    DrainLogSink(time_series_out_);
+    DrainLogSink(latencies_out_);
+    DrainLogSink(latency_histogram_out_);
+  }
+  std::unique_lock<std::mutex> lock(trace_mutex_);
+  if (trace_out_ && trace_binary_) {
+    binary_trace_.WriteBuffer();
+  }
+  DrainLogSink(trace_out_);
+}
+
+void AsyncLog::WriteTimeSeriesHeaderLocked() {
+  *time_series_out_ << "phase,window_start_s,window_s,samples,samples_per_s,"
+                       "min_ns,mean_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n";
+}
+
+void AsyncLog::LogTimeSeries(const std::string& phase,
+                             const LatencyTimeSeries& time_series) {
+  if (writer_) {
+    writer_->LogTimeSeries(phase, time_series);
+    return;
+  }
+  std::vector<LatencyTimeSeries::WindowStats> windows = time_series.Stats();
+  std::unique_lock<std::mutex> lock(log_mutex_);
+  if (!time_series_out_) {
+    return;
+  }
+  for (auto& w : windows) {
+    double window_seconds = DurationToSeconds(w.length);
+    LogLineWriter line(time_series_out_);
+    line << phase << ',' << DurationToSeconds(w.start) << ','
+         << window_seconds << ',' << w.sample_count << ','
+         << w.sample_count / window_seconds << ',' << w.min << ',' << w.mean
+         << ',' << w.p50 << ',' << w.p90 << ',' << w.p99 << ',' << w.p999
+         << ',' << w.max << '\n';
+  }
+}
+
+void AsyncLog::SetLatencyExportFiles(std::ostream* latencies,
+                                     std::ostream* latency_histogram) {
+  std::unique_lock<std::mutex> lock(log_mutex_);
+  if (latencies_out_) {
+    latencies_out_->flush();
+  }
+  if (latency_histogram_out_) {
+    latency_export::WriteHistogramJsonFooter(latency_histogram_out_);
+    latency_histogram_out_->flush();
+  }
+  latencies_out_ = latencies;
+  latency_histogram_out_ = latency_histogram;
+  latency_export_run_count_ = 0;
+  if (latency_histogram_out_) {
+    latency_export::WriteHistogramJsonHeader(latency_histogram_out_);
+  }
+}
+
+void AsyncLog::LogLatencyExport(const std::vector<LatencyRecord>& records,
+                                const LatencyHistogram& histogram) {
+  if (writer_) {
+    writer_->LogLatencyExport(records, histogram);
+    return;
+  }
+  std::unique_lock<std::mutex> lock(log_mutex_);
+  if (latencies_out_) {
+    latency_export::WriteRecords(latencies_out_, latency_export_run_count_,
+                                 records);
+  }
+  if (latency_histogram_out_) {
+    latency_export::WriteHistogramJson(latency_histogram_out_,
+                                       latency_export_run_count_, histogram);
+  }
+  latency_export_run_count_++;
+}
+
+void AsyncLog::SyncShardWithWriter() {
+  {
+    std::unique_lock<std::mutex> lock(writer_->log_mutex_);
+    log_origin_ = writer_->log_origin_;
+  }
+  {
+    std::unique_lock<std::mutex> lock(writer_->latencies_mutex_);
+    time_series_.SetWindow(writer_->time_series_.WindowLength());
+  }
+
+  std::unique_lock<std::mutex> lock(writer_->trace_mutex_);
+  if (!writer_->trace_out_) {
+    trace_out_ = nullptr;
+    return;
+  }
+  if (trace_out_ && trace_generation_ == writer_->trace_generation_) {
+    return;
+  }
+  // Start a fragment of the writer's new trace.
+  trace_out_ = &shard_trace_;
+  trace_origin_ = writer_->trace_origin_;
+  trace_binary_ = writer_->trace_binary_;
+  trace_generation_ = writer_->trace_generation_;
+  shard_trace_.str("");
+  if (trace_binary_) {
+    binary_trace_.StartFragment();
+  }
+}
+
+void AsyncLog::MergeShards(const std::vector<AsyncLog*>& shards) {
+  {
+    std::unique_lock<std::mutex> lock(log_mutex_);
+    // Summary logs are usually from a single thread, so they're kept in
+    // order by keeping shard order.
+    for (AsyncLog* shard : shards) {
+      const std::string summary = shard->shard_summary_.str();
+      *summary_out_ << summary;
+      if (copy_summary_to_stdout_) {
+        std::cout << summary;
+      }
+      log_error_count_ += shard->log_error_count_;
+      shard->log_error_count_ = 0;
+
+      // Each shard starts its own list of accuracy entries every merge.
+      const std::string accuracy = shard->shard_accuracy_.str();
+      if (accuracy_out_ && !accuracy.empty()) {
+        if (accuracy_needs_comma_) {
+          *accuracy_out_ << ",";
+        }
+        *accuracy_out_ << accuracy;
+        accuracy_needs_comma_ = true;
+      }
+      shard->accuracy_needs_comma_ = false;
+    }
+
+    // Detail logs from all shards are sorted by the time they were logged.
+    struct Line {
+      PerfClock::time_point time;
+      const std::string* text;
+      size_t begin;
+      size_t end;
+    };
+    std::vector<std::string> details;
+    details.reserve(shards.size());
+    std::vector<Line> lines;
+    for (AsyncLog* shard : shards) {
+      details.push_back(shard->shard_detail_.str());
+      size_t begin = 0;
+      for (auto& line : shard->shard_detail_lines_) {
+        lines.push_back({line.time, &details.back(), begin, line.end});
+        begin = line.end;
+      }
+      shard->shard_detail_lines_.clear();
+    }
+    std::stable_sort(
+        lines.begin(), lines.end(),
+        [](const Line& a, const Line& b) { return a.time < b.time; });
+    for (auto& line : lines) {
+      detail_out_->write(line.text->data() + line.begin, line.end - line.begin);
+      if (copy_detail_to_stdout_) {
+        std::cout.write(line.text->data() + line.begin,
+                        line.end - line.begin);
+      }
+    }
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(trace_mutex_);
+    for (AsyncLog* shard : shards) {
+      bool same_trace = trace_out_ && shard->trace_out_ &&
+                        shard->trace_generation_ == trace_generation_;
+      if (!same_trace) {
+        // The trace changed while the shard was serializing. Drop the
+        // fragment and have the shard start over on its next sync.
+        shard->trace_out_ = nullptr;
+      } else if (trace_binary_) {
+        binary_trace_.AppendFragment(shard->shard_index_ + 1,
+                                     &shard->binary_trace_);
+      } else {
+        *trace_out_ << shard->shard_trace_.str();
+      }
+      shard->shard_trace_.str("");
+    }
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(latencies_mutex_);
+    bool merged_latencies = false;
+    for (AsyncLog* shard : shards) {
+      if (shard->latency_histogram_.Count() != 0) {
+        latency_histogram_.Merge(shard->latency_histogram_);
+        shard->latency_histogram_.Reset();
+        time_series_.Merge(shard->time_series_);
+        shard->time_series_.Clear();
+        merged_latencies = true;
+      }
+    }
+    if (merged_latencies && AllLatenciesRecorded()) {
+      all_latencies_recorded_.notify_all();
+    }
+  }
+
+  for (AsyncLog* shard : shards) {
+    shard->shard_summary_.str("");
+    shard->shard_detail_.str("");
+    shard->shard_accuracy_.str("");
+    std::vector<std::function<void()>> tasks;
+    tasks.swap(shard->deferred_tasks_);
+    for (auto& task : tasks) {
+      task();
+    }
+  }
+}
+
+void IOThreadWakeup::Wake() {
+  sequence_.fetch_add(1);
+  // The seq_cst ordering here and in WaitFor guarantees either the waiter
+  // sees the new sequence or we see that it's waiting.
+  if (!waiting_.load()) {
+    return;
+  }
+#if defined(__linux__)
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(&sequence_),
+          FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#else
+  cv_.notify_one();
+#endif
+}
+
+bool IOThreadWakeup::WaitFor(uint32_t sequence,
+                             std::chrono::duration<double> timeout) {
+  waiting_.store(true);
+  if (sequence_.load() == sequence) {
+#if defined(__linux__)
+    static_assert(sizeof(sequence_) == sizeof(uint32_t),
+                  "futex requires a 32-bit word.");
+    auto timeout_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count();
+    timespec ts;
+    ts.tv_sec = timeout_ns / std::nano::den;
+    ts.tv_nsec = timeout_ns % std::nano::den;
+    // Returns immediately if the sequence has changed since the load above.
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&sequence_),
+            FUTEX_WAIT_PRIVATE, sequence, &ts, nullptr, 0);
+#else
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait_for(lock, timeout, [&] { return sequence_.load() != sequence; });
+#endif
+  }
+  waiting_.store(false);
+  return sequence_.load() != sequence;
 }
 
 void Logger::StartIOThread() {
@@ -261,16 +962,18 @@ void Logger::StopIOThread() {
   {
     std::unique_lock<std::mutex> lock(io_thread_mutex_);
     keep_io_thread_alive_ = false;
-    io_thread_cv_.notify_all();
   }
+  WakeIOThread();
   io_thread_.join();
 }
 
 void Logger::StartLogging(std::ostream* summary, std::ostream* detail,
-                          std::ostream* accuracy, bool copy_detail_to_stdout,
+                          std::ostream* accuracy, std::ostream* time_series,
+                          bool copy_detail_to_stdout,
                           bool copy_summary_to_stdout) {
-  async_logger_.SetLogFiles(summary, detail, accuracy, copy_detail_to_stdout,
-                            copy_summary_to_stdout, PerfClock::now());
+  async_logger_.SetLogFiles(summary, detail, accuracy, time_series,
+                            copy_detail_to_stdout, copy_summary_to_stdout,
+                            PerfClock::now());
 }
 
 void Logger::StopLogging() {
@@ -280,40 +983,163 @@ void Logger::StopLogging() {
   }
 
   // Flush logs from this thread.
+  SetDeferIO(false);
   std::promise<void> io_thread_flushed_this_thread;
-  Log([&](AsyncLog&) { io_thread_flushed_this_thread.set_value(); });
+  Log([&](AsyncLog& log) {
+    log.DeferUntilWritten([&] { io_thread_flushed_this_thread.set_value(); });
+  });
+  WakeIOThread();
   io_thread_flushed_this_thread.get_future().wait();
-  async_logger_.SetLogFiles(&std::cerr, &std::cerr, &std::cerr, false, false,
-                            PerfClock::now());
+  async_logger_.SetLogFiles(&std::cerr, &std::cerr, &std::cerr, nullptr,
+                            false, false, PerfClock::now());
+  async_logger_.SetLatencyExportFiles(nullptr, nullptr);
+  exporting_latencies_.store(false, std::memory_order_relaxed);
+}
+
+void Logger::StartLatencyExport(std::ostream* latencies,
+                                std::ostream* latency_histogram) {
+  async_logger_.SetLatencyExportFiles(latencies, latency_histogram);
+  exporting_latencies_.store(latencies || latency_histogram,
+                             std::memory_order_relaxed);
 }
 
 void Logger::StartNewTrace(std::ostream* trace_out,
-                           PerfClock::time_point origin) {
-  async_logger_.StartNewTrace(trace_out, origin);
+                           PerfClock::time_point origin, TraceFormat format) {
+  async_logger_.StartNewTrace(trace_out, origin, format);
 }
 
 void Logger::StopTracing() {
   // Flush traces from this thread.
   std::promise<void> io_thread_flushed_this_thread;
-  Log([&](AsyncLog&) { io_thread_flushed_this_thread.set_value(); });
+  Log([&](AsyncLog& log) {
+    log.DeferUntilWritten([&] { io_thread_flushed_this_thread.set_value(); });
+  });
+  WakeIOThread();
   io_thread_flushed_this_thread.get_future().wait();
-  async_logger_.StartNewTrace(nullptr, PerfClock::now());
+  async_logger_.StartNewTrace(nullptr, PerfClock::now(),
+                              TraceFormat::ChromeJson);
+}
+
+void Logger::ApplyLogSettings(const LogSettings& log_settings) {
+  SetTracingEnabled(log_settings.enable_trace);
+  async_logger_.SetTimeSeriesWindow(
+      std::chrono::milliseconds(log_settings.time_series_window_ms));
+  std::unique_lock<std::mutex> lock(io_thread_mutex_);
+  log_mode_ = log_settings.log_mode;
+  poll_period_ = std::chrono::milliseconds(
+      std::max<uint64_t>(log_settings.log_mode_async_poll_interval_ms, 1));
+  serializer_thread_count_ = std::min<uint64_t>(
+      log_settings.log_serializer_thread_count, kMaxSerializerThreads);
+  bool end_of_test_only = log_mode_ == LoggingMode::EndOfTestOnly;
+  size_t max_deferred_bytes =
+      log_settings.log_mode_end_of_test_max_memory_mb * 1024 * 1024;
+  log_entry_chunk_pool_.SetMaxBytes(log_settings.log_buffer_max_memory_mb *
+                                    1024 * 1024);
+  max_deferred_bytes_.store(end_of_test_only
+                                ? max_deferred_bytes
+                                : std::numeric_limits<size_t>::max(),
+                            std::memory_order_relaxed);
+  lock.unlock();
+
+  // Allocated here, before the run, so logging threads don't allocate
+  // chunks during the run.
+  log_entry_chunk_pool_.Reserve(
+      std::min(log_settings.log_buffer_reserved_memory_mb,
+               log_settings.log_buffer_max_memory_mb) *
+      1024 * 1024);
+}
+
+void Logger::SetDeferIO(bool defer) {
+  {
+    std::unique_lock<std::mutex> lock(io_thread_mutex_);
+    if (log_mode_ != LoggingMode::EndOfTestOnly) {
+      return;
+    }
+    defer_io_ = defer;
+    io_deferred_.store(defer, std::memory_order_relaxed);
+    max_deferred_bytes_exceeded_.store(false, std::memory_order_relaxed);
+  }
+  WakeIOThread();
+}
+
+// Returns true if the IOThread should not process any logs yet.
+bool Logger::WaitWhileDeferringIO() {
+  uint32_t wake_sequence = io_thread_wakeup_.Sequence();
+  std::chrono::duration<double> poll_period;
+  bool exceeded = false;
+  {
+    std::unique_lock<std::mutex> lock(io_thread_mutex_);
+    if (!keep_io_thread_alive_ || !defer_io_) {
+      return false;
+    }
+    exceeded = max_deferred_bytes_exceeded_.load(std::memory_order_relaxed);
+    // Fall back to processing logs asynchronously rather than dropping
+    // them if the memory cap was exceeded.
+    defer_io_ = !exceeded;
+    io_deferred_.store(defer_io_, std::memory_order_relaxed);
+    poll_period = poll_period_;
+  }
+
+  if (exceeded) {
+    ReportDeferredBytesExceeded();
+    return false;
+  }
+  io_thread_wakeup_.WaitFor(wake_sequence, poll_period);
+  return true;
+}
+
+void Logger::ReportDeferredBytesExceeded() {
+  LogError([reserved = log_entry_chunk_pool_.BytesInUse(),
+            max = max_deferred_bytes_.load()](AsyncLog& log) {
+    log.LogDetail(
+        "EndOfTestOnly log memory cap exceeded. Processing logs "
+        "asynchronously for the remainder of the run.",
+        "reserved_bytes", reserved, "max_bytes", max);
+  });
+}
+
+void Logger::WakeIOThread() {
+  // Only the oldest outstanding request is used to measure wake latency.
+  if (wake_requested_time_ns_.load(std::memory_order_relaxed) == 0) {
+    int64_t no_request = 0;
+    wake_requested_time_ns_.compare_exchange_strong(
+        no_request, PerfClockNowNs(), std::memory_order_relaxed);
+  }
+  io_thread_wakeup_.Wake();
+}
+
+void Logger::RecordIOThreadWake(bool woken) {
+  int64_t requested_time_ns =
+      wake_requested_time_ns_.exchange(0, std::memory_order_relaxed);
+  if (!woken) {
+    io_thread_poll_wake_count_++;
+    return;
+  }
+  io_thread_requested_wake_count_++;
+  if (requested_time_ns != 0) {
+    int64_t latency = PerfClockNowNs() - requested_time_ns;
+    io_thread_wake_latency_total_ns_ += latency;
+    io_thread_wake_latency_max_ns_ =
+        std::max(io_thread_wake_latency_max_ns_, latency);
+  }
 }
 
 void Logger::LogContentionCounters() {
   LogDetail([&](AsyncLog& log) {
+    size_t tls_logger_create_count, tls_logger_reuse_count, slot_count;
     {
-      std::unique_lock<std::mutex> lock(tls_loggers_registerd_mutex_);
-      for (auto tls_logger : tls_loggers_registerd_) {
-        CollectTlsLoggerStats(tls_logger);
+      std::unique_lock<std::mutex> lock(tls_loggers_mutex_);
+      for (auto& tls_logger : tls_loggers_registerd_) {
+        CollectTlsLoggerStats(tls_logger.get());
       }
-    }
-
-    {
-      std::unique_lock<std::mutex> lock(tls_logger_orphans_mutex_);
       for (auto& orphan : tls_logger_orphans_) {
         CollectTlsLoggerStats(orphan.get());
       }
+      tls_logger_create_count = tls_logger_create_count_;
+      tls_logger_reuse_count = tls_logger_reuse_count_;
+      tls_logger_create_count_ = 0;
+      tls_logger_reuse_count_ = 0;
+      slot_count = swap_request_tables_[swap_request_generation_]->slots.size();
     }
 
     log.LogDetail("Log Contention Counters:");
@@ -330,34 +1156,103 @@ void Logger::LogContentionCounters() {
     log.LogDetail(std::to_string(tls_total_swap_buffers_slot_retry_count_) +
                   " : tls_total_swap_buffers_slot_retry_count");
 
+    log.LogDetail(std::to_string(tls_logger_create_count) +
+                  " : tls_logger_create_count");
+    log.LogDetail(std::to_string(tls_logger_reuse_count) +
+                  " : tls_logger_reuse_count");
+    log.LogDetail(std::to_string(slot_count) + " : swap_request_slot_count");
+
+    log.LogDetail("Log Memory Counters:");
+    log.LogDetail(std::to_string(tls_total_dropped_entry_count_) +
+                  " : tls_total_dropped_entry_count");
+    log.LogDetail(std::to_string(log_entry_chunk_pool_.ReportOverCapCount()) +
+                  " : log_entry_chunk_over_cap_count");
+    log.LogDetail(
+        std::to_string(log_entry_chunk_pool_.ReportPeakBytesInUse()) +
+        " : log_entry_chunk_peak_bytes");
+
+    int64_t io_thread_wake_latency_mean_ns =
+        io_thread_requested_wake_count_ == 0
+            ? 0
+            : io_thread_wake_latency_total_ns_ /
+                  static_cast<int64_t>(io_thread_requested_wake_count_);
+    log.LogDetail("IO Thread Wake Counters:");
+    log.LogDetail(std::to_string(io_thread_poll_wake_count_) +
+                  " : io_thread_poll_wake_count");
+    log.LogDetail(std::to_string(io_thread_requested_wake_count_) +
+                  " : io_thread_requested_wake_count");
+    log.LogDetail(std::to_string(io_thread_wake_latency_mean_ns) +
+                  " : io_thread_wake_latency_mean_ns");
+    log.LogDetail(std::to_string(io_thread_wake_latency_max_ns_) +
+                  " : io_thread_wake_latency_max_ns");
+
     swap_request_slots_retry_count_ = 0;
     swap_request_slots_retry_retry_count_ = 0;
     swap_request_slots_retry_reencounter_count_ = 0;
     start_reading_entries_retry_count_ = 0;
     tls_total_log_cas_fail_count_ = 0;
     tls_total_swap_buffers_slot_retry_count_ = 0;
+    tls_total_dropped_entry_count_ = 0;
+    io_thread_poll_wake_count_ = 0;
+    io_thread_requested_wake_count_ = 0;
+    io_thread_wake_latency_total_ns_ = 0;
+    io_thread_wake_latency_max_ns_ = 0;
   });
 }
 
-void Logger::RestartLatencyRecording() {
-  async_logger_.RestartLatencyRecording();
+void Logger::RestartLatencyRecording(uint64_t first_sample_sequence_id,
+                                     bool keep_latencies) {
+  async_logger_.RestartLatencyRecording(first_sample_sequence_id,
+                                        keep_latencies);
+  bool end_of_test_only;
+  {
+    std::unique_lock<std::mutex> lock(io_thread_mutex_);
+    draining_latencies_ = false;
+    end_of_test_only = log_mode_ == LoggingMode::EndOfTestOnly;
+  }
+  // The whole run is buffered, so its memory is reserved before it starts.
+  if (end_of_test_only) {
+    log_entry_chunk_pool_.Reserve(
+        std::min(max_deferred_bytes_.load(std::memory_order_relaxed),
+                 log_entry_chunk_pool_.MaxBytes()));
+  }
+  log_entry_chunk_pool_.SetFrozen(true);
+  SetDeferIO(true);
 }
 
 std::vector<QuerySampleLatency> Logger::GetLatenciesBlocking(
-    size_t expected_count) {
-  return async_logger_.GetLatenciesBlocking(expected_count);
+    size_t expected_count, LatencyHistogram* histogram,
+    LatencyTimeSeries* time_series) {
+  // Latencies are recorded by the IOThread, so it must start processing the
+  // deferred logs before they can be collected.
+  {
+    std::unique_lock<std::mutex> lock(io_thread_mutex_);
+    draining_latencies_ = true;
+  }
+  log_entry_chunk_pool_.SetFrozen(false);
+  SetDeferIO(false);
+  WakeIOThread();
+  return async_logger_.GetLatenciesBlocking(expected_count, histogram,
+                                            time_series);
 }
 
 QuerySampleLatency Logger::GetMaxLatencySoFar() {
   return async_logger_.GetMaxLatencySoFar();
 }
 
-TlsLogger* Logger::GetTlsLoggerThatRequestedSwap(size_t slot, size_t next_id) {
-  uintptr_t slot_value = thread_swap_request_slots_[slot].load();
+bool Logger::GetLastFullTimeSeriesWindow(
+    std::chrono::nanoseconds now, LatencyTimeSeries::WindowStats* stats) {
+  return async_logger_.GetLastFullTimeSeriesWindow(now, stats);
+}
+
+TlsLogger* Logger::GetTlsLoggerThatRequestedSwap(SwapRequestTable* table,
+                                                  size_t slot,
+                                                  uint64_t next_id) {
+  uintptr_t slot_value = table->slots[slot].load();
   if (SwapRequestSlotIsReadable(slot_value)) {
     // TODO: Convert this block to a simple write once we are confidient
     // that we don't need to check for success.
-    bool success = thread_swap_request_slots_[slot].compare_exchange_strong(
+    bool success = table->slots[slot].compare_exchange_strong(
         slot_value, SwapRequestSlotIsWritableValue(next_id));
     if (!success) {
       GlobalLogger().LogErrorSync("CAS failed.", "line", __LINE__);
@@ -376,8 +1271,8 @@ void Logger::GatherRetrySwapRequests(std::vector<TlsLogger*>* threads_to_swap) {
   std::vector<SlotRetry> retry_slots;
   retry_slots.swap(swap_request_slots_to_retry_);
   for (auto& slot_retry : retry_slots) {
-    TlsLogger* tls_logger =
-        GetTlsLoggerThatRequestedSwap(slot_retry.slot, slot_retry.next_id);
+    TlsLogger* tls_logger = GetTlsLoggerThatRequestedSwap(
+        slot_retry.table, slot_retry.slot, slot_retry.next_id);
     if (tls_logger) {
       threads_to_swap->push_back(tls_logger);
     } else {
@@ -388,43 +1283,233 @@ void Logger::GatherRetrySwapRequests(std::vector<TlsLogger*>* threads_to_swap) {
 }
 
 void Logger::GatherNewSwapRequests(std::vector<TlsLogger*>* threads_to_swap) {
-  auto swap_request_end = swap_request_id_.load(std::memory_order_acquire);
-  for (; swap_request_id_read_ < swap_request_end; swap_request_id_read_++) {
-    size_t slot = swap_request_id_read_ % thread_swap_request_slots_.size();
-    size_t next_id = swap_request_id_read_ + thread_swap_request_slots_.size();
-    TlsLogger* tls_logger = GetTlsLoggerThatRequestedSwap(slot, next_id);
-    if (tls_logger) {
-      threads_to_swap->push_back(tls_logger);
-    } else {
-      swap_request_slots_retry_count_++;
-      // A thread is in the middle of its call to RequestSwapBuffers.
-      // Retry later once it's done.
-      auto it = std::find_if(swap_request_slots_to_retry_.begin(),
-                             swap_request_slots_to_retry_.end(),
-                             [=](SlotRetry& s) { return s.slot == slot; });
-      if (it == swap_request_slots_to_retry_.end()) {
-        // This is the first time we are retrying the slot.
-        swap_request_slots_to_retry_.push_back({slot, next_id});
+  const uint64_t kIdMask = (uint64_t(1) << kSwapRequestGenerationShift) - 1;
+  uint64_t swap_request_end = swap_request_id_.load(std::memory_order_acquire);
+  uint64_t end_generation = swap_request_end >> kSwapRequestGenerationShift;
+  while (true) {
+    uint64_t generation = swap_request_id_read_ >> kSwapRequestGenerationShift;
+    SwapRequestTable* table = swap_request_tables_[generation].get();
+    // Finish reading older generations before moving on to the next.
+    uint64_t end = generation == end_generation
+                       ? swap_request_end & kIdMask
+                       : swap_request_tables_[generation + 1]
+                             ->previous_generation_end.load(
+                                 std::memory_order_relaxed);
+    for (uint64_t id = swap_request_id_read_ & kIdMask; id < end; id++) {
+      size_t slot = id % table->slots.size();
+      uint64_t next_id = id + table->slots.size();
+      TlsLogger* tls_logger =
+          GetTlsLoggerThatRequestedSwap(table, slot, next_id);
+      if (tls_logger) {
+        threads_to_swap->push_back(tls_logger);
       } else {
-        // Whoa. We've been retrying this slot since the last time it was
-        // encountered. Just update the next_id.
-        it->next_id = next_id;
-        swap_request_slots_retry_reencounter_count_++;
+        swap_request_slots_retry_count_++;
+        // A thread is in the middle of its call to RequestSwapBuffers.
+        // Retry later once it's done.
+        auto it = std::find_if(
+            swap_request_slots_to_retry_.begin(),
+            swap_request_slots_to_retry_.end(),
+            [=](SlotRetry& s) { return s.table == table && s.slot == slot; });
+        if (it == swap_request_slots_to_retry_.end()) {
+          // This is the first time we are retrying the slot.
+          swap_request_slots_to_retry_.push_back({table, slot, next_id});
+        } else {
+          // Whoa. We've been retrying this slot since the last time it was
+          // encountered. Just update the next_id.
+          it->next_id = next_id;
+          swap_request_slots_retry_reencounter_count_++;
+        }
+      };
+    }
+    if (generation == end_generation) {
+      swap_request_id_read_ = swap_request_end;
+      return;
+    }
+    swap_request_id_read_ = (generation + 1) << kSwapRequestGenerationShift;
+  }
+}
+
+std::chrono::duration<double> Logger::IOThreadPollPeriod() {
+  std::unique_lock<std::mutex> lock(io_thread_mutex_);
+  // Poll more often when something is blocked on the IOThread or when
+  // retries are pending, so a long poll period doesn't stall them.
+  bool retries_pending = !threads_to_read_.empty() ||
+                         !threads_to_swap_deferred_.empty() ||
+                         !swap_request_slots_to_retry_.empty();
+  if (draining_latencies_ || retries_pending) {
+    return std::min<std::chrono::duration<double>>(poll_period_,
+                                                   kMaxDrainPollPeriod);
+  }
+  return poll_period_;
+}
+
+size_t Logger::SerializerThreadCount() {
+  std::unique_lock<std::mutex> lock(io_thread_mutex_);
+  if (serializer_thread_count_ != 0) {
+    return serializer_thread_count_;
+  }
+  // The SUT is done by the time EndOfTestOnly drains the run's logs, so
+  // the drain can use every core.
+  if (log_mode_ == LoggingMode::EndOfTestOnly && draining_latencies_) {
+    return std::max<size_t>(
+        std::min<size_t>(std::thread::hardware_concurrency(),
+                         kMaxSerializerThreads),
+        1);
+  }
+  return 1;
+}
+
+size_t Logger::ProcessEntries(AsyncLog* log,
+                              std::vector<TlsLogger*>* threads_to_read) {
+  size_t start_reading_entries_retry_count = 0;
+  // Read from the threads we are confident have activity.
+  for (std::vector<TlsLogger*>::iterator thread = threads_to_read->begin();
+       thread != threads_to_read->end(); thread++) {
+    // Avoid copying the tid string if it won't be traced.
+    auto trace = MakeScopedTracer(
+        [tid = TracingEnabled() ? *(*thread)->TidAsString() : std::string()](
+            AsyncLog& log) { log.ScopedTrace("Thread", "tid", tid); });
+    TlsLogger::EntryBuffer* entries = (*thread)->StartReadingEntries();
+    if (!entries) {
+      start_reading_entries_retry_count++;
+      continue;
+    }
+
+    log->SetCurrentTracePidTidString((*thread)->TracePidTidString());
+    for (LogEntryChunk* chunk = entries->head; chunk; chunk = chunk->next) {
+      for (size_t i = 0; i < chunk->size; i++) {
+        // Execute the entry to perform the serialization and I/O.
+        chunk->entries[i](*log);
       }
-    };
+    }
+    (*thread)->FinishReadingEntries();
+    // Mark for removal by the call to RemoveValue below.
+    *thread = nullptr;
+  }
+
+  // Only remove threads where reading succeeded so we retry the failed
+  // threads the next time around.
+  RemoveValue(threads_to_read, nullptr);
+  return start_reading_entries_retry_count;
+}
+
+void Logger::ProcessEntriesInParallel() {
+  // Each TlsLogger is always read by the same serializer, so entries from
+  // the same thread are serialized in order.
+  for (auto& serializer : serializers_) {
+    serializer->log.SyncShardWithWriter();
+  }
+  for (TlsLogger* thread : threads_to_read_) {
+    serializers_[thread->Id() % serializers_.size()]
+        ->threads_to_read.push_back(thread);
+  }
+  threads_to_read_.clear();
+
+  {
+    std::unique_lock<std::mutex> lock(serializers_mutex_);
+    serializers_window_++;
+    serializers_busy_ = serializers_.size() - 1;
+  }
+  serializers_work_cv_.notify_all();
+
+  // The IOThread is the first serializer.
+  LogSerializer* first = serializers_.front().get();
+  first->start_reading_entries_retry_count +=
+      ProcessEntries(&first->log, &first->threads_to_read);
+
+  {
+    std::unique_lock<std::mutex> lock(serializers_mutex_);
+    serializers_done_cv_.wait(lock, [&] { return serializers_busy_ == 0; });
+  }
+
+  std::vector<AsyncLog*> shards;
+  for (auto& serializer : serializers_) {
+    start_reading_entries_retry_count_ +=
+        serializer->start_reading_entries_retry_count;
+    serializer->start_reading_entries_retry_count = 0;
+    threads_to_read_.insert(threads_to_read_.end(),
+                            serializer->threads_to_read.begin(),
+                            serializer->threads_to_read.end());
+    serializer->threads_to_read.clear();
+    shards.push_back(&serializer->log);
+  }
+  async_logger_.MergeShards(shards);
+}
+
+void Logger::SerializerThread(LogSerializer* serializer, uint64_t window) {
+  std::unique_lock<std::mutex> lock(serializers_mutex_);
+  while (true) {
+    serializers_work_cv_.wait(lock, [&] {
+      return !keep_serializers_alive_ || serializers_window_ != window;
+    });
+    if (!keep_serializers_alive_) {
+      return;
+    }
+    window = serializers_window_;
+    lock.unlock();
+    serializer->start_reading_entries_retry_count +=
+        ProcessEntries(&serializer->log, &serializer->threads_to_read);
+    lock.lock();
+    if (--serializers_busy_ == 0) {
+      serializers_done_cv_.notify_one();
+    }
+  }
+}
+
+void Logger::ResizeSerializers(size_t count) {
+  // A single serializer is just the IOThread writing to the outputs
+  // directly, without any shards.
+  if (count <= 1) {
+    count = 0;
+  }
+  if (count == serializers_.size()) {
+    return;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(serializers_mutex_);
+    keep_serializers_alive_ = false;
+  }
+  serializers_work_cv_.notify_all();
+  for (auto& serializer : serializers_) {
+    if (serializer->thread.joinable()) {
+      serializer->thread.join();
+    }
+  }
+  serializers_.clear();
+
+  keep_serializers_alive_ = true;
+  for (size_t i = 0; i < count; i++) {
+    serializers_.emplace_back(
+        std::make_unique<LogSerializer>(&async_logger_, i));
+    if (i != 0) {
+      serializers_.back()->thread =
+          std::thread(&Logger::SerializerThread, this,
+                      serializers_.back().get(), serializers_window_);
+    }
   }
 }
 
 void Logger::IOThread() {
+  // Wakes requested while processing will cause the next wait to return
+  // immediately.
+  uint32_t wake_sequence = io_thread_wakeup_.Sequence();
   while (keep_io_thread_alive_) {
+    // Don't trace the loop while deferring IO, since the traces would
+    // just accumulate in memory with all the other logs.
+    if (WaitWhileDeferringIO()) {
+      continue;
+    }
+
     auto trace1 = MakeScopedTracer(
         [](AsyncLog& log) { log.ScopedTrace("IOThreadLoop"); });
     {
       auto trace2 =
           MakeScopedTracer([](AsyncLog& log) { log.ScopedTrace("Wait"); });
-      std::unique_lock<std::mutex> lock(io_thread_mutex_);
-      io_thread_cv_.wait_for(lock, poll_period_,
-                             [&] { return !keep_io_thread_alive_; });
+      bool woken =
+          io_thread_wakeup_.WaitFor(wake_sequence, IOThreadPollPeriod());
+      RecordIOThreadWake(woken);
+      wake_sequence = io_thread_wakeup_.Sequence();
     }
 
     {
@@ -450,33 +1535,13 @@ void Logger::IOThread() {
     {
       auto trace4 =
           MakeScopedTracer([](AsyncLog& log) { log.ScopedTrace("Process"); });
-      // Read from the threads we are confident have activity.
-      for (std::vector<TlsLogger*>::iterator thread = threads_to_read_.begin();
-           thread != threads_to_read_.end(); thread++) {
-        auto trace5 =
-            MakeScopedTracer([tid = *(*thread)->TidAsString()](AsyncLog& log) {
-              log.ScopedTrace("Thread", "tid", tid);
-            });
-        std::vector<AsyncLogEntry>* entries = (*thread)->StartReadingEntries();
-        if (!entries) {
-          start_reading_entries_retry_count_++;
-          continue;
-        }
-
-        async_logger_.SetCurrentTracePidTidString(
-            (*thread)->TracePidTidString());
-        for (auto& entry : *entries) {
-          // Execute the entry to perform the serialization and I/O.
-          entry(async_logger_);
-        }
-        (*thread)->FinishReadingEntries();
-        // Mark for removal by the call to RemoveValue below.
-        *thread = nullptr;
+      ResizeSerializers(SerializerThreadCount());
+      if (serializers_.empty()) {
+        start_reading_entries_retry_count_ +=
+            ProcessEntries(&async_logger_, &threads_to_read_);
+      } else {
+        ProcessEntriesInParallel();
       }
-
-      // Only remove threads where reading succeeded so we retry the failed
-      // threads the next time around.
-      RemoveValue(&threads_to_read_, nullptr);
     }
 
     {
@@ -485,33 +1550,69 @@ void Logger::IOThread() {
       async_logger_.Flush();
     }
 
-    if (!orphans_to_destroy_.empty()) {
+    if (!orphans_to_recycle_.empty()) {
       auto trace7 = MakeScopedTracer(
-          [](AsyncLog& log) { log.ScopedTrace("Abandoning Orphans"); });
-      std::unique_lock<std::mutex> lock(tls_logger_orphans_mutex_);
-      for (auto orphan : orphans_to_destroy_) {
-        tls_logger_orphans_.erase(orphan);
+          [](AsyncLog& log) { log.ScopedTrace("Recycling Orphans"); });
+      std::unique_lock<std::mutex> lock(tls_loggers_mutex_);
+      // Orphans whose thread hasn't returned from Log yet are retried on
+      // the next iteration.
+      auto recycle_end =
+          std::partition(orphans_to_recycle_.begin(), orphans_to_recycle_.end(),
+                         [](TlsLoggerList::iterator orphan) {
+                           return (*orphan)->Detatched();
+                         });
+      for (auto orphan = orphans_to_recycle_.begin(); orphan != recycle_end;
+           orphan++) {
+        tls_loggers_free_.splice(tls_loggers_free_.begin(),
+                                 tls_logger_orphans_, *orphan);
       }
-      orphans_to_destroy_.clear();
+      orphans_to_recycle_.erase(orphans_to_recycle_.begin(), recycle_end);
     }
   }
+  ResizeSerializers(0);
 }
 
-TlsLogger::TlsLogger(std::function<void()> forced_detatch)
-    : forced_detatch_(std::move(forced_detatch)) {
-  std::stringstream ss;
-  ss << std::this_thread::get_id();
-  tid_as_string_ = ss.str();
-  trace_pid_tid_ = "\"pid\": " + std::to_string(MLPERF_GET_PID()) + ", " +
-                   "\"tid\": " + tid_as_string_ + ", ";
+namespace {
+std::atomic<size_t> g_next_tls_logger_id{0};
+}  // namespace
+
+TlsLogger::TlsLogger()
+    : id_(g_next_tls_logger_id.fetch_add(1, std::memory_order_relaxed)) {}
+
+// The previous thread's entries have all been processed by now, so the
+// buffers and the consumer's state carry over as is.
+void TlsLogger::AttachToThread(Logger::TlsLoggerList::iterator registry_node,
+                               std::function<void()> forced_detatch) {
+  static const std::string pid_as_string = std::to_string(MLPERF_GET_PID());
+  registry_node_ = registry_node;
+  forced_detatch_ = std::move(forced_detatch);
+  detatched_.store(false, std::memory_order_relaxed);
+  AssignStreamed(&tid_as_string_, std::this_thread::get_id());
+  trace_pid_tid_.assign("\"pid\": ");
+  trace_pid_tid_.append(pid_as_string);
+  trace_pid_tid_.append(", \"tid\": ");
+  trace_pid_tid_.append(tid_as_string_);
+  trace_pid_tid_.append(", ");
 }
 
-TlsLogger::~TlsLogger() {}
+TlsLogger::~TlsLogger() {
+  for (auto& entries : entries_) {
+    LogEntryChunk* chunk = entries.head;
+    while (chunk) {
+      LogEntryChunk* next = chunk->next;
+      for (size_t i = 0; i < chunk->size; i++) {
+        chunk->entries[i] = nullptr;
+      }
+      GlobalLogger().ReleaseLogEntryChunk(chunk);
+      chunk = next;
+    }
+  }
+}
 
 // Log always makes forward progress since it can unconditionally obtain a
 // "lock" on at least one of the buffers for writting.
 // Notificiation is also lock free.
-void TlsLogger::Log(AsyncLogEntry&& entry) {
+void TlsLogger::Log(AsyncLogEntry&& entry, bool droppable) {
   size_t cas_fail_count = 0;
   auto unlocked = EntryState::Unlocked;
   size_t i_write = i_write_.load(std::memory_order_relaxed);
@@ -531,7 +1632,10 @@ void TlsLogger::Log(AsyncLogEntry&& entry) {
     }
     log_cas_fail_count_.fetch_add(1, std::memory_order_relaxed);
   }
-  entries_[i_write].emplace_back(std::forward<AsyncLogEntry>(entry));
+  EntryBuffer& entries = entries_[i_write];
+  bool appended = AppendEntry(&entries, std::forward<AsyncLogEntry>(entry),
+                              droppable);
+  bool wake_io_thread = entries.size == kTlsLoggerWakeWatermark;
 
   // TODO: Convert this block to a simple write once we are confidient
   // that we don't need to check for success.
@@ -548,6 +1652,37 @@ void TlsLogger::Log(AsyncLogEntry&& entry) {
     GlobalLogger().RequestSwapBuffers(this);
     i_write_prev_ = i_write;
   }
+
+  if (!appended) {
+    dropped_entry_count_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Wake after the swap request above so the IOThread is guaranteed to
+  // find this buffer.
+  if (wake_io_thread) {
+    GlobalLogger().WakeIOThread();
+  }
+}
+
+bool TlsLogger::AppendEntry(EntryBuffer* entries, AsyncLogEntry&& entry,
+                            bool droppable) {
+  // The consumer leaves the first chunk of each buffer in place for reuse.
+  LogEntryChunk* chunk = entries->tail;
+  if (!chunk || chunk->size == kLogEntryChunkCapacity) {
+    chunk = GlobalLogger().AcquireLogEntryChunk(droppable);
+    if (!chunk) {
+      return false;
+    }
+    if (entries->tail) {
+      entries->tail->next = chunk;
+    } else {
+      entries->head = chunk;
+    }
+    entries->tail = chunk;
+  }
+  chunk->entries[chunk->size++] = std::move(entry);
+  entries->size++;
+  return true;
 }
 
 void TlsLogger::SwapBuffers() {
@@ -567,7 +1702,7 @@ void TlsLogger::SwapBuffers() {
 }
 
 // Returns nullptr if read lock fails.
-std::vector<AsyncLogEntry>* TlsLogger::StartReadingEntries() {
+TlsLogger::EntryBuffer* TlsLogger::StartReadingEntries() {
   auto unlocked = EntryState::Unlocked;
   if (entry_states_[i_read_].compare_exchange_strong(
           unlocked, EntryState::ReadLock, std::memory_order_acquire,
@@ -578,7 +1713,24 @@ std::vector<AsyncLogEntry>* TlsLogger::StartReadingEntries() {
 }
 
 void TlsLogger::FinishReadingEntries() {
-  entries_[i_read_].clear();
+  EntryBuffer& entries = entries_[i_read_];
+  LogEntryChunk* chunk = entries.head;
+  while (chunk) {
+    LogEntryChunk* next = chunk->next;
+    for (size_t i = 0; i < chunk->size; i++) {
+      // Destroys whatever the entry captured.
+      chunk->entries[i] = nullptr;
+    }
+    if (chunk == entries.head) {
+      chunk->size = 0;
+      chunk->next = nullptr;
+    } else {
+      GlobalLogger().ReleaseLogEntryChunk(chunk);
+    }
+    chunk = next;
+  }
+  entries.tail = entries.head;
+  entries.size = 0;
   unread_swaps_--;
 }
 
@@ -602,36 +1754,44 @@ Logger& GlobalLogger() {
 // TlsLoggerWrapper moves ownership of the TlsLogger to Logger on thread exit
 // so no round-trip synchronization with the IO thread is required.
 struct TlsLoggerWrapper {
-  TlsLoggerWrapper(std::function<void()> forced_detatch)
-      : tls_logger(std::make_unique<TlsLogger>(std::move(forced_detatch))) {
-    GlobalLogger().RegisterTlsLogger(tls_logger.get());
+  ~TlsLoggerWrapper() { Detatch(); }
+  void Attach(std::function<void()> forced_detatch) {
+    tls_logger = GlobalLogger().RegisterTlsLogger(std::move(forced_detatch));
   }
-  ~TlsLoggerWrapper() {
+  void Detatch() {
+    if (!tls_logger) {
+      return;
+    }
     tls_logger->TraceCounters();
-    GlobalLogger().UnRegisterTlsLogger(std::move(tls_logger));
+    GlobalLogger().UnRegisterTlsLogger(tls_logger);
+    tls_logger = nullptr;
   }
-  std::unique_ptr<TlsLogger> tls_logger;
+  TlsLogger* tls_logger = nullptr;
 };
 
-TlsLoggerWrapper* InitializeMyTlsLoggerWrapper() {
-  thread_local std::unique_ptr<TlsLoggerWrapper> tls_logger_wrapper;
+TlsLogger* InitializeMyTlsLogger() {
+  thread_local TlsLoggerWrapper tls_logger_wrapper;
   // forced_detatch lets the global Logger forcefully detatch TlsLoggers
   // from the thread in the Logger's destructor, which may run before
   // thread-local variables are destroyed when the loadgen is used as a python
   // module and dynamically unloaded.
-  auto forced_detatch = [&]() { tls_logger_wrapper.reset(); };
-  tls_logger_wrapper = std::make_unique<TlsLoggerWrapper>(forced_detatch);
-  return tls_logger_wrapper.get();
+  TlsLoggerWrapper* wrapper = &tls_logger_wrapper;
+  auto forced_detatch = [wrapper]() { wrapper->Detatch(); };
+  wrapper->Attach(forced_detatch);
+  return wrapper->tls_logger;
 }
 
-TlsLogger* InitializeMyTlsLogger() {
-  thread_local TlsLoggerWrapper* wrapper = InitializeMyTlsLoggerWrapper();
-  return wrapper->tls_logger.get();
+TlsLogger* MyTlsLogger() {
+  thread_local TlsLogger* const tls_logger = InitializeMyTlsLogger();
+  return tls_logger;
 }
 
 void Log(AsyncLogEntry&& entry) {
-  thread_local TlsLogger* const tls_logger = InitializeMyTlsLogger();
-  tls_logger->Log(std::forward<AsyncLogEntry>(entry));
+  MyTlsLogger()->Log(std::forward<AsyncLogEntry>(entry), false);
+}
+
+void LogTrace(AsyncLogEntry&& entry) {
+  MyTlsLogger()->Log(std::forward<AsyncLogEntry>(entry), true);
 }
 
 }  // namespace mlperf
@@ -18,18 +18,25 @@ limitations under the License.
 #include <cassert>
 #include <chrono>
 #include <condition_variable>
+#include <cstring>
 #include <functional>
 #include <future>
 #include <iostream>
 #include <list>
 #include <mutex>
 #include <set>
+#include <sstream>
 #include <string>
 #include <thread>
-#include <unordered_set>
+#include <type_traits>
 #include <vector>
 
+#include "binary_trace.h"
+#include "latency_export.h"
+#include "latency_histogram.h"
+#include "latency_time_series.h"
 #include "query_sample.h"
+#include "test_settings.h"
 
 namespace mlperf {
 
@@ -37,21 +44,124 @@ class AsyncLog;
 class Logger;
 class TlsLogger;
 class TlsLoggerWrapper;
+struct LogSerializer;
+struct LogEntryChunk;
 
 using AsyncLogEntry = std::function<void(AsyncLog&)>;
 using PerfClock = std::chrono::high_resolution_clock;
 
+// Tracing is switched at runtime via LogSettings::enable_trace and checked
+// before any trace reads the clock or logs anything.
+// Defining MLPERF_LOADGEN_DISABLE_TRACING removes tracing at compile time.
+#if defined(MLPERF_LOADGEN_DISABLE_TRACING)
+constexpr bool TracingEnabled() { return false; }
+inline void SetTracingEnabled(bool) {}
+#else
+extern std::atomic<bool> g_tracing_enabled;
+inline bool TracingEnabled() {
+  return g_tracing_enabled.load(std::memory_order_relaxed);
+}
+inline void SetTracingEnabled(bool enabled) {
+  g_tracing_enabled.store(enabled, std::memory_order_relaxed);
+}
+#endif
+
 struct LogBinaryAsHexString {
   std::vector<uint8_t>* data;
 };
 
-const std::string& ArgValueTransform(const bool& value);
-const std::string ArgValueTransform(const LogBinaryAsHexString& value);
+// Formats a log line into a local buffer and writes it to |out| in one call
+// when destroyed. Integers and hex strings are formatted by hand, bypassing
+// the locale and virtual calls std::ostream makes for every value.
+class LogLineWriter {
+ public:
+  explicit LogLineWriter(std::ostream* out) : out_(out) {}
+  ~LogLineWriter() { Flush(); }
+  LogLineWriter(const LogLineWriter&) = delete;
+  LogLineWriter& operator=(const LogLineWriter&) = delete;
+
+  LogLineWriter& operator<<(const std::string& value) {
+    Append(value.data(), value.size());
+    return *this;
+  }
 
-template <typename T>
-const T& ArgValueTransform(const T& value) {
-  return value;
-}
+  LogLineWriter& operator<<(const char* value) {
+    Append(value, std::strlen(value));
+    return *this;
+  }
+
+  LogLineWriter& operator<<(char value) {
+    Append(&value, 1);
+    return *this;
+  }
+
+  LogLineWriter& operator<<(bool value) {
+    return *this << (value ? "true" : "false");
+  }
+
+  // Single byte integers are formatted as characters, like std::ostream.
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value &&
+                              std::is_signed<T>::value && (sizeof(T) > 1),
+                          LogLineWriter&>::type
+  operator<<(T value) {
+    AppendSigned(value);
+    return *this;
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value &&
+                              std::is_unsigned<T>::value && (sizeof(T) > 1),
+                          LogLineWriter&>::type
+  operator<<(T value) {
+    AppendUnsigned(value);
+    return *this;
+  }
+
+  LogLineWriter& operator<<(double value);
+  LogLineWriter& operator<<(const LogBinaryAsHexString& value);
+
+  // Anything else is formatted by the stream itself.
+  template <typename T>
+  typename std::enable_if<!std::is_arithmetic<T>::value ||
+                              std::is_same<T, signed char>::value ||
+                              std::is_same<T, unsigned char>::value,
+                          LogLineWriter&>::type
+  operator<<(const T& value) {
+    Flush();
+    *out_ << value;
+    return *this;
+  }
+
+ private:
+  void Append(const char* data, size_t size) {
+    if (size > kBufferSize - size_) {
+      Flush();
+      if (size > kBufferSize) {
+        out_->write(data, size);
+        return;
+      }
+    }
+    std::memcpy(buffer_ + size_, data, size);
+    size_ += size;
+  }
+
+  void AppendUnsigned(uint64_t value);
+  void AppendSigned(int64_t value);
+
+  void Flush() {
+    if (size_ != 0) {
+      out_->write(buffer_, size_);
+      size_ = 0;
+    }
+  }
+
+  static constexpr size_t kBufferSize = 512;
+
+  std::ostream* out_;
+  size_t size_ = 0;
+  char buffer_[kBufferSize];
+};
 
 // AsyncLog is passed as an argument to the log lambda on the
 // recording thread to serialize the data captured by the lambda and
@@ -59,11 +169,27 @@ const T& ArgValueTransform(const T& value) {
 // TODO: Move non-templated methods to the cc file.
 class AsyncLog {
  public:
-  ~AsyncLog() { StartNewTrace(nullptr, PerfClock::now()); }
+  AsyncLog() = default;
+
+  // Creates a shard that serializes entries into its own buffers, so several
+  // threads can serialize entries at once. |writer| owns the real outputs
+  // and merges the buffers of all its shards via MergeShards.
+  AsyncLog(AsyncLog* writer, uint64_t shard_index)
+      : writer_(writer), shard_index_(shard_index) {
+    summary_out_ = &shard_summary_;
+    detail_out_ = &shard_detail_;
+    accuracy_out_ = &shard_accuracy_;
+  }
+
+  ~AsyncLog() {
+    if (!writer_) {
+      StartNewTrace(nullptr, PerfClock::now(), TraceFormat::ChromeJson);
+    }
+  }
 
   void SetLogFiles(std::ostream* summary, std::ostream* detail,
-                   std::ostream* accuracy, bool copy_detail_to_stdout,
-                   bool copy_summary_to_stdout,
+                   std::ostream* accuracy, std::ostream* time_series,
+                   bool copy_detail_to_stdout, bool copy_summary_to_stdout,
                    PerfClock::time_point log_origin) {
     std::unique_lock<std::mutex> lock(log_mutex_);
     if (summary_out_ != &std::cerr) {
@@ -91,19 +217,27 @@ class AsyncLog {
       WriteAccuracyFooterLocked();
       accuracy_out_->flush();
     }
+    if (time_series_out_) {
+      time_series_out_->flush();
+    }
     summary_out_ = summary;
     detail_out_ = detail;
     accuracy_out_ = accuracy;
+    time_series_out_ = time_series;
     if (accuracy_out_ != &std::cerr) {
       WriteAccuracyHeaderLocked();
     }
+    if (time_series_out_) {
+      WriteTimeSeriesHeaderLocked();
+    }
     copy_detail_to_stdout_ = copy_detail_to_stdout;
     copy_summary_to_stdout_ = copy_summary_to_stdout;
     log_origin_ = log_origin;
     log_error_count_ = 0;
   }
 
-  void StartNewTrace(std::ostream* trace_out, PerfClock::time_point origin) {
+  void StartNewTrace(std::ostream* trace_out, PerfClock::time_point origin,
+                     TraceFormat format) {
     std::unique_lock<std::mutex> lock(trace_mutex_);
     // Cleanup previous trace.
     if (trace_out_) {
@@ -114,6 +248,8 @@ class AsyncLog {
     // Setup new trace.
     trace_out_ = trace_out;
     trace_origin_ = origin;
+    trace_binary_ = format == TraceFormat::Binary;
+    trace_generation_++;
     if (trace_out_) {
       WriteTraceEventHeaderLocked();
     }
@@ -131,11 +267,21 @@ class AsyncLog {
       if (accuracy_out_) {
         accuracy_out_->flush();
       }
+      if (time_series_out_) {
+        time_series_out_->flush();
+      }
+      if (latencies_out_) {
+        latencies_out_->flush();
+      }
+      if (latency_histogram_out_) {
+        latency_histogram_out_->flush();
+      }
     }
 
     {
+      // The binary trace is only written when its buffer fills up.
       std::unique_lock<std::mutex> lock(trace_mutex_);
-      if (trace_out_) {
+      if (trace_out_ && !trace_binary_) {
         trace_out_->flush();
       }
     }
@@ -145,6 +291,26 @@ class AsyncLog {
     current_pid_tid_ = pid_tid;
   }
 
+  // Writes everything output so far through to the files, including the
+  // partial blocks of LargeBlock and Direct sinks.
+  void DrainSinks();
+
+  // Called on a shard before it serializes entries, while the shard is idle.
+  void SyncShardWithWriter();
+  // Called on the writer once all its shards are idle.
+  void MergeShards(const std::vector<AsyncLog*>& shards);
+
+  // Runs |task| once everything serialized before it has been written to the
+  // output streams. For a shard, that is after its next merge, on the
+  // merging thread.
+  void DeferUntilWritten(std::function<void()> task) {
+    if (writer_) {
+      deferred_tasks_.push_back(std::move(task));
+    } else {
+      task();
+    }
+  }
+
   template <typename... Args>
   void LogSummary(const std::string& message, const Args... args) {
     auto trace = MakeScopedTracer([message](AsyncLog& log) {
@@ -156,14 +322,18 @@ class AsyncLog {
       log.ScopedTrace("LogSummary", "message", "\"" + sanitized_message + "\"");
     });
     std::unique_lock<std::mutex> lock(log_mutex_);
-    *summary_out_ << message;
-    LogArgs(summary_out_, args...);
-    *summary_out_ << "\n";
+    {
+      LogLineWriter line(summary_out_);
+      line << message;
+      LogArgs(&line, args...);
+      line << "\n";
+    }
 
     if (copy_summary_to_stdout_) {
-      std::cout << message;
-      LogArgs(&std::cout, args...);
-      std::cout << "\n";
+      LogLineWriter line(&std::cout);
+      line << message;
+      LogArgs(&line, args...);
+      line << "\n";
     }
   }
 
@@ -187,21 +357,27 @@ class AsyncLog {
       log.ScopedTrace("LogDetail", "message", "\"" + sanitized_message + "\"");
     });
     std::unique_lock<std::mutex> lock(log_mutex_);
-    std::vector<std::ostream*> detail_streams{detail_out_, &std::cout};
-    if (!copy_detail_to_stdout_) {
-      detail_streams.pop_back();
-    }
+    std::ostream* detail_streams[] = {
+        detail_out_, copy_detail_to_stdout_ ? &std::cout : nullptr};
     for (auto os : detail_streams) {
-      *os << *current_pid_tid_
-          << "\"ts\": " << (log_detail_time_ - log_origin_).count() << "ns : ";
+      if (!os) {
+        continue;
+      }
+      LogLineWriter line(os);
+      line << *current_pid_tid_ << "\"ts\": "
+           << (log_detail_time_ - log_origin_).count() << "ns : ";
       if (error_flagged_) {
-        *os << "ERROR : ";
+        line << "ERROR : ";
       }
-      *os << message;
-      LogArgs(os, args...);
-      *os << "\n";
+      line << message;
+      LogArgs(&line, args...);
+      line << "\n";
     }
     error_flagged_ = false;
+    if (writer_) {
+      shard_detail_lines_.push_back(
+          {log_detail_time_, static_cast<size_t>(shard_detail_.tellp())});
+    }
   }
 
   void LogAccuracy(uint64_t seq_id, const QuerySampleIndex qsl_idx,
@@ -210,10 +386,10 @@ class AsyncLog {
     if (!accuracy_out_) {
       return;
     }
-    *accuracy_out_ << (accuracy_needs_comma_ ? ",\n{ " : "\n{ ");
-    LogArgs(accuracy_out_, "seq_id", seq_id, "qsl_idx", qsl_idx, "data",
-            response);
-    *accuracy_out_ << " }";
+    LogLineWriter line(accuracy_out_);
+    line << (accuracy_needs_comma_ ? ",\n{ " : "\n{ ");
+    LogArgs(&line, "seq_id", seq_id, "qsl_idx", qsl_idx, "data", response);
+    line << " }";
     accuracy_needs_comma_ = true;
   }
 
@@ -224,13 +400,20 @@ class AsyncLog {
     if (!trace_out_) {
       return;
     }
-    *trace_out_ << "{ \"name\": \"" << trace_name << "\", "
-                << "\"ph\": \"X\", " << *current_pid_tid_
-                << "\"ts\": " << (start - trace_origin_).count() << ", "
-                << "\"dur\": " << (end - start).count() << ", "
-                << "\"args\": { ";
-    LogArgs(trace_out_, args...);
-    *trace_out_ << " }},\n";
+    if (trace_binary_) {
+      binary_trace_.WriteComplete(trace_name, *current_pid_tid_,
+                                  (start - trace_origin_).count(),
+                                  (end - start).count(), args...);
+      return;
+    }
+    LogLineWriter line(trace_out_);
+    line << "{ \"name\": \"" << trace_name << "\", "
+         << "\"ph\": \"X\", " << *current_pid_tid_
+         << "\"ts\": " << (start - trace_origin_).count() << ", "
+         << "\"dur\": " << (end - start).count() << ", "
+         << "\"args\": { ";
+    LogArgs(&line, args...);
+    line << " }},\n";
   }
 
   template <typename... Args>
@@ -241,14 +424,21 @@ class AsyncLog {
     if (!trace_out_) {
       return;
     }
-    *trace_out_ << "{\"name\": \"" << trace_name << "\", "
-                << "\"cat\": \"default\", "
-                << "\"ph\": \"n\", "
-                << "\"id\": " << id << ", " << *current_pid_tid_
-                << "\"ts\": " << (instant_time - trace_origin_).count() << ", "
-                << "\"args\": { ";
-    LogArgs(trace_out_, args...);
-    *trace_out_ << " }},\n";
+    if (trace_binary_) {
+      binary_trace_.WriteAsyncInstant(trace_name, *current_pid_tid_, id,
+                                      (instant_time - trace_origin_).count(),
+                                      args...);
+      return;
+    }
+    LogLineWriter line(trace_out_);
+    line << "{\"name\": \"" << trace_name << "\", "
+         << "\"cat\": \"default\", "
+         << "\"ph\": \"n\", "
+         << "\"id\": " << id << ", " << *current_pid_tid_
+         << "\"ts\": " << (instant_time - trace_origin_).count() << ", "
+         << "\"args\": { ";
+    LogArgs(&line, args...);
+    line << " }},\n";
   }
 
   void SetScopedTraceTimes(PerfClock::time_point start,
@@ -264,13 +454,21 @@ class AsyncLog {
     if (!trace_out_) {
       return;
     }
-    *trace_out_ << "{ \"name\": \"" << trace_name << "\", "
-                << "\"ph\": \"X\", " << *current_pid_tid_
-                << "\"ts\": " << (scoped_start_ - trace_origin_).count() << ", "
-                << "\"dur\": " << (scoped_end_ - scoped_start_).count() << ", "
-                << "\"args\": { ";
-    LogArgs(trace_out_, args...);
-    *trace_out_ << " }},\n";
+    if (trace_binary_) {
+      binary_trace_.WriteComplete(trace_name, *current_pid_tid_,
+                                  (scoped_start_ - trace_origin_).count(),
+                                  (scoped_end_ - scoped_start_).count(),
+                                  args...);
+      return;
+    }
+    LogLineWriter line(trace_out_);
+    line << "{ \"name\": \"" << trace_name << "\", "
+         << "\"ph\": \"X\", " << *current_pid_tid_
+         << "\"ts\": " << (scoped_start_ - trace_origin_).count() << ", "
+         << "\"dur\": " << (scoped_end_ - scoped_start_).count() << ", "
+         << "\"args\": { ";
+    LogArgs(&line, args...);
+    line << " }},\n";
   }
 
   template <typename... Args>
@@ -281,64 +479,131 @@ class AsyncLog {
     if (!trace_out_) {
       return;
     }
-    *trace_out_ << "{\"name\": \"" << trace_name << "\", "
-                << "\"cat\": \"default\", "
-                << "\"ph\": \"b\", "
-                << "\"id\": " << id << ", " << *current_pid_tid_
-                << "\"ts\": " << (start - trace_origin_).count() << ", "
-                << "\"args\": { ";
-    LogArgs(trace_out_, args...);
-    *trace_out_ << " }},\n";
-
-    *trace_out_ << "{ \"name\": \"" << trace_name << "\", "
-                << "\"cat\": \"default\", "
-                << "\"ph\": \"e\", "
-                << "\"id\": " << id << ", " << *current_pid_tid_
-                << "\"ts\": " << (end - trace_origin_).count() << " },\n";
+    if (trace_binary_) {
+      binary_trace_.WriteAsyncSpan(trace_name, *current_pid_tid_, id,
+                                   (start - trace_origin_).count(),
+                                   (end - start).count(), args...);
+      return;
+    }
+    LogLineWriter line(trace_out_);
+    line << "{\"name\": \"" << trace_name << "\", "
+         << "\"cat\": \"default\", "
+         << "\"ph\": \"b\", "
+         << "\"id\": " << id << ", " << *current_pid_tid_
+         << "\"ts\": " << (start - trace_origin_).count() << ", "
+         << "\"args\": { ";
+    LogArgs(&line, args...);
+    line << " }},\n";
+
+    line << "{ \"name\": \"" << trace_name << "\", "
+         << "\"cat\": \"default\", "
+         << "\"ph\": \"e\", "
+         << "\"id\": " << id << ", " << *current_pid_tid_
+         << "\"ts\": " << (end - trace_origin_).count() << " },\n";
   }
 
-  void RecordLatency(uint64_t sample_sequence_id, QuerySampleLatency latency) {
-    std::unique_lock<std::mutex> lock(latencies_mutex_);
-    if (latencies_.size() < sample_sequence_id + 1) {
-      // TODO: Reserve in advance.
-      latencies_.resize(sample_sequence_id + 1,
-                        std::numeric_limits<QuerySampleLatency>::min());
-    }
-    latencies_[sample_sequence_id] = latency;
-    latencies_recorded_++;
-    if (AllLatenciesRecorded()) {
-      all_latencies_recorded_.notify_all();
+  // |completion_time| is relative to the start of the phase.
+  void RecordLatency(uint64_t sample_sequence_id, QuerySampleLatency latency,
+                     std::chrono::nanoseconds completion_time) {
+    // Each shard counts its latencies in its own histogram and time series,
+    // which the writer merges along with the rest of the shard.
+    latency_histogram_.Record(latency);
+    if (writer_) {
+      time_series_.Record(completion_time, latency);
+      std::unique_lock<std::mutex> lock(writer_->latencies_mutex_);
+      writer_->StoreLatencyLocked(sample_sequence_id, latency);
+    } else {
+      std::unique_lock<std::mutex> lock(latencies_mutex_);
+      time_series_.Record(completion_time, latency);
+      StoreLatencyLocked(sample_sequence_id, latency);
     }
-    // Relaxed memory order since the early-out checks can be racy.
-    // The final check will be ordered by locks on the latencies_mutex.
-    max_latency_.store(
-        std::max(max_latency_.load(std::memory_order_relaxed), latency),
-        std::memory_order_relaxed);
   }
 
-  void RestartLatencyRecording() {
+  // Latencies are collected by sample sequence id, starting from
+  // |first_sample_sequence_id|. Unless |keep_latencies|, they are only
+  // counted in the histogram and time series, and GetLatenciesBlocking
+  // returns no latencies.
+  void RestartLatencyRecording(uint64_t first_sample_sequence_id,
+                               bool keep_latencies) {
     std::unique_lock<std::mutex> lock(latencies_mutex_);
     assert(latencies_.empty());
+    assert(latency_histogram_.Count() == 0);
+    assert(time_series_.Empty());
     assert(latencies_recorded_ == latencies_expected_);
+    first_sample_sequence_id_ = first_sample_sequence_id;
+    keep_latencies_ = keep_latencies;
     latencies_recorded_ = 0;
     latencies_expected_ = 0;
     max_latency_ = 0;
   }
 
-  std::vector<QuerySampleLatency> GetLatenciesBlocking(size_t expected_count) {
+  // Also merges the histogram of the latencies into |histogram| and moves
+  // their time series into |time_series|.
+  std::vector<QuerySampleLatency> GetLatenciesBlocking(
+      size_t expected_count, LatencyHistogram* histogram,
+      LatencyTimeSeries* time_series) {
     std::vector<QuerySampleLatency> latencies;
     std::unique_lock<std::mutex> lock(latencies_mutex_);
     latencies_expected_ = expected_count;
     all_latencies_recorded_.wait(lock, [&] { return AllLatenciesRecorded(); });
     latencies.swap(latencies_);
+    histogram->Merge(latency_histogram_);
+    latency_histogram_.Reset();
+    *time_series = std::move(time_series_);
+    time_series_.Clear();
     return latencies;
   }
 
+  void SetTimeSeriesWindow(std::chrono::nanoseconds window) {
+    std::unique_lock<std::mutex> lock(latencies_mutex_);
+    time_series_.SetWindow(window);
+  }
+
+  // The time series window before the one that contains |now|, relative to
+  // the start of the phase. Only counts the latencies recorded so far.
+  bool GetLastFullTimeSeriesWindow(std::chrono::nanoseconds now,
+                                   LatencyTimeSeries::WindowStats* stats) {
+    std::unique_lock<std::mutex> lock(latencies_mutex_);
+    return time_series_.StatsAt(now - time_series_.WindowLength(), stats);
+  }
+
+  void LogTimeSeries(const std::string& phase,
+                     const LatencyTimeSeries& time_series);
+
+  // Both may be null, which stops the export.
+  void SetLatencyExportFiles(std::ostream* latencies,
+                             std::ostream* latency_histogram);
+  void LogLatencyExport(const std::vector<LatencyRecord>& records,
+                        const LatencyHistogram& histogram);
+
   QuerySampleLatency GetMaxLatencySoFar() {
-    return max_latency_.load(std::memory_order_release);
+    return max_latency_.load(std::memory_order_acquire);
   }
 
  private:
+  void StoreLatencyLocked(uint64_t sample_sequence_id,
+                          QuerySampleLatency latency) {
+    assert(sample_sequence_id >= first_sample_sequence_id_);
+    if (keep_latencies_) {
+      const size_t i = sample_sequence_id - first_sample_sequence_id_;
+      if (latencies_.size() < i + 1) {
+        // TODO: Reserve in advance.
+        latencies_.resize(i + 1,
+                          std::numeric_limits<QuerySampleLatency>::min());
+      }
+      latencies_[i] = latency;
+    }
+    latencies_recorded_++;
+    if (AllLatenciesRecorded()) {
+      all_latencies_recorded_.notify_all();
+    }
+    // Relaxed memory order since the early-out checks can be racy.
+    // The final check will be ordered by locks on the latencies_mutex.
+    max_latency_.store(
+        std::max(max_latency_.load(std::memory_order_relaxed), latency),
+        std::memory_order_relaxed);
+  }
+
   void WriteAccuracyHeaderLocked() {
     *accuracy_out_ << "[";
     accuracy_needs_comma_ = false;
@@ -346,37 +611,41 @@ class AsyncLog {
 
   void WriteAccuracyFooterLocked() { *accuracy_out_ << "\n]\n"; }
 
+  void WriteTimeSeriesHeaderLocked();
+
   void WriteTraceEventHeaderLocked() {
-    *trace_out_ << "{ \"traceEvents\": [\n";
+    if (trace_binary_) {
+      binary_trace_.Start(trace_out_);
+    } else {
+      WriteChromeTraceJsonHeader(trace_out_);
+    }
   }
 
   void WriteTraceEventFooterLocked() {
-    *trace_out_ << "{ \"name\": \"LastTrace\" }\n"
-                << "],\n"
-                << "\"displayTimeUnit\": \"ns\",\n"
-                << "\"otherData\": {\n"
-                << "\"version\": \"MLPerf LoadGen v0.5a0\"\n"
-                << "}\n"
-                << "}\n";
+    if (trace_binary_) {
+      binary_trace_.Finish();
+    } else {
+      WriteChromeTraceJsonFooter(trace_out_);
+    }
   }
 
-  void LogArgs(std::ostream*) {}
+  void LogArgs(LogLineWriter*) {}
 
   template <typename T>
-  void LogArgs(std::ostream* out, const T& value_only) {
-    *out << ArgValueTransform(value_only);
+  void LogArgs(LogLineWriter* out, const T& value_only) {
+    *out << value_only;
   }
 
   template <typename T>
-  void LogArgs(std::ostream* out, const std::string& arg_name,
+  void LogArgs(LogLineWriter* out, const std::string& arg_name,
                const T& arg_value) {
-    *out << "\"" << arg_name << "\" : " << ArgValueTransform(arg_value);
+    *out << "\"" << arg_name << "\" : " << arg_value;
   }
 
   template <typename T, typename... Args>
-  void LogArgs(std::ostream* out, const std::string& arg_name,
+  void LogArgs(LogLineWriter* out, const std::string& arg_name,
                const T& arg_value, const Args... args) {
-    *out << "\"" << arg_name << "\" : " << ArgValueTransform(arg_value) << ", ";
+    *out << "\"" << arg_name << "\" : " << arg_value << ", ";
     LogArgs(out, args...);
   }
 
@@ -384,6 +653,10 @@ class AsyncLog {
   std::ostream* summary_out_ = &std::cerr;
   std::ostream* detail_out_ = &std::cerr;
   std::ostream* accuracy_out_ = &std::cerr;
+  std::ostream* time_series_out_ = nullptr;
+  std::ostream* latencies_out_ = nullptr;
+  std::ostream* latency_histogram_out_ = nullptr;
+  uint32_t latency_export_run_count_ = 0;
   // TODO: Instead of these bools, use a class that forwards to two streams.
   bool copy_detail_to_stdout_ = false;
   bool copy_summary_to_stdout_ = false;
@@ -395,6 +668,9 @@ class AsyncLog {
   std::mutex trace_mutex_;
   std::ostream* trace_out_ = nullptr;
   PerfClock::time_point trace_origin_;
+  bool trace_binary_ = false;
+  BinaryTraceWriter binary_trace_;
+  uint64_t trace_generation_ = 0;
 
   const std::string* current_pid_tid_ = nullptr;
   PerfClock::time_point log_detail_time_;
@@ -404,30 +680,61 @@ class AsyncLog {
   std::mutex latencies_mutex_;
   std::condition_variable all_latencies_recorded_;
   std::vector<QuerySampleLatency> latencies_;
+  uint64_t first_sample_sequence_id_ = 0;
+  bool keep_latencies_ = true;
   std::atomic<QuerySampleLatency> max_latency_{0};
   size_t latencies_recorded_ = 0;
   size_t latencies_expected_ = 0;
+  // Updated lock-free by the thread serializing this log. A writer's
+  // histogram also holds those of its shards as of the last merge.
+  LatencyHistogram latency_histogram_;
+  // Only a writer's is protected by latencies_mutex_. Like the histogram,
+  // it includes its shards' as of the last merge.
+  LatencyTimeSeries time_series_;
   // Must be called with latencies_mutex_ held.
   bool AllLatenciesRecorded() {
-    return latencies_recorded_ == latencies_expected_;
+    return latencies_recorded_ == latencies_expected_ &&
+           latency_histogram_.Count() == latencies_expected_;
   }
+
+  // Only used by shards.
+  AsyncLog* const writer_ = nullptr;
+  const uint64_t shard_index_ = 0;
+  std::ostringstream shard_summary_;
+  std::ostringstream shard_detail_;
+  std::ostringstream shard_accuracy_;
+  std::ostringstream shard_trace_;
+  struct DetailLine {
+    PerfClock::time_point time;
+    size_t end;
+  };
+  std::vector<DetailLine> shard_detail_lines_;
+  std::vector<std::function<void()>> deferred_tasks_;
 };
 
 template <typename LambdaT>
 class ScopedTracer {
  public:
   ScopedTracer(LambdaT&& lambda)
-      : start_(PerfClock::now()), lambda_(std::forward<LambdaT>(lambda)) {}
+      : enabled_(TracingEnabled()), lambda_(std::forward<LambdaT>(lambda)) {
+    if (enabled_) {
+      start_ = PerfClock::now();
+    }
+  }
 
   ~ScopedTracer() {
-    Log([start = start_, lambda = std::move(lambda_),
-         end = PerfClock::now()](AsyncLog& log) {
+    if (!enabled_) {
+      return;
+    }
+    LogTrace([start = start_, lambda = std::move(lambda_),
+              end = PerfClock::now()](AsyncLog& log) {
       log.SetScopedTraceTimes(start, end);
       lambda(log);
     });
   }
 
  private:
+  const bool enabled_;
   PerfClock::time_point start_;
   LambdaT lambda_;
 };
@@ -437,38 +744,159 @@ auto MakeScopedTracer(LambdaT&& lambda) -> ScopedTracer<LambdaT> {
   return ScopedTracer<LambdaT>(std::forward<LambdaT>(lambda));
 }
 
+// Lets producers wake the IOThread early without taking any locks, so
+// TlsLogger::Log keeps its forward-progress guarantee.
+// Uses a futex on Linux. On other platforms wakeups are best effort and
+// the IOThread falls back to its poll period.
+class IOThreadWakeup {
+ public:
+  uint32_t Sequence() const { return sequence_.load(); }
+
+  void Wake();
+
+  // Waits for a call to Wake() made after |sequence| was read or until
+  // |timeout| expires. Returns true if woken.
+  bool WaitFor(uint32_t sequence, std::chrono::duration<double> timeout);
+
+ private:
+  std::atomic<uint32_t> sequence_{0};
+  std::atomic<bool> waiting_{false};
+#if !defined(__linux__)
+  std::mutex mutex_;
+  std::condition_variable cv_;
+#endif
+};
+
+// A lock-free pool of LogEntryChunks shared by all TlsLoggers, so producers
+// never reallocate their buffers and the memory queued for the IOThread is
+// bounded.
+// Once |max_bytes| are in use, only entries that can't be dropped get
+// chunks. Chunks are reserved ahead of time, and while the pool is frozen
+// for a run, producers only take chunks from the free list. Entries that
+// can't be dropped also get an eighth of the reserve that droppable entries
+// can't use. Past that, their chunks are allocated outside of the pool and
+// freed on release.
+class LogEntryChunkPool {
+ public:
+  LogEntryChunkPool() = default;
+  ~LogEntryChunkPool();
+
+  void SetMaxBytes(size_t max_bytes);
+  // Allocates chunks until |bytes|, plus the headroom for entries that
+  // can't be dropped, are pooled. Never shrinks the pool.
+  void Reserve(size_t bytes);
+  // While frozen, the pool doesn't allocate chunks and droppable entries are
+  // limited to the reserve.
+  void SetFrozen(bool frozen);
+
+  // Returns nullptr if |droppable| and the pool is at its cap.
+  // Sets |at_cap| if the pool is at its cap.
+  LogEntryChunk* Acquire(bool droppable, bool* at_cap);
+  void Release(LogEntryChunk* chunk);
+
+  size_t BytesInUse() const;
+  size_t MaxBytes() const;
+
+  // These reset the counters they report.
+  size_t ReportPeakBytesInUse();
+  size_t ReportOverCapCount();
+
+ private:
+  static constexpr size_t kSegmentSize = 4096;
+  static constexpr size_t kSegmentCount = 64;
+
+  LogEntryChunk* PopFree();
+  void PushFree(LogEntryChunk* chunk);
+  LogEntryChunk* AllocatePooled();
+
+  // The index of the first free chunk plus one in the low 32 bits and a tag
+  // that changes on every push in the high bits, to avoid ABA issues.
+  std::atomic<uint64_t> free_list_{0};
+  // Chunks are never freed while pooled, so they are addressed by index
+  // through lazily allocated segments.
+  std::atomic<LogEntryChunk**> segments_[kSegmentCount] = {};
+  std::atomic<size_t> pooled_count_{0};
+
+  std::atomic<size_t> max_chunks_{0};
+  std::atomic<size_t> reserved_chunks_{0};
+  std::atomic<bool> frozen_{false};
+  std::atomic<size_t> chunks_in_use_{0};
+  std::atomic<size_t> peak_chunks_in_use_{0};
+  std::atomic<size_t> over_cap_count_{0};
+};
+
 // Logs all threads belonging to a run.
 class Logger {
  public:
+  // |max_threads_to_log| only sizes the initial swap request slots, which
+  // grow with the number of threads logging.
   Logger(std::chrono::duration<double> poll_period, size_t max_threads_to_log);
   ~Logger();
 
   void StartIOThread();
   void StopIOThread();
 
+  // |time_series| may be null.
   void StartLogging(std::ostream* summary, std::ostream* detail,
-                    std::ostream* accuracy, bool copy_detail_to_stdout,
-                    bool copy_summary_to_stdout);
+                    std::ostream* accuracy, std::ostream* time_series,
+                    bool copy_detail_to_stdout, bool copy_summary_to_stdout);
   void StopLogging();
 
-  void StartNewTrace(std::ostream* trace_out, PerfClock::time_point origin);
+  // Either may be null. Stopped by StopLogging.
+  void StartLatencyExport(std::ostream* latencies,
+                          std::ostream* latency_histogram);
+  bool ExportingLatencies() const {
+    return exporting_latencies_.load(std::memory_order_relaxed);
+  }
+
+  void StartNewTrace(std::ostream* trace_out, PerfClock::time_point origin,
+                     TraceFormat format);
   void StopTracing();
 
+  // In LoggingMode::EndOfTestOnly, RestartLatencyRecording stops the IOThread
+  // from processing logs until GetLatenciesBlocking is called.
+  void ApplyLogSettings(const LogSettings& log_settings);
+
   void LogContentionCounters();
 
-  void RestartLatencyRecording();
-  std::vector<QuerySampleLatency> GetLatenciesBlocking(size_t expected_count);
+  void RestartLatencyRecording(uint64_t first_sample_sequence_id,
+                               bool keep_latencies);
+  std::vector<QuerySampleLatency> GetLatenciesBlocking(
+      size_t expected_count, LatencyHistogram* histogram,
+      LatencyTimeSeries* time_series);
   QuerySampleLatency GetMaxLatencySoFar();
+  bool GetLastFullTimeSeriesWindow(std::chrono::nanoseconds now,
+                                   LatencyTimeSeries::WindowStats* stats);
+
+  // The memory holding log entries that haven't been processed yet.
+  size_t LogBufferBytesInUse() const {
+    return log_entry_chunk_pool_.BytesInUse();
+  }
 
  private:
   friend TlsLogger;
   friend TlsLoggerWrapper;
 
-  void RegisterTlsLogger(TlsLogger* tls_logger);
-  void UnRegisterTlsLogger(std::unique_ptr<TlsLogger> tls_logger);
+  // Returns a recycled TlsLogger if there is one.
+  TlsLogger* RegisterTlsLogger(std::function<void()> forced_detatch);
+  void UnRegisterTlsLogger(TlsLogger* tls_logger);
+  void GrowSwapRequestSlots(size_t slot_count);
   void RequestSwapBuffers(TlsLogger* tls_logger);
   void CollectTlsLoggerStats(TlsLogger* tls_logger);
 
+  LogEntryChunk* AcquireLogEntryChunk(bool droppable);
+  void ReleaseLogEntryChunk(LogEntryChunk* chunk);
+
+  void SetDeferIO(bool defer);
+  bool WaitWhileDeferringIO();
+  void ReportDeferredBytesExceeded();
+  std::chrono::duration<double> IOThreadPollPeriod();
+
+  // Called when there is work for the IOThread that shouldn't wait for the
+  // next poll.
+  void WakeIOThread();
+  void RecordIOThreadWake(bool woken);
+
   // Slow synchronous error logging for internals that may prevent
   // async logging from working.
   template <typename... Args>
@@ -477,7 +905,9 @@ class Logger {
     async_logger_.LogDetail(message, args...);
   }
 
-  TlsLogger* GetTlsLoggerThatRequestedSwap(size_t slot, size_t next_id);
+  struct SwapRequestTable;
+  TlsLogger* GetTlsLoggerThatRequestedSwap(SwapRequestTable* table,
+                                           size_t slot, uint64_t next_id);
   void GatherRetrySwapRequests(std::vector<TlsLogger*>* threads_to_swap);
   void GatherNewSwapRequests(std::vector<TlsLogger*>* threads_to_swap);
 
@@ -485,43 +915,104 @@ class Logger {
   // and I/O to the stream or file.
   void IOThread();
 
+  // Executes the entries of |threads_to_read| against |log|.
+  // Threads that couldn't be read are left in |threads_to_read| and the
+  // number of them is returned.
+  size_t ProcessEntries(AsyncLog* log,
+                        std::vector<TlsLogger*>* threads_to_read);
+  void ProcessEntriesInParallel();
+  // Resolves |serializer_thread_count_| for the current phase.
+  size_t SerializerThreadCount();
+  void SerializerThread(LogSerializer* serializer, uint64_t window);
+  void ResizeSerializers(size_t count);
+
   // Accessed by IOThead only.
-  const std::chrono::duration<double> poll_period_;
   AsyncLog async_logger_;
 
-  const size_t max_threads_to_log_;
+  std::atomic<bool> exporting_latencies_{false};
+
   std::thread io_thread_;
 
-  // Accessed by producers and IOThead during thread registration and
-  // destruction. Protected by io_thread_mutex_.
+  // Accessed by producers and IOThead during thread registration,
+  // destruction, and changes to the logging mode.
+  // Protected by io_thread_mutex_.
   std::mutex io_thread_mutex_;
-  std::condition_variable io_thread_cv_;
   bool keep_io_thread_alive_ = false;
-
-  std::mutex tls_loggers_registerd_mutex_;
-  std::unordered_set<TlsLogger*> tls_loggers_registerd_;
-
-  // Temporarily stores TlsLogger data for threads that have exited until
-  // all their log entries have been processed.
-  // Accessed by IOThread and producers as their threads exit.
-  std::mutex tls_logger_orphans_mutex_;
-  using OrphanContainer = std::list<std::unique_ptr<TlsLogger>>;
-  OrphanContainer tls_logger_orphans_;
+  std::chrono::duration<double> poll_period_;
+  LoggingMode log_mode_ = LoggingMode::AsyncPoll;
+  bool defer_io_ = false;
+  bool draining_latencies_ = false;
+  size_t serializer_thread_count_ = 0;  // 0 picks the count automatically.
+
+  // Accessed by producers and IOThread atomically.
+  IOThreadWakeup io_thread_wakeup_;
+  std::atomic<int64_t> wake_requested_time_ns_{0};
+
+  // Backs the TlsLogger buffers. Its memory use is also checked against
+  // |max_deferred_bytes_| while IO is deferred.
+  // Accessed by producers and consumers atomically.
+  LogEntryChunkPool log_entry_chunk_pool_;
+  std::atomic<size_t> max_deferred_bytes_{0};
+  std::atomic<bool> max_deferred_bytes_exceeded_{false};
+  std::atomic<bool> io_deferred_{false};  // Mirrors |defer_io_|.
+
+  // Every TlsLogger is in one of these lists. TlsLoggers move between them
+  // with splice, so thread churn doesn't allocate once enough TlsLoggers
+  // have been created.
+  // Orphans belong to threads that have exited and are kept until all
+  // their log entries have been processed, after which they are free to be
+  // reused by new threads.
+  // Accessed by producers as their threads start and exit, and by IOThread.
+  // Protected by tls_loggers_mutex_.
+  using TlsLoggerList = std::list<std::unique_ptr<TlsLogger>>;
+  std::mutex tls_loggers_mutex_;
+  TlsLoggerList tls_loggers_registerd_;
+  TlsLoggerList tls_logger_orphans_;
+  TlsLoggerList tls_loggers_free_;
+  size_t tls_logger_create_count_ = 0;
+  size_t tls_logger_reuse_count_ = 0;
+
+  // Swap requests are written to the table of the generation encoded in
+  // the high bits of their id. A new generation with a larger table starts
+  // whenever more TlsLoggers are alive than the current table was sized
+  // for. Tables are only written once and live as long as the Logger.
+  static constexpr size_t kSwapRequestGenerationShift = 56;
+  static constexpr size_t kMaxSwapRequestGenerations = 32;
+  struct SwapRequestTable {
+    explicit SwapRequestTable(size_t slot_count);
+    std::vector<std::atomic<uintptr_t>> slots;
+    // The number of ids used by the previous generation.
+    std::atomic<uint64_t> previous_generation_end{0};
+  };
+  std::unique_ptr<SwapRequestTable>
+      swap_request_tables_[kMaxSwapRequestGenerations];
+  // Protected by tls_loggers_mutex_.
+  uint64_t swap_request_generation_ = 0;
 
   // Accessed by producers and IOThead atomically.
-  std::atomic<size_t> swap_request_id_{0};
-  std::vector<std::atomic<uintptr_t>> thread_swap_request_slots_;
+  std::atomic<uint64_t> swap_request_id_{0};
 
   // Accessed by IOThead only.
-  size_t swap_request_id_read_{0};
+  uint64_t swap_request_id_read_{0};
   struct SlotRetry {
+    SwapRequestTable* table;
     size_t slot;
-    uintptr_t next_id;
+    uint64_t next_id;
   };
   std::vector<SlotRetry> swap_request_slots_to_retry_;
   std::vector<TlsLogger*> threads_to_swap_deferred_;
   std::vector<TlsLogger*> threads_to_read_;
-  std::vector<OrphanContainer::iterator> orphans_to_destroy_;
+  std::vector<TlsLoggerList::iterator> orphans_to_recycle_;
+  std::vector<std::unique_ptr<LogSerializer>> serializers_;
+
+  // Hands each processing window to the serializer threads.
+  // Protected by serializers_mutex_.
+  std::mutex serializers_mutex_;
+  std::condition_variable serializers_work_cv_;
+  std::condition_variable serializers_done_cv_;
+  uint64_t serializers_window_ = 0;
+  size_t serializers_busy_ = 0;
+  bool keep_serializers_alive_ = false;
 
   // Counts for retries related to the lock-free scheme.
   // Abnormally high counts could be an indicator of contention.
@@ -532,11 +1023,23 @@ class Logger {
   size_t start_reading_entries_retry_count_ = 0;
   size_t tls_total_log_cas_fail_count_ = 0;
   size_t tls_total_swap_buffers_slot_retry_count_ = 0;
+  size_t tls_total_dropped_entry_count_ = 0;
+
+  // Counts for how often and how promptly the IOThread wakes up.
+  // Access on IOThread only.
+  size_t io_thread_poll_wake_count_ = 0;
+  size_t io_thread_requested_wake_count_ = 0;
+  int64_t io_thread_wake_latency_total_ns_ = 0;
+  int64_t io_thread_wake_latency_max_ns_ = 0;
 };
 
 Logger& GlobalLogger();
 void Log(AsyncLogEntry&& entry);
 
+// Like Log, but the entry is dropped instead of exceeding the log memory
+// cap. Only for entries that just trace.
+void LogTrace(AsyncLogEntry&& entry);
+
 template <typename LambdaT>
 void LogError(LambdaT&& lambda) {
   Log([lambda = std::forward<LambdaT>(lambda),
@@ -556,6 +1059,14 @@ void LogDetail(LambdaT&& lambda) {
   });
 }
 
+// Makes sure everything logged so far reaches the log files without
+// blocking the caller. Called at the end of each phase of a test.
+inline void DrainLogSinks() {
+  Log([](AsyncLog& log) {
+    log.DeferUntilWritten([&log] { log.DrainSinks(); });
+  });
+}
+
 }  // namespace mlperf
 
 #endif  // MLPERF_LOADGEN_LOGGING_H_
@@ -47,6 +47,9 @@ class QuerySampleLibrary {
   //     SUTs that need the queries to be contiguous.
   // In all other scenarios:
   //   * A previously loaded sample will not be loaded again.
+  // With TestSettings::accuracy_double_buffered_loading, accuracy mode calls
+  // this on a separate thread, while the SUT processes the previous set and
+  // while that set is unloaded.
   virtual void LoadSamplesToRam(
       const std::vector<QuerySampleIndex>& samples) = 0;
 
@@ -33,6 +33,7 @@ generate_loadgen_version_definitions(generated_version_source_filename,
                                      ".")
 
 public_headers = [
+  "live_metrics.h",
   "loadgen.h",
   "mlperf_spec_constants.h",
   "query_sample.h",
@@ -42,6 +43,13 @@ public_headers = [
 ]
 
 lib_headers = [
+  "binary_trace.h",
+  "early_termination.h",
+  "latency_export.h",
+  "latency_histogram.h",
+  "latency_time_series.h",
+  "live_metrics_internal.h",
+  "log_sink.h",
   "logging.h",
   "test_settings_internal.h",
   "trace_generator.h",
@@ -50,7 +58,14 @@ lib_headers = [
 ]
 
 lib_sources = [
+  "binary_trace.cc",
+  "early_termination.cc",
+  "latency_export.cc",
+  "latency_histogram.cc",
+  "latency_time_series.cc",
+  "live_metrics_internal.cc",
   "loadgen.cc",
+  "log_sink.cc",
   "logging.cc",
   "mlperf_spec_constants.cc",
   "test_settings_internal.cc",
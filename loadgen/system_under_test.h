@@ -13,6 +13,8 @@ limitations under the License.
 #ifndef MLPERF_LOADGEN_SYSTEM_UNDER_TEST_H
 #define MLPERF_LOADGEN_SYSTEM_UNDER_TEST_H
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -20,6 +22,20 @@ limitations under the License.
 
 namespace mlperf {
 
+// The details of every sample of a performance run, as parallel arrays in
+// sample sequence order. Times are in nanoseconds since the start of the run.
+// The arrays point into the loadgen's buffers and are only valid during the
+// call to ReportLatencyDetails.
+struct LatencyReport {
+  size_t sample_count = 0;
+  const uint64_t* sequence_ids = nullptr;
+  const QuerySampleIndex* sample_indices = nullptr;
+  const int64_t* scheduled_ns = nullptr;
+  const int64_t* issued_ns = nullptr;
+  const int64_t* completed_ns = nullptr;
+  const QuerySampleLatency* latencies_ns = nullptr;
+};
+
 // SystemUnderTest provides the interface to:
 //  1) Allocate, preprocess, and issue queries.
 //  2) Warm up the system.
@@ -50,6 +66,17 @@ class SystemUnderTest {
   // Units are nanoseconds.
   virtual void ReportLatencyResults(
       const std::vector<QuerySampleLatency>& latencies_ns) = 0;
+
+  // SUTs that return false aren't given the raw latencies, so the loadgen
+  // doesn't keep a latency per sample in memory, unless
+  // exact_latency_percentiles is requested.
+  virtual bool WantsLatencyResults() const { return true; }
+
+  // SUTs that return true are also given the LatencyReport of each
+  // performance run, right after ReportLatencyResults. The loadgen only
+  // gathers the details for SUTs that want them.
+  virtual bool WantsLatencyDetails() const { return false; }
+  virtual void ReportLatencyDetails(const LatencyReport& /*report*/) {}
 };
 
 }  // namespace mlperf
@@ -42,8 +42,9 @@ enum class TestScenario {
   //       may request to have up to Q outstanding queries instead via
   //       |multi_stream_max_async_queries|. Should this be officially
   //       allowed?
-  // Final performance result is PASS if the 90 percentile latency is under
-  // a given threshold (model-specific) for a given N.
+  // Final performance result is PASS if the 90 percentile query latency is
+  // under a given threshold (model-specific) for a given N. A query's
+  // latency is that of its last sample.
   MultiStream,
 
   // MultiStreamFree is not an official MLPerf scenario, but is implemented
@@ -52,8 +53,8 @@ enum class TestScenario {
   // N is limited only by the latency target. Instead of attempting to issue
   // queries at a fixed rate, this scenario issues a query as soon as the P'th
   // oldest query completes.
-  // Final performance result is PASS if the 90th percentile latency is under
-  // a given threashold (model-specific) for a given value of N and P.
+  // Final performance result is PASS if the 90th percentile query latency is
+  // under a given threashold (model-specific) for a given value of N and P.
   MultiStreamFree,
 
   // Server sends queries with a single sample. Queries have a random poisson
@@ -128,6 +129,78 @@ struct TestSettings {
   uint64_t min_query_count = 100;
   uint64_t max_query_count = 0;  // 0: Infinity.
 
+  // Before the performance run, warm-up traffic is issued with the
+  // scenario's schedule until both |warmup_duration_ms| and
+  // |warmup_query_count| have been met. Its latencies aren't part of any
+  // statistic or validity check, and it drains before the performance run
+  // starts. Disabled if both are 0.
+  uint64_t warmup_duration_ms = 0;
+  uint64_t warmup_query_count = 0;
+
+  // Ignored in SubmissionRun mode. SingleStream and Offline only.
+  // Before the performance run, and after any warm-up, the SUT is measured
+  // for |calibration_duration_ms|. The measured latency or QPS replaces
+  // |single_stream_expected_latency_ns| or |offline_expected_qps|, so the
+  // performance run generates as many queries as it needs. Calibration
+  // starts from the requested value, so an Offline value that errs low keeps
+  // it short. The calibrated value is logged, to be set explicitly to
+  // reproduce the run.
+  bool calibrate_expected_performance = false;
+  uint64_t calibration_duration_ms = 1000;
+
+  // Accuracy mode loads the next loadable set while the current one is
+  // issued, instead of in between, so the SUT doesn't wait for the QSL.
+  // The QSL must have memory for two sets, and must allow LoadSamplesToRam
+  // to run concurrently with UnloadSamplesFromRam and with the SUT's use of
+  // the loaded samples.
+  bool accuracy_double_buffered_loading = false;
+
+  // Latency statistics come from a histogram, so percentiles are rounded up
+  // by less than 1%. Set this to compute them exactly from every latency,
+  // and to log how far off the histogram was.
+  bool exact_latency_percentiles = false;
+
+  // Ignored in SubmissionRun mode and by scenarios without a latency
+  // constraint.
+  // Ends the performance run as soon as the latencies so far show, with
+  // |early_termination_confidence|, whether the 90th percentile latency is
+  // within the target latency. Useful to explore settings quickly, but the
+  // result is INVALID unless min duration and min query count were met.
+  // The stopping point and verdict are logged.
+  bool early_termination = false;
+  double early_termination_confidence = 0.99;
+
+  // Ignored in SubmissionRun mode and by scenarios without a latency
+  // constraint.
+  // Ends the performance run as soon as more latencies are over the target
+  // latency than the 90th percentile allows out of every latency the run
+  // could collect, since the constraint can no longer be met. The result is
+  // INVALID, and the summary says why.
+  bool fail_fast = false;
+
+  // FindPeakPerformance-specific settings.
+  // The search probes the SUT with runs of
+  // |peak_performance_probe_duration_ms|. A probe ends early once it misses
+  // the latency constraint, either with |early_termination_confidence| or
+  // because more latencies are over the target than it can allow, as with
+  // |fail_fast|. It never ends early for meeting the constraint, since the
+  // SUT may only fall behind later in the probe. The search doubles or
+  // halves the load until one probe passes and another fails, then bisects
+  // between them until they are within |peak_performance_tolerance| of each
+  // other. The highest passing load is confirmed by a run with the min
+  // duration and min query count, which is the result of the test.
+  // The Server scenario searches QPS, starting from |server_target_qps|.
+  // The MultiStream scenario searches samples per query, starting from
+  // |multi_stream_samples_per_query|, up to the performance sample count.
+  // The load stays within |peak_performance_min_load| and
+  // |peak_performance_max_load|, in QPS or samples per query. The search
+  // fails if the peak is outside them, or if 3 probes in a row fail before
+  // any passes, so it should start at or below the expected peak.
+  uint64_t peak_performance_probe_duration_ms = 10000;
+  double peak_performance_tolerance = 0.01;
+  double peak_performance_min_load = 1;
+  double peak_performance_max_load = 1000000;
+
   // Random number generation seeds.
   // There are 3 separate seeds, so each dimension can be changed independently.
 
@@ -149,11 +222,26 @@ struct TestSettings {
 enum class LoggingMode {
   AsyncPoll,      // Logs are serialized and ouptut on an IOThread that polls
                   // for new logs at a fixed interval.
-  EndOfTestOnly,  // TODO: Logs are serialzied and output only at the end of
-                  // the test.
+  EndOfTestOnly,  // Logs are buffered in memory while queries are issued and
+                  // are only serialized and output once the loadgen starts
+                  // collecting latencies at the end of the run.
   Synchronous,    // TODO: Logs are serialized and output inline.
 };
 
+enum class TraceFormat {
+  ChromeJson,  // trace<suffix>.json, loadable by chrome://tracing directly.
+  Binary,      // trace<suffix>.bin, a compact encoding that is much cheaper
+               // to produce. Convert with tools/binary_trace_to_json.
+};
+
+enum class LogSinkType {
+  Stream,      // A std::ofstream, flushed every time the IOThread polls.
+  LargeBlock,  // Written in large blocks, only flushed at the end of each
+               // phase of the test and at the end of the test.
+  Direct,      // Like LargeBlock, but full blocks bypass the page cache via
+               // O_DIRECT where the file system supports it.
+};
+
 struct LogOutputSettings {
   // By default, the loadgen outputs its log files to outdir and
   // modifies the filenames of its logs with a prefix and suffix.
@@ -165,13 +253,61 @@ struct LogOutputSettings {
   bool prefix_with_datetime = false;
   bool copy_detail_to_stdout = false;
   bool copy_summary_to_stdout = false;
+  LogSinkType summary_sink = LogSinkType::Stream;
+  LogSinkType detail_sink = LogSinkType::Stream;
+  LogSinkType accuracy_sink = LogSinkType::Stream;
+  LogSinkType trace_sink = LogSinkType::Stream;
+  LogSinkType time_series_sink = LogSinkType::Stream;
+  LogSinkType latency_export_sink = LogSinkType::Stream;
 };
 
 struct LogSettings {
   LogOutputSettings log_output;
   LoggingMode log_mode = LoggingMode::AsyncPoll;
-  uint64_t log_mode_async_poll_interval_ms = 1000;  // TODO.
-  bool enable_trace = true;  // TODO: Allow trace to be disabled.
+  // The maximum time the IOThread sleeps between checks for new logs.
+  // Threads that log heavily wake the IOThread sooner, so this mostly
+  // affects how quickly sparse logs reach the output files. The default
+  // matches the IOThread's poll period from before this was configurable.
+  uint64_t log_mode_async_poll_interval_ms = 10;
+  // Only used when |log_mode| is EndOfTestOnly.
+  // Caps the memory reserved for buffering log entries until the end of the
+  // run. If the cap is exceeded, an error is flagged and logs are processed
+  // asynchronously for the remainder of the run so nothing is dropped.
+  // Up to |log_buffer_max_memory_mb| of it is allocated before the first
+  // run starts and kept until the process exits, so logging threads don't
+  // allocate during the run.
+  uint64_t log_mode_end_of_test_max_memory_mb = 1024;
+  // Caps the memory used to queue log entries for the IOThread across all
+  // threads. At the cap, trace events are dropped and counted in the detail
+  // log. Latencies and other log entries are never dropped, even if that
+  // means going over the cap.
+  uint64_t log_buffer_max_memory_mb = 1024;
+  // The part of |log_buffer_max_memory_mb| allocated before each run, plus
+  // an eighth more for entries that can't be dropped. Logging threads don't
+  // allocate log memory during a run, so the reserve also caps the memory
+  // for trace events until the run ends.
+  uint64_t log_buffer_reserved_memory_mb = 64;
+  // Disabling the trace removes the clock reads and log entries of every
+  // trace point. The trace file isn't written at all.
+  bool enable_trace = true;
+  TraceFormat trace_format = TraceFormat::ChromeJson;
+  // The number of threads that serialize log entries. Values above 1 let
+  // the IOThread keep up with many logging threads, at the cost of detail
+  // logs only being ordered by timestamp within each poll.
+  // 0 uses one thread, except that EndOfTestOnly serializes the logs
+  // buffered during a run with one thread per hardware thread once the
+  // run's latencies are being collected.
+  uint64_t log_serializer_thread_count = 0;
+  // The length of the windows of completion time that latency statistics
+  // are broken down into, in timeseries<suffix>.csv and in the live
+  // metrics, e.g. 1000. 0 disables the time series and doesn't write the
+  // file.
+  uint64_t time_series_window_ms = 0;
+  // Writes the scheduled, issued and completed times of every sample of
+  // each performance run to latencies<suffix>.bin, and the latency
+  // histogram of each run to latency_histogram<suffix>.json.
+  // See latency_export.h for the file layouts.
+  bool enable_latency_export = false;
 };
 
 }  // namespace mlperf
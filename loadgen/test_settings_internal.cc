@@ -31,6 +31,17 @@ TestSettingsInternal::TestSettingsInternal(
       min_query_count(requested.min_query_count),
       max_query_count(requested.max_query_count),
       min_sample_count(0),
+      early_termination(false),
+      early_termination_confidence(requested.early_termination_confidence),
+      fail_fast(false),
+      calibrate_expected_performance(false),
+      calibration_duration(requested.calibration_duration_ms),
+      peak_performance_probe_duration(
+          requested.peak_performance_probe_duration_ms),
+      peak_performance_tolerance(requested.peak_performance_tolerance),
+      peak_performance_min_load(requested.peak_performance_min_load),
+      peak_performance_max_load(requested.peak_performance_max_load),
+      peak_performance_probe(false),
       qsl_rng_seed(requested.qsl_rng_seed),
       sample_index_rng_seed(requested.sample_index_rng_seed),
       schedule_rng_seed(requested.schedule_rng_seed) {
@@ -99,6 +110,109 @@ TestSettingsInternal::TestSettingsInternal(
   }
 
   min_sample_count = min_query_count * samples_per_query;
+
+  const bool has_latency_constraint =
+      scenario == TestScenario::MultiStream ||
+      scenario == TestScenario::MultiStreamFree ||
+      scenario == TestScenario::Server;
+
+  // Early termination.
+  if (requested.early_termination) {
+    if (mode == TestMode::SubmissionRun) {
+      LogError([](AsyncLog &log) {
+        log.LogDetail("Early termination is not allowed in submission runs.");
+      });
+    } else if (!has_latency_constraint) {
+      LogError([](AsyncLog &log) {
+        log.LogDetail(
+            "Early termination only applies to scenarios with a latency "
+            "constraint.");
+      });
+    } else if (!(early_termination_confidence > 0.0 &&
+                 early_termination_confidence < 1.0)) {
+      LogError([confidence = early_termination_confidence](AsyncLog &log) {
+        log.LogDetail("Invalid value for early_termination_confidence.",
+                      "requested", confidence);
+      });
+    } else {
+      early_termination = true;
+    }
+  }
+
+  // Calibration.
+  if (requested.calibrate_expected_performance) {
+    if (mode == TestMode::SubmissionRun) {
+      LogError([](AsyncLog &log) {
+        log.LogDetail("Calibration is not allowed in submission runs.");
+      });
+    } else if (scenario != TestScenario::SingleStream &&
+               scenario != TestScenario::Offline) {
+      LogError([](AsyncLog &log) {
+        log.LogDetail(
+            "Calibration only applies to the SingleStream and Offline "
+            "scenarios.");
+      });
+    } else {
+      calibrate_expected_performance = true;
+    }
+    if (calibration_duration.count() == 0) {
+      calibration_duration = std::chrono::milliseconds(1000);
+      LogError([duration = calibration_duration](AsyncLog &log) {
+        log.LogDetail("Invalid value for calibration_duration_ms requested.",
+                      "requested", 0, "using", duration.count());
+      });
+    }
+  }
+
+  // Fail fast.
+  if (requested.fail_fast) {
+    if (mode == TestMode::SubmissionRun) {
+      LogError([](AsyncLog &log) {
+        log.LogDetail("Fail fast is not allowed in submission runs.");
+      });
+    } else if (!has_latency_constraint) {
+      LogError([](AsyncLog &log) {
+        log.LogDetail(
+            "Fail fast only applies to scenarios with a latency constraint.");
+      });
+    } else {
+      fail_fast = true;
+    }
+  }
+
+  // Peak performance search.
+  if (mode == TestMode::FindPeakPerformance) {
+    if (peak_performance_probe_duration.count() == 0) {
+      peak_performance_probe_duration = std::chrono::milliseconds(10000);
+      LogError([probe_duration = peak_performance_probe_duration](
+                   AsyncLog &log) {
+        log.LogDetail(
+            "Invalid value for peak_performance_probe_duration_ms requested.",
+            "requested", 0, "using", probe_duration.count());
+      });
+    }
+    if (!(peak_performance_tolerance > 0.0)) {
+      LogError([requested_tolerance = peak_performance_tolerance](
+                   AsyncLog &log) {
+        log.LogDetail("Invalid value for peak_performance_tolerance requested.",
+                      "requested", requested_tolerance, "using", 0.01);
+      });
+      peak_performance_tolerance = 0.01;
+    }
+    if (!(peak_performance_min_load > 0.0 &&
+          peak_performance_max_load >= peak_performance_min_load)) {
+      LogError([requested_min = peak_performance_min_load,
+                requested_max = peak_performance_max_load](AsyncLog &log) {
+        log.LogDetail(
+            "Invalid values for peak_performance_min_load and "
+            "peak_performance_max_load requested.",
+            "requested_min", requested_min, "requested_max", requested_max,
+            "using_min", 1, "using_max", 1000000);
+      });
+      peak_performance_min_load = 1;
+      peak_performance_max_load = 1000000;
+    }
+  }
 }
 
 std::string ToString(TestScenario scenario) {
@@ -172,6 +286,24 @@ void LogRequestedTestSettings(const TestSettings &s) {
     log.LogDetail("max_duration_ms : ", s.max_duration_ms);
     log.LogDetail("min_query_count : ", s.min_query_count);
     log.LogDetail("max_query_count : ", s.max_query_count);
+    log.LogDetail("warmup_duration_ms : ", s.warmup_duration_ms);
+    log.LogDetail("warmup_query_count : ", s.warmup_query_count);
+    log.LogDetail("calibrate_expected_performance : ",
+                  s.calibrate_expected_performance);
+    log.LogDetail("calibration_duration_ms : ", s.calibration_duration_ms);
+    log.LogDetail("accuracy_double_buffered_loading : ",
+                  s.accuracy_double_buffered_loading);
+    log.LogDetail("exact_latency_percentiles : ", s.exact_latency_percentiles);
+    log.LogDetail("early_termination : ", s.early_termination);
+    log.LogDetail("early_termination_confidence : ",
+                  s.early_termination_confidence);
+    log.LogDetail("fail_fast : ", s.fail_fast);
+    log.LogDetail("peak_performance_probe_duration_ms : ",
+                  s.peak_performance_probe_duration_ms);
+    log.LogDetail("peak_performance_tolerance : ",
+                  s.peak_performance_tolerance);
+    log.LogDetail("peak_performance_min_load : ", s.peak_performance_min_load);
+    log.LogDetail("peak_performance_max_load : ", s.peak_performance_max_load);
     log.LogDetail("qsl_rng_seed : ", s.qsl_rng_seed);
     log.LogDetail("sample_index_rng_seed : ", s.sample_index_rng_seed);
     log.LogDetail("schedule_rng_seed : ", s.schedule_rng_seed);
@@ -198,6 +330,28 @@ void TestSettingsInternal::LogEffectiveSettings() const {
     log.LogDetail("min_query_count : ", s.min_query_count);
     log.LogDetail("max_query_count : ", s.max_query_count);
     log.LogDetail("min_sample_count : ", s.min_sample_count);
+    log.LogDetail("early_termination : ", s.early_termination);
+    if (s.early_termination) {
+      log.LogDetail("early_termination_confidence : ",
+                    s.early_termination_confidence);
+    }
+    log.LogDetail("fail_fast : ", s.fail_fast);
+    log.LogDetail("calibrate_expected_performance : ",
+                  s.calibrate_expected_performance);
+    if (s.calibrate_expected_performance) {
+      log.LogDetail("calibration_duration (ms): ",
+                    s.calibration_duration.count());
+    }
+    if (s.mode == TestMode::FindPeakPerformance) {
+      log.LogDetail("peak_performance_probe_duration (ms): ",
+                    s.peak_performance_probe_duration.count());
+      log.LogDetail("peak_performance_tolerance : ",
+                    s.peak_performance_tolerance);
+      log.LogDetail("peak_performance_min_load : ",
+                    s.peak_performance_min_load);
+      log.LogDetail("peak_performance_max_load : ",
+                    s.peak_performance_max_load);
+    }
     log.LogDetail("qsl_rng_seed : ", s.qsl_rng_seed);
     log.LogDetail("sample_index_rng_seed : ", s.sample_index_rng_seed);
     log.LogDetail("schedule_rng_seed : ", s.schedule_rng_seed);
@@ -218,6 +372,26 @@ void TestSettingsInternal::LogSummary(AsyncLog &log) const {
   log.LogSummary("max_duration (ms): ", max_duration.count());
   log.LogSummary("min_query_count : ", min_query_count);
   log.LogSummary("max_query_count : ", max_query_count);
+  if (requested.warmup_duration_ms != 0 || requested.warmup_query_count != 0) {
+    log.LogSummary("warmup_duration_ms : ", requested.warmup_duration_ms);
+    log.LogSummary("warmup_query_count : ", requested.warmup_query_count);
+  }
+  if (early_termination) {
+    log.LogSummary("early_termination_confidence : ",
+                   early_termination_confidence);
+  }
+  if (fail_fast) {
+    log.LogSummary("fail_fast : ", fail_fast);
+  }
+  if (calibrate_expected_performance) {
+    if (scenario == TestScenario::SingleStream) {
+      log.LogSummary("Calibrated single_stream_expected_latency_ns : ",
+                     requested.single_stream_expected_latency_ns);
+    } else {
+      log.LogSummary("Calibrated offline_expected_qps : ",
+                     requested.offline_expected_qps);
+    }
+  }
   log.LogSummary("qsl_rng_seed : ", qsl_rng_seed);
   log.LogSummary("sample_index_rng_seed : ", sample_index_rng_seed);
   log.LogSummary("schedule_rng_seed : ", schedule_rng_seed);
@@ -56,6 +56,25 @@ struct TestSettingsInternal {
   uint64_t max_query_count;
   uint64_t min_sample_count;  // Offline only.
 
+  // Only true if the requested early termination applies.
+  bool early_termination;
+  double early_termination_confidence;
+  bool fail_fast;  // Only true if the requested fail fast applies.
+  // Only true if the requested calibration applies.
+  bool calibrate_expected_performance;
+  std::chrono::milliseconds calibration_duration;
+
+  std::chrono::milliseconds peak_performance_probe_duration;
+  double peak_performance_tolerance;
+  double peak_performance_min_load;
+  double peak_performance_max_load;
+  // Names the phase in the logs if its results are discarded, as for the
+  // warm-up. Empty for the phases that are measured.
+  std::string discarded_phase;
+  // Set for FindPeakPerformance probes, which only end early once the
+  // latency constraint is missed, and for which ending early isn't an error.
+  bool peak_performance_probe;
+
   uint64_t qsl_rng_seed;
   uint64_t sample_index_rng_seed;
   uint64_t schedule_rng_seed;
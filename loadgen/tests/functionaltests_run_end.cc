@@ -0,0 +1,158 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Checks that runs end when they should, rather than running for their whole
+// min duration or never ending. A regression in the latter hangs the test.
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../loadgen.h"
+#include "../query_sample_library.h"
+#include "../system_under_test.h"
+#include "../test_settings.h"
+
+constexpr size_t kSampleCount = 1000;
+
+// Completes every sample inline, after a delay.
+class SystemUnderTestDelayed : public mlperf::SystemUnderTest {
+ public:
+  explicit SystemUnderTestDelayed(std::chrono::milliseconds delay)
+      : delay_(delay) {}
+
+  const std::string& Name() const override { return name_; }
+
+  void IssueQuery(const std::vector<mlperf::QuerySample>& samples) override {
+    std::this_thread::sleep_for(delay_);
+    std::vector<mlperf::QuerySampleResponse> responses;
+    responses.reserve(samples.size());
+    for (auto s : samples) {
+      responses.push_back({s.id, 0, 0});
+    }
+    mlperf::QuerySamplesComplete(responses.data(), responses.size());
+  }
+
+  void FlushQueries() override {}
+
+  void ReportLatencyResults(
+      const std::vector<mlperf::QuerySampleLatency>& latencies_ns) override {}
+
+ private:
+  std::string name_{"DelayedSUT"};
+  const std::chrono::milliseconds delay_;
+};
+
+class QuerySampleLibraryNull : public mlperf::QuerySampleLibrary {
+ public:
+  const std::string& Name() const override { return name_; }
+
+  const size_t TotalSampleCount() override { return kSampleCount; }
+
+  const size_t PerformanceSampleCount() override { return kSampleCount; }
+
+  void LoadSamplesToRam(
+      const std::vector<mlperf::QuerySampleIndex>& samples) override {}
+
+  void UnloadSamplesFromRam(
+      const std::vector<mlperf::QuerySampleIndex>& samples) override {}
+
+ private:
+  std::string name_{"NullQSL"};
+};
+
+std::string ReadFile(const std::string& path) {
+  std::ifstream file(path);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  return contents.str();
+}
+
+// Fail fast must end the run from the latencies as they complete, even when
+// the logs are only processed at the end of the test.
+bool RunFailFastEndOfTestOnlyTest() {
+  SystemUnderTestDelayed sut(std::chrono::milliseconds(5));
+  QuerySampleLibraryNull qsl;
+
+  mlperf::TestSettings test_settings;
+  test_settings.scenario = mlperf::TestScenario::Server;
+  test_settings.mode = mlperf::TestMode::PerformanceOnly;
+  test_settings.server_target_qps = 100;
+  test_settings.server_target_latency_ns = 1000000;
+  test_settings.min_duration_ms = 20000;
+  test_settings.min_query_count = 100;
+  test_settings.fail_fast = true;
+
+  mlperf::LogSettings log_settings;
+  log_settings.log_output.suffix = "_fail_fast";
+  log_settings.log_mode = mlperf::LoggingMode::EndOfTestOnly;
+  log_settings.enable_trace = false;
+
+  auto start = std::chrono::steady_clock::now();
+  mlperf::StartTest(&sut, &qsl, test_settings, log_settings);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  const std::string summary = ReadFile("./mlperf_log_summary_fail_fast.txt");
+  const bool ended_early =
+      summary.find("the latency constraint can no longer be met") !=
+      std::string::npos;
+
+  std::cout << "Fail fast with EndOfTestOnly: " << elapsed.count() << "s, "
+            << (ended_early ? "ended early" : "did not end early") << ".\n";
+  return ended_early &&
+         elapsed.count() * 1000 < test_settings.min_duration_ms / 2;
+}
+
+// The last Offline accuracy query holds the samples left over from the
+// others. The run used to wait for a full query's worth of them.
+bool RunOfflineAccuracyRemainderTest() {
+  SystemUnderTestDelayed sut(std::chrono::milliseconds(0));
+  QuerySampleLibraryNull qsl;
+
+  mlperf::TestSettings test_settings;
+  test_settings.scenario = mlperf::TestScenario::Offline;
+  test_settings.mode = mlperf::TestMode::AccuracyOnly;
+  test_settings.offline_expected_qps = 1;
+  test_settings.min_query_count = 300;
+
+  mlperf::LogSettings log_settings;
+  log_settings.log_output.suffix = "_offline_remainder";
+  log_settings.enable_trace = false;
+
+  mlperf::StartTest(&sut, &qsl, test_settings, log_settings);
+
+  const std::string log =
+      ReadFile("./mlperf_log_accuracy_offline_remainder.json");
+  const char kQslIdx[] = "\"qsl_idx\" : ";
+  size_t entry_count = 0;
+  for (size_t i = log.find(kQslIdx); i != std::string::npos;
+       i = log.find(kQslIdx, i + 1)) {
+    entry_count++;
+  }
+
+  std::cout << "Offline accuracy remainder: " << entry_count
+            << " accuracy entries.\n";
+  return entry_count == kSampleCount;
+}
+
+int main(int argc, char* argv[]) {
+  bool fail_fast_passed = RunFailFastEndOfTestOnlyTest();
+  bool offline_remainder_passed = RunOfflineAccuracyRemainderTest();
+  bool passed = fail_fast_passed && offline_remainder_passed;
+  std::cout << (passed ? "PASSED" : "FAILED") << "\n";
+  return passed ? 0 : 1;
+}
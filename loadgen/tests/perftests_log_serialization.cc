@@ -0,0 +1,218 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Measures the CPU time the IOThread spends serializing the most common log
+// entries. Output goes to a stream that discards everything, so only the
+// formatting is measured. Each entry is also formatted through
+// std::ostream::operator<<, as AsyncLog did before LogLineWriter, for
+// comparison.
+
+#include <chrono>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../logging.h"
+
+namespace {
+
+class NullStreamBuf : public std::streambuf {
+ protected:
+  int overflow(int c) override { return c; }
+  std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+constexpr size_t kEventCount = 1000000;
+
+// Formats the same entries as AsyncLog through std::ostream::operator<<,
+// with payloads hex encoded a nibble at a time into a temporary string.
+class OstreamLog {
+ public:
+  OstreamLog(std::ostream* out, const std::string* pid_tid,
+             mlperf::PerfClock::time_point origin)
+      : out_(out), pid_tid_(pid_tid), origin_(origin) {}
+
+  template <typename... Args>
+  void TraceSample(const std::string& trace_name, uint64_t id,
+                   mlperf::PerfClock::time_point start,
+                   mlperf::PerfClock::time_point end, const Args... args) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    *out_ << "{\"name\": \"" << trace_name << "\", "
+          << "\"cat\": \"default\", "
+          << "\"ph\": \"b\", "
+          << "\"id\": " << id << ", " << *pid_tid_
+          << "\"ts\": " << (start - origin_).count() << ", "
+          << "\"args\": { ";
+    LogArgs(args...);
+    *out_ << " }},\n";
+
+    *out_ << "{ \"name\": \"" << trace_name << "\", "
+          << "\"cat\": \"default\", "
+          << "\"ph\": \"e\", "
+          << "\"id\": " << id << ", " << *pid_tid_
+          << "\"ts\": " << (end - origin_).count() << " },\n";
+  }
+
+  template <typename... Args>
+  void LogDetail(mlperf::PerfClock::time_point time,
+                 const std::string& message, const Args... args) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    *out_ << *pid_tid_ << "\"ts\": " << (time - origin_).count() << "ns : "
+          << message;
+    LogArgs(args...);
+    *out_ << "\n";
+  }
+
+  void LogAccuracy(uint64_t seq_id, mlperf::QuerySampleIndex qsl_idx,
+                   const mlperf::LogBinaryAsHexString& response) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    *out_ << (accuracy_needs_comma_ ? ",\n{ " : "\n{ ");
+    LogArgs("seq_id", seq_id, "qsl_idx", qsl_idx, "data", response);
+    *out_ << " }";
+    accuracy_needs_comma_ = true;
+  }
+
+ private:
+  static char Bin2Hex(uint8_t four_bits) {
+    char number = '0' + four_bits;
+    char letter = ('A' - 10) + four_bits;
+    return four_bits < 10 ? number : letter;
+  }
+
+  static std::string ArgValueTransform(
+      const mlperf::LogBinaryAsHexString& value) {
+    std::string hex;
+    hex.reserve(value.data->size() + 2);
+    hex.push_back('"');
+    for (auto b : *value.data) {
+      hex.push_back(Bin2Hex(b >> 4));
+      hex.push_back(Bin2Hex(b & 0x0F));
+    }
+    hex.push_back('"');
+    return hex;
+  }
+
+  template <typename T>
+  static const T& ArgValueTransform(const T& value) {
+    return value;
+  }
+
+  void LogArgs() {}
+
+  template <typename T>
+  void LogArgs(const std::string& arg_name, const T& arg_value) {
+    *out_ << "\"" << arg_name << "\" : " << ArgValueTransform(arg_value);
+  }
+
+  template <typename T, typename... Args>
+  void LogArgs(const std::string& arg_name, const T& arg_value,
+               const Args... args) {
+    *out_ << "\"" << arg_name << "\" : " << ArgValueTransform(arg_value)
+          << ", ";
+    LogArgs(args...);
+  }
+
+  std::mutex mutex_;
+  std::ostream* out_;
+  const std::string* pid_tid_;
+  mlperf::PerfClock::time_point origin_;
+  bool accuracy_needs_comma_ = false;
+};
+
+template <typename F>
+double CpuSecondsPerMillion(size_t event_count, F event) {
+  std::clock_t start = std::clock();
+  for (size_t i = 0; i < event_count; i++) {
+    event(i);
+  }
+  std::clock_t end = std::clock();
+  double cpu_seconds = static_cast<double>(end - start) / CLOCKS_PER_SEC;
+  return cpu_seconds * 1e6 / event_count;
+}
+
+template <typename Before, typename After>
+void Benchmark(const std::string& name, size_t event_count, Before before,
+               After after) {
+  double before_seconds = CpuSecondsPerMillion(event_count, before);
+  double after_seconds = CpuSecondsPerMillion(event_count, after);
+  std::cout << name << " : " << before_seconds << " -> " << after_seconds
+            << " CPU seconds per million events (ostream -> AsyncLog).\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  // Tracing would log each LogDetail to the global logger, which isn't
+  // running.
+  mlperf::SetTracingEnabled(false);
+
+  NullStreamBuf null_buf;
+  std::ostream null_stream(&null_buf);
+  const std::string pid_tid = "\"pid\": 1234, \"tid\": 140234567890, ";
+  const auto origin = mlperf::PerfClock::now();
+
+  mlperf::AsyncLog log;
+  log.SetLogFiles(&null_stream, &null_stream, &null_stream, nullptr, false,
+                  false, origin);
+  log.StartNewTrace(&null_stream, origin, mlperf::TraceFormat::ChromeJson);
+  log.SetCurrentTracePidTidString(&pid_tid);
+  OstreamLog ostream_log(&null_stream, &pid_tid, origin);
+
+  auto trace_sample = [&](auto* log, size_t i) {
+    auto start = origin + std::chrono::nanoseconds(i * 1000 + 123456789);
+    auto end = start + std::chrono::nanoseconds(1234567);
+    log->TraceSample("Sample", i, start, end, "sample_seq", i, "query_seq", i,
+                     "sample_idx", i % 1024, "issue_start_ns", int64_t(4321),
+                     "complete_ns", int64_t(1234567));
+  };
+  Benchmark(
+      "TraceSample", kEventCount,
+      [&](size_t i) { trace_sample(&ostream_log, i); },
+      [&](size_t i) { trace_sample(&log, i); });
+
+  Benchmark(
+      "LogDetail", kEventCount,
+      [&](size_t i) {
+        ostream_log.LogDetail(origin + std::chrono::nanoseconds(i * 1000),
+                              "Max latency so far: ", "latency_ns", i * 7,
+                              "qps", 1234.5678);
+      },
+      [&](size_t i) {
+        log.SetLogDetailTime(origin + std::chrono::nanoseconds(i * 1000));
+        log.LogDetail("Max latency so far: ", "latency_ns", i * 7, "qps",
+                      1234.5678);
+      });
+
+  std::vector<uint8_t> small_payload(64);
+  std::vector<uint8_t> large_payload(4096);
+  for (size_t i = 0; i < large_payload.size(); i++) {
+    large_payload[i] = static_cast<uint8_t>(i * 31);
+    small_payload[i % small_payload.size()] = static_cast<uint8_t>(i * 7);
+  }
+
+  auto log_accuracy = [&](auto* log, size_t i,
+                          std::vector<uint8_t>* payload) {
+    log->LogAccuracy(i, i % 1024, mlperf::LogBinaryAsHexString{payload});
+  };
+  Benchmark(
+      "LogAccuracy 64B", kEventCount,
+      [&](size_t i) { log_accuracy(&ostream_log, i, &small_payload); },
+      [&](size_t i) { log_accuracy(&log, i, &small_payload); });
+  Benchmark(
+      "LogAccuracy 4KiB", kEventCount / 10,
+      [&](size_t i) { log_accuracy(&ostream_log, i, &large_payload); },
+      [&](size_t i) { log_accuracy(&log, i, &large_payload); });
+
+  return 0;
+}
@@ -10,6 +10,9 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <chrono>
+#include <iostream>
+
 #include "../loadgen.h"
 #include "../query_sample_library.h"
 #include "../system_under_test.h"
@@ -21,6 +24,13 @@ class SystemUnderTestNull : public mlperf::SystemUnderTest {
   ~SystemUnderTestNull() override = default;
   const std::string& Name() const override { return name_; }
   void IssueQuery(const std::vector<mlperf::QuerySample>& samples) override {
+    auto now = std::chrono::high_resolution_clock::now();
+    if (issue_count_ == 0) {
+      first_issue_time_ = now;
+    }
+    last_issue_time_ = now;
+    issue_count_++;
+
     std::vector<mlperf::QuerySampleResponse> responses;
     responses.reserve(samples.size());
     for (auto s : samples) {
@@ -32,8 +42,22 @@ class SystemUnderTestNull : public mlperf::SystemUnderTest {
   void ReportLatencyResults(
       const std::vector<mlperf::QuerySampleLatency>& latencies_ns) override {}
 
+  // The average time between issues, which is dominated by loadgen overhead
+  // since this SUT completes queries immediately.
+  double NsPerQuery() const {
+    if (issue_count_ < 2) {
+      return 0;
+    }
+    std::chrono::duration<double, std::nano> span =
+        last_issue_time_ - first_issue_time_;
+    return span.count() / (issue_count_ - 1);
+  }
+
  private:
   std::string name_{"NullSUT"};
+  size_t issue_count_ = 0;
+  std::chrono::high_resolution_clock::time_point first_issue_time_;
+  std::chrono::high_resolution_clock::time_point last_issue_time_;
 };
 
 class QuerySampleLibraryNull : public mlperf::QuerySampleLibrary {
@@ -60,14 +84,35 @@ class QuerySampleLibraryNull : public mlperf::QuerySampleLibrary {
   std::string name_{"NullQSL"};
 };
 
-int main(int argc, char* argv[]) {
+double RunNullSutTest(bool enable_trace) {
   SystemUnderTestNull null_sut;
   QuerySampleLibraryNull null_qsl;
 
   mlperf::TestSettings test_settings;
+  // Issue a fixed number of queries, independent of duration.
+  // The expected latency is far below the loadgen overhead, so twice the
+  // 1ms min duration generates more queries than the run issues.
+  test_settings.min_duration_ms = 1;
+  test_settings.min_query_count = 100000;
+  test_settings.single_stream_expected_latency_ns = 10;
+
   mlperf::LogSettings log_settings;
   log_settings.log_output.prefix_with_datetime = true;
+  log_settings.log_output.suffix = enable_trace ? "_trace_on" : "_trace_off";
+  log_settings.enable_trace = enable_trace;
 
   mlperf::StartTest(&null_sut, &null_qsl, test_settings, log_settings);
+  return null_sut.NsPerQuery();
+}
+
+int main(int argc, char* argv[]) {
+  double ns_per_query_trace_on = RunNullSutTest(true);
+  double ns_per_query_trace_off = RunNullSutTest(false);
+
+  std::cout << "Loadgen overhead per query (ns):\n"
+            << "  Trace enabled  : " << ns_per_query_trace_on << "\n"
+            << "  Trace disabled : " << ns_per_query_trace_off << "\n"
+            << "  Savings        : "
+            << ns_per_query_trace_on - ns_per_query_trace_off << "\n";
   return 0;
 }
@@ -0,0 +1,183 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Completes every sample on its own short-lived thread, which is how
+// thread-per-request SUTs use the loadgen, and checks that no log entries
+// are lost as the loggers of the exited threads are recycled.
+
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../loadgen.h"
+#include "../query_sample_library.h"
+#include "../system_under_test.h"
+#include "../test_settings.h"
+
+constexpr size_t kSampleCount = 10000;
+constexpr size_t kMaxUnjoinedThreads = 4096;
+
+class SystemUnderTestThreadPerSample : public mlperf::SystemUnderTest {
+ public:
+  explicit SystemUnderTestThreadPerSample(std::chrono::milliseconds delay)
+      : delay_(delay) {}
+  ~SystemUnderTestThreadPerSample() override { JoinThreads(); }
+
+  const std::string& Name() const override { return name_; }
+
+  void IssueQuery(const std::vector<mlperf::QuerySample>& samples) override {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // The oldest threads have exited long ago. Joining them keeps the number
+    // of thread stacks in check.
+    while (threads_.size() > kMaxUnjoinedThreads) {
+      threads_.front().join();
+      threads_.pop_front();
+    }
+    for (auto s : samples) {
+      issued_count_++;
+      threads_.emplace_back([this, s] {
+        std::this_thread::sleep_for(delay_);
+        uint32_t data = static_cast<uint32_t>(s.index);
+        mlperf::QuerySampleResponse response{
+            s.id, reinterpret_cast<uintptr_t>(&data), sizeof(data)};
+        mlperf::QuerySamplesComplete(&response, 1);
+      });
+    }
+  }
+
+  void FlushQueries() override {}
+
+  void ReportLatencyResults(
+      const std::vector<mlperf::QuerySampleLatency>& latencies_ns) override {
+    reported_count_ = latencies_ns.size();
+  }
+
+  void JoinThreads() {
+    std::deque<std::thread> threads;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      threads.swap(threads_);
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+  size_t IssuedCount() const { return issued_count_; }
+  size_t ReportedCount() const { return reported_count_; }
+
+ private:
+  std::string name_{"ThreadPerSampleSUT"};
+  const std::chrono::milliseconds delay_;
+  std::mutex mutex_;
+  std::deque<std::thread> threads_;
+  size_t issued_count_ = 0;
+  size_t reported_count_ = 0;
+};
+
+class QuerySampleLibraryStress : public mlperf::QuerySampleLibrary {
+ public:
+  QuerySampleLibraryStress() = default;
+  ~QuerySampleLibraryStress() = default;
+  const std::string& Name() const override { return name_; }
+
+  const size_t TotalSampleCount() override { return kSampleCount; }
+
+  const size_t PerformanceSampleCount() override { return kSampleCount; }
+
+  void LoadSamplesToRam(
+      const std::vector<mlperf::QuerySampleIndex>& samples) override {}
+
+  void UnloadSamplesFromRam(
+      const std::vector<mlperf::QuerySampleIndex>& samples) override {}
+
+ private:
+  std::string name_{"StressQSL"};
+};
+
+// Every sample of the QSL must be in the accuracy log exactly once.
+bool RunAccuracyChurnTest() {
+  SystemUnderTestThreadPerSample sut(std::chrono::milliseconds(0));
+  QuerySampleLibraryStress qsl;
+
+  mlperf::TestSettings test_settings;
+  test_settings.scenario = mlperf::TestScenario::SingleStream;
+  test_settings.mode = mlperf::TestMode::AccuracyOnly;
+
+  mlperf::LogSettings log_settings;
+  log_settings.log_output.suffix = "_accuracy_churn";
+  log_settings.enable_trace = false;
+
+  mlperf::StartTest(&sut, &qsl, test_settings, log_settings);
+  sut.JoinThreads();
+
+  std::ifstream accuracy_log("./mlperf_log_accuracy_accuracy_churn.json");
+  std::stringstream accuracy;
+  accuracy << accuracy_log.rdbuf();
+  const std::string log = accuracy.str();
+
+  const char kQslIdx[] = "\"qsl_idx\" : ";
+  size_t entry_count = 0;
+  std::set<uint64_t> sample_indices;
+  for (size_t i = log.find(kQslIdx); i != std::string::npos;
+       i = log.find(kQslIdx, i + 1)) {
+    entry_count++;
+    sample_indices.insert(std::stoull(log.substr(i + strlen(kQslIdx), 32)));
+  }
+
+  std::cout << "Accuracy churn: " << sut.IssuedCount() << " threads, "
+            << entry_count << " accuracy entries, " << sample_indices.size()
+            << " unique samples.\n";
+  return sut.IssuedCount() == kSampleCount && entry_count == kSampleCount &&
+         sample_indices.size() == kSampleCount;
+}
+
+// Keeps thousands of threads alive at once, so the loadgen has to grow its
+// swap request slots while threads are logging.
+bool RunConcurrentChurnTest() {
+  SystemUnderTestThreadPerSample sut(std::chrono::milliseconds(200));
+  QuerySampleLibraryStress qsl;
+
+  mlperf::TestSettings test_settings;
+  test_settings.scenario = mlperf::TestScenario::Server;
+  test_settings.mode = mlperf::TestMode::PerformanceOnly;
+  test_settings.server_target_qps = 10000;
+  test_settings.min_duration_ms = 1000;
+  test_settings.min_query_count = kSampleCount;
+
+  mlperf::LogSettings log_settings;
+  log_settings.log_output.suffix = "_concurrent_churn";
+
+  mlperf::StartTest(&sut, &qsl, test_settings, log_settings);
+  sut.JoinThreads();
+
+  std::cout << "Concurrent churn: " << sut.IssuedCount() << " threads, "
+            << sut.ReportedCount() << " latencies.\n";
+  return sut.IssuedCount() >= kSampleCount &&
+         sut.ReportedCount() == sut.IssuedCount();
+}
+
+int main(int argc, char* argv[]) {
+  bool accuracy_passed = RunAccuracyChurnTest();
+  bool concurrent_passed = RunConcurrentChurnTest();
+  bool passed = accuracy_passed && concurrent_passed;
+  std::cout << (passed ? "PASSED" : "FAILED") << "\n";
+  return passed ? 0 : 1;
+}
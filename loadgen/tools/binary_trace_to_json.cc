@@ -0,0 +1,50 @@
+/* Copyright 2019 The MLPerf Authors. All Rights Reserved.
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Converts a trace recorded with TraceFormat::Binary to Chrome trace JSON.
+// Usage: binary_trace_to_json <trace.bin> [trace.json]
+// Writes to stdout if no output file is given.
+
+#include <fstream>
+#include <iostream>
+
+#include "../binary_trace.h"
+
+int main(int argc, char* argv[]) {
+  if (argc < 2 || argc > 3) {
+    std::cerr << "Usage: " << argv[0] << " <trace.bin> [trace.json]\n";
+    return 1;
+  }
+
+  std::ifstream in(argv[1], std::ios::in | std::ios::binary);
+  if (!in.good()) {
+    std::cerr << "Failed to open " << argv[1] << "\n";
+    return 1;
+  }
+
+  std::ofstream out_file;
+  std::ostream* out = &std::cout;
+  if (argc == 3) {
+    out_file.open(argv[2]);
+    if (!out_file.good()) {
+      std::cerr << "Failed to open " << argv[2] << "\n";
+      return 1;
+    }
+    out = &out_file;
+  }
+
+  if (!mlperf::ConvertBinaryTraceToJson(&in, out)) {
+    std::cerr << argv[1] << " is not a valid binary trace or is truncated.\n";
+    return 1;
+  }
+  return 0;
+}
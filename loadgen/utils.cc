@@ -12,11 +12,48 @@ limitations under the License.
 
 #include "utils.h"
 
+#include <cassert>
 #include <ctime>
 #include <sstream>
+#include <thread>
 
 namespace mlperf {
 
+namespace {
+
+// Partitions smaller than this aren't worth a thread.
+constexpr ptrdiff_t kMinParallelSelectSize = 1 << 20;
+
+using LatencyIterator = std::vector<QuerySampleLatency>::iterator;
+using RankIterator = std::vector<size_t>::const_iterator;
+
+// Selects the middle rank, which leaves the ranks below and above it to
+// independent partitions that are selected the same way.
+void MultiSelect(LatencyIterator values, LatencyIterator first,
+                 LatencyIterator last, RankIterator ranks_first,
+                 RankIterator ranks_last, size_t spare_threads) {
+  if (ranks_first == ranks_last) {
+    return;
+  }
+  RankIterator middle_rank = ranks_first + (ranks_last - ranks_first) / 2;
+  LatencyIterator nth = values + *middle_rank;
+  std::nth_element(first, nth, last);
+
+  if (spare_threads == 0 || last - first < kMinParallelSelectSize) {
+    MultiSelect(values, first, nth, ranks_first, middle_rank, 0);
+    MultiSelect(values, nth + 1, last, middle_rank + 1, ranks_last, 0);
+    return;
+  }
+  size_t upper_threads = (spare_threads - 1) / 2;
+  std::thread upper(MultiSelect, values, nth + 1, last, middle_rank + 1,
+                    ranks_last, upper_threads);
+  MultiSelect(values, first, nth, ranks_first, middle_rank,
+              spare_threads - 1 - upper_threads);
+  upper.join();
+}
+
+}  // namespace
+
 std::string DoubleToString(double value, int precision) {
   std::stringstream ss;
   ss.precision(precision);
@@ -33,4 +70,14 @@ std::string CurrentDateTimeISO8601() {
   return date_time_cstring;
 }
 
+void SelectOrderStatistics(std::vector<QuerySampleLatency>* values,
+                           std::vector<size_t> ranks) {
+  std::sort(ranks.begin(), ranks.end());
+  ranks.erase(std::unique(ranks.begin(), ranks.end()), ranks.end());
+  assert(ranks.empty() || ranks.back() < values->size());
+  size_t hardware_threads = std::thread::hardware_concurrency();
+  MultiSelect(values->begin(), values->begin(), values->end(), ranks.begin(),
+              ranks.end(), hardware_threads > 1 ? hardware_threads - 1 : 0);
+}
+
 }  // namespace mlperf
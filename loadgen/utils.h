@@ -16,6 +16,7 @@ limitations under the License.
 #include <algorithm>
 #include <chrono>
 #include <string>
+#include <vector>
 
 #include "query_sample.h"
 
@@ -52,6 +53,12 @@ std::string CurrentDateTimeISO8601();
 
 std::string DoubleToString(double value, int precision = 2);
 
+// Reorders |values| in linear time so the value at each index in |ranks| is
+// the one a full sort would put there. Large vectors are split between
+// threads once the first ranks have partitioned them.
+void SelectOrderStatistics(std::vector<QuerySampleLatency>* values,
+                           std::vector<size_t> ranks);
+
 }  // namespace mlperf
 
 #endif  // MLPERF_LOADGEN_UTILS_H